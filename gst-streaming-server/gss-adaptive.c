@@ -36,6 +36,10 @@
 #include "gss-soup.h"
 #include "gss-content.h"
 #include "gss-isom.h"
+#include "gss-fragment-cache.h"
+#include "gss-fd-cache.h"
+#include "gss-prefetch.h"
+#include "gss-uring.h"
 #include "gss-playready.h"
 #include "gss-sglist.h"
 #include "gss-utils.h"
@@ -45,6 +49,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <openssl/aes.h>
 
@@ -69,63 +74,99 @@
 
 #define GSS_ISM_SECOND 10000000
 
+/* Requests with more ranges than this get the whole file */
+#define GSS_ADAPTIVE_MAX_RANGES 16
+
 static void gss_adaptive_resource_get_manifest (GssTransaction * t,
     GssAdaptive * adaptive);
 static void gss_adaptive_resource_get_content (GssTransaction * t,
     GssAdaptive * adaptive);
-static void load_file (GssAdaptive * adaptive, const char *filename);
+static void load_files (GssAdaptive * adaptive, GPtrArray * filenames);
 static void gss_adaptive_async_assemble_chunk (GssTransaction * t,
     gpointer priv);
 static void gss_adaptive_async_assemble_chunk_finish (GssTransaction * t,
     gpointer priv);
+static void gss_adaptive_async_store_chunk (GssTransaction * t,
+    gpointer priv);
+static gboolean gss_adaptive_read_fragment_uring (GssTransaction * t,
+    GssAdaptiveQuery * query);
+static gboolean gss_adaptive_send_dash_range_mapped (GssTransaction * t,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level);
+static gboolean gss_adaptive_send_fragment_mapped (GssTransaction * t,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomFragment * fragment);
 static void gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv);
 static void gss_adaptive_dash_range_async_finish (GssTransaction * t,
     gpointer priv);
 
 
-static guint8 *
-gss_adaptive_assemble_chunk (GssTransaction * t, GssAdaptive * adaptive,
-    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+/* Reads the sample data described by @sglist from the source file of
+ * @level into @dest.  On error, sets an error response on @t, unless
+ * @t is NULL. */
+static gboolean
+gss_adaptive_read_samples (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssSGList * sglist, guint8 * dest)
 {
   GError *error = NULL;
-  guint8 *mdat_data;
+  GssFdCacheFile *file = NULL;
   int fd;
   gboolean ret;
 
-  g_return_val_if_fail (t != NULL, NULL);
-  g_return_val_if_fail (adaptive != NULL, NULL);
-  g_return_val_if_fail (level != NULL, NULL);
-  g_return_val_if_fail (fragment != NULL, NULL);
-
-  fd = open (level->filename, O_RDONLY);
+  if (adaptive->fd_cache) {
+    file = gss_fd_cache_open (adaptive->fd_cache, level->filename, NULL);
+    fd = file ? file->fd : -1;
+  } else {
+    fd = open (level->filename, O_RDONLY);
+  }
   if (fd < 0) {
     GST_WARNING ("failed to open \"%s\", error=\"%s\", broken manifest?",
         level->filename, g_strerror (errno));
-    gss_transaction_error_not_found (t,
-        "failed to open file (broken manifest?)");
-    return NULL;
+    if (t) {
+      gss_transaction_error_not_found (t,
+          "failed to open file (broken manifest?)");
+    }
+    return FALSE;
+  }
+
+  ret = gss_sglist_load (sglist, fd, dest, &error);
+  if (!ret) {
+    if (t)
+      gss_transaction_error_not_found (t, error->message);
+    g_error_free (error);
   }
 
+  if (file)
+    gss_fd_cache_release (adaptive->fd_cache, file);
+  else
+    close (fd);
+
+  return ret;
+}
+
+static guint8 *
+gss_adaptive_assemble_chunk (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+{
+  guint8 *mdat_data;
+
+  g_return_val_if_fail (adaptive != NULL, NULL);
+  g_return_val_if_fail (level != NULL, NULL);
+  g_return_val_if_fail (fragment != NULL, NULL);
+
   mdat_data = g_malloc (fragment->mdat_size);
 
   GST_WRITE_UINT32_BE (mdat_data, fragment->mdat_size);
   GST_WRITE_UINT32_LE (mdat_data + 4, GST_MAKE_FOURCC ('m', 'd', 'a', 't'));
 
-  ret = gss_sglist_load (fragment->sglist, fd, mdat_data + 8, &error);
-  if (!ret) {
-    gss_transaction_error_not_found (t, error->message);
-    g_error_free (error);
+  if (!gss_adaptive_read_samples (t, adaptive, level, fragment->sglist,
+          mdat_data + 8)) {
     g_free (mdat_data);
-    close (fd);
     return NULL;
   }
 
-  close (fd);
-
   return mdat_data;
 }
 
-
 typedef struct _ManifestQuery ManifestQuery;
 struct _ManifestQuery
 {
@@ -188,6 +229,47 @@ manifest_query_check_video (ManifestQuery * mq, GssAdaptiveLevel * level)
   return TRUE;
 }
 
+/* Appends the fragment durations of @level as a run-length encoded
+ * timeline: a run of fragments with the same duration becomes a single
+ * element with a repeat count.  DASH <S> elements count the repeats
+ * after the first fragment, Smooth Streaming <c> elements count all
+ * fragments of the run.  A start time is only given where it does not
+ * follow from the previous element. */
+static void
+append_timeline (GString * s, GssAdaptiveLevel * level, const char *indent,
+    gboolean is_smooth)
+{
+  guint64 next_timestamp = 0;
+  int i;
+  int n;
+
+  for (i = 0; i < level->n_fragments; i += n) {
+    GssIsomFragment *fragment;
+
+    fragment = gss_isom_track_get_fragment (level->track, i);
+    for (n = 1; i + n < level->n_fragments; n++) {
+      GssIsomFragment *next = gss_isom_track_get_fragment (level->track,
+          i + n);
+
+      if (next->duration != fragment->duration ||
+          next->timestamp != fragment->timestamp + n * fragment->duration)
+        break;
+    }
+
+    GSS_P ("%s<%s", indent, is_smooth ? "c" : "S");
+    if (fragment->timestamp != next_timestamp) {
+      GSS_P (" t=\"%" G_GUINT64_FORMAT "\"", fragment->timestamp);
+    }
+    GSS_P (" d=\"%" G_GUINT64_FORMAT "\"", fragment->duration);
+    if (n > 1) {
+      GSS_P (" r=\"%d\"", is_smooth ? n : n - 1);
+    }
+    GSS_A (" />\n");
+
+    next_timestamp = fragment->timestamp + n * fragment->duration;
+  }
+}
+
 static void
 gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
 {
@@ -202,8 +284,9 @@ gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
 
   GSS_A ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
 
+  /* version 2.2 added the r attribute to <c> */
   GSS_P
-      ("<SmoothStreamingMedia MajorVersion=\"2\" MinorVersion=\"1\" Duration=\"%"
+      ("<SmoothStreamingMedia MajorVersion=\"2\" MinorVersion=\"2\" Duration=\"%"
       G_GUINT64_FORMAT "\">\n", adaptive->duration);
   GSS_P
       ("  <StreamIndex Type=\"video\" Name=\"video\" Chunks=\"%d\" QualityLevels=\"%d\" MaxWidth=\"%d\" MaxHeight=\"%d\" "
@@ -224,16 +307,7 @@ gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
           level->video_height, level->codec_data);
     }
   }
-  {
-    GssAdaptiveLevel *level = &adaptive->video_levels[0];
-
-    for (i = 0; i < level->n_fragments; i++) {
-      GssIsomFragment *fragment;
-      fragment = gss_isom_track_get_fragment (level->track, i);
-      GSS_P ("    <c d=\"%" G_GUINT64_FORMAT "\" />\n",
-          (guint64) fragment->duration);
-    }
-  }
+  append_timeline (s, &adaptive->video_levels[0], "    ", TRUE);
   GSS_A ("  </StreamIndex>\n");
 
   show_audio_levels = 1;
@@ -250,16 +324,7 @@ gss_adaptive_resource_get_manifest (GssTransaction * t, GssAdaptive * adaptive)
         level->bitrate, level->audio_rate, level->codec_data);
     break;
   }
-  {
-    GssAdaptiveLevel *level = &adaptive->audio_levels[0];
-
-    for (i = 0; i < level->n_fragments; i++) {
-      GssIsomFragment *fragment;
-      fragment = gss_isom_track_get_fragment (level->track, i);
-      GSS_P ("    <c d=\"%" G_GUINT64_FORMAT "\" />\n",
-          (guint64) fragment->duration);
-    }
-  }
+  append_timeline (s, &adaptive->audio_levels[0], "    ", TRUE);
 
   GSS_A ("  </StreamIndex>\n");
   if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
@@ -425,6 +490,307 @@ gss_soup_message_body_append_clipped (SoupMessageBody * body,
   soup_message_body_append (body, use, data + offset, end - start);
 }
 
+/* Like gss_soup_message_body_append_clipped(), but the body references
+ * @data, which belongs to @adaptive, instead of copying it. */
+static void
+gss_adaptive_append_clipped_static (SoupMessageBody * body,
+    GssAdaptive * adaptive, const guint8 * data, guint64 start1,
+    guint64 size1, guint64 start2, guint64 size2)
+{
+  SoupBuffer *buffer;
+  guint64 start;
+  guint64 end;
+
+  start = MAX (start1, start2);
+  end = MIN (start1 + size1, start2 + size2);
+  if (start >= end)
+    return;
+
+  buffer = soup_buffer_new_with_owner (data + (start - start2), end - start,
+      gss_adaptive_ref (adaptive), (GDestroyNotify) gss_adaptive_unref);
+  soup_message_body_append_buffer (body, buffer);
+  soup_buffer_free (buffer);
+}
+
+static void
+gss_adaptive_append_mapped_range (SoupMessageBody * body,
+    GMappedFile * mapped, guint64 offset, guint64 size)
+{
+  guint8 *data = (guint8 *) g_mapped_file_get_contents (mapped) + offset;
+  gsize page_mask = sysconf (_SC_PAGESIZE) - 1;
+  guint8 *page = (guint8 *) ((gsize) data & ~page_mask);
+  SoupBuffer *buffer;
+
+  /* start reading ahead now rather than faulting the pages in one by
+   * one while the response is written */
+  madvise (page, data + size - page, MADV_WILLNEED);
+
+  buffer = soup_buffer_new_with_owner (data, size, g_mapped_file_ref (mapped),
+      (GDestroyNotify) g_mapped_file_unref);
+  soup_message_body_append_buffer (body, buffer);
+  soup_buffer_free (buffer);
+}
+
+/* Appends the part of [start, start + size) that overlaps the samples
+ * of @fragment, which are at @samples_start in the response, directly
+ * from the mapped source file.  Samples that are adjacent in the file
+ * share a buffer.  Returns FALSE if the sample table points outside
+ * the file. */
+static gboolean
+gss_adaptive_append_mapped_samples (SoupMessageBody * body,
+    GMappedFile * mapped, GssIsomFragment * fragment, guint64 start,
+    guint64 size, guint64 samples_start)
+{
+  GssSGList *sglist = fragment->sglist;
+  gsize length = g_mapped_file_get_length (mapped);
+  guint64 pos = samples_start;
+  guint64 run_offset = 0;
+  guint64 run_size = 0;
+  int i;
+
+  for (i = 0; i < sglist->n_chunks; i++) {
+    GssSGChunk *chunk = &sglist->chunks[i];
+    guint64 s;
+    guint64 e;
+
+    if (chunk->offset + chunk->size > length)
+      return FALSE;
+
+    s = MAX (start, pos);
+    e = MIN (start + size, pos + chunk->size);
+    if (s < e) {
+      guint64 offset = chunk->offset + (s - pos);
+
+      if (run_size > 0 && offset == run_offset + run_size) {
+        run_size += e - s;
+      } else {
+        if (run_size > 0)
+          gss_adaptive_append_mapped_range (body, mapped, run_offset,
+              run_size);
+        run_offset = offset;
+        run_size = e - s;
+      }
+    }
+    pos += chunk->size;
+  }
+  if (run_size > 0)
+    gss_adaptive_append_mapped_range (body, mapped, run_offset, run_size);
+
+  return TRUE;
+}
+
+static GMappedFile *
+gss_adaptive_map_level (GssAdaptive * adaptive, GssAdaptiveLevel * level)
+{
+  GssFdCacheFile *file;
+  GMappedFile *mapped;
+
+  file = gss_fd_cache_open (adaptive->fd_cache, level->filename, NULL);
+  if (file == NULL)
+    return NULL;
+  mapped = gss_fd_cache_file_map (adaptive->fd_cache, file);
+  gss_fd_cache_release (adaptive->fd_cache, file);
+
+  return mapped;
+}
+
+/* Whether sample data read from the file of @level still needs to be
+ * encrypted before it is sent. */
+static gboolean
+gss_adaptive_level_needs_encryption (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level)
+{
+  return adaptive->drm_type != GSS_DRM_CLEAR && !level->pre_encrypted;
+}
+
+static gboolean
+gss_adaptive_can_use_mmap (GssAdaptive * adaptive, GssAdaptiveLevel * level)
+{
+  return adaptive->use_mmap && adaptive->fd_cache != NULL &&
+      !gss_adaptive_level_needs_encryption (adaptive, level);
+}
+
+static char *
+gss_adaptive_get_level_key (GssAdaptive * adaptive, GssAdaptiveLevel * level)
+{
+  return g_strdup_printf ("%s/%s/%s/%s/%c%d", adaptive->content_id,
+      adaptive->version, gss_drm_get_drm_name (adaptive->drm_type),
+      gss_adaptive_stream_get_name (adaptive->stream_type),
+      gss_isom_track_is_video (level->track) ? 'v' : 'a', level->bitrate);
+}
+
+static char *
+gss_adaptive_get_fragment_key (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+{
+  char *level_key;
+  char *key;
+
+  level_key = gss_adaptive_get_level_key (adaptive, level);
+  key = g_strdup_printf ("%s/%d", level_key, fragment->index);
+  g_free (level_key);
+
+  return key;
+}
+
+/* Encrypts a freshly read mdat if needed, and offers it to the
+ * fragment cache.  Takes ownership of @data. */
+static SoupBuffer *
+gss_adaptive_store_fragment_payload (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment, const char *key,
+    guint8 * data, gboolean prefetched)
+{
+  if (gss_adaptive_level_needs_encryption (adaptive, level)) {
+    gss_playready_encrypt_samples (fragment, data, adaptive->content_key);
+  }
+
+  if (key) {
+    return gss_fragment_cache_insert_full (adaptive->fragment_cache, key,
+        data, fragment->mdat_size, prefetched);
+  }
+  return soup_buffer_new (SOUP_MEMORY_TAKE, data, fragment->mdat_size);
+}
+
+/* Returns the mdat of a fragment, including its 8 byte header and
+ * encrypted if the stream has DRM.  Popular fragments come from the
+ * fragment cache, so they are only read and encrypted once.  Called
+ * from worker threads. */
+static SoupBuffer *
+gss_adaptive_get_fragment_payload (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+{
+  SoupBuffer *buffer;
+  guint8 *data;
+  char *key = NULL;
+
+  if (adaptive->fragment_cache) {
+    key = gss_adaptive_get_fragment_key (adaptive, level, fragment);
+    buffer = gss_fragment_cache_lookup (adaptive->fragment_cache, key);
+    if (buffer) {
+      g_free (key);
+      return buffer;
+    }
+  }
+
+  data = gss_adaptive_assemble_chunk (t, adaptive, level, fragment);
+  if (data == NULL) {
+    g_free (key);
+    return NULL;
+  }
+
+  buffer = gss_adaptive_store_fragment_payload (adaptive, level, fragment,
+      key, data, FALSE);
+  g_free (key);
+
+  return buffer;
+}
+
+typedef struct _GssAdaptivePrefetch GssAdaptivePrefetch;
+struct _GssAdaptivePrefetch
+{
+  GssAdaptive *adaptive;
+  GssAdaptiveLevel *level;
+  GssIsomFragment *fragment;
+};
+
+static void
+gss_adaptive_prefetch_free (GssAdaptivePrefetch * prefetch)
+{
+  gss_adaptive_unref (prefetch->adaptive);
+  g_free (prefetch);
+}
+
+/* Reads and encrypts a fragment into the fragment cache, ahead of the
+ * request for it.  Called from the prefetch threads. */
+static void
+gss_adaptive_prefetch_fragment (GssAdaptivePrefetch * prefetch)
+{
+  GssAdaptive *adaptive = prefetch->adaptive;
+  SoupBuffer *buffer;
+  guint8 *data;
+  char *key;
+
+  key = gss_adaptive_get_fragment_key (adaptive, prefetch->level,
+      prefetch->fragment);
+  if (gss_fragment_cache_contains (adaptive->fragment_cache, key)) {
+    g_free (key);
+    return;
+  }
+
+  data = gss_adaptive_assemble_chunk (NULL, adaptive, prefetch->level,
+      prefetch->fragment);
+  if (data) {
+    /* The cache would normally turn away a fragment nobody has asked
+     * for yet, but this one is about to be requested. */
+    buffer = gss_adaptive_store_fragment_payload (adaptive,
+        prefetch->level, prefetch->fragment, key, data, TRUE);
+    soup_buffer_free (buffer);
+  }
+  g_free (key);
+}
+
+/* Notes that the client of @t requested fragment @index of @level, and
+ * if it is reading the level in sequence, loads the next fragment into
+ * the fragment cache in the background. */
+static void
+gss_adaptive_prefetch_next (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, int index)
+{
+  GssAdaptivePrefetch *prefetch = NULL;
+  GssIsomFragment *next = NULL;
+  char *level_key;
+  char *session_key;
+
+  if (adaptive->prefetch == NULL || adaptive->fragment_cache == NULL)
+    return;
+
+  if (index + 1 < level->track->n_fragments) {
+    next = gss_isom_track_get_fragment (level->track, index + 1);
+    prefetch = g_malloc0 (sizeof (GssAdaptivePrefetch));
+    prefetch->adaptive = gss_adaptive_ref (adaptive);
+    prefetch->level = level;
+    prefetch->fragment = next;
+  }
+
+  level_key = gss_adaptive_get_level_key (adaptive, level);
+  session_key = g_strdup_printf ("%s %s",
+      soup_client_context_get_host (t->client), level_key);
+  gss_prefetch_request (adaptive->prefetch, session_key, index,
+      next ? next->mdat_size : 0,
+      next ? (GssPrefetchFunc) gss_adaptive_prefetch_fragment : NULL,
+      prefetch, (GDestroyNotify) gss_adaptive_prefetch_free);
+  g_free (session_key);
+  g_free (level_key);
+}
+
+/* Returns the index of the fragment that byte @offset of the DASH
+ * representation of @level belongs to, or -1 if it is in the header. */
+static int
+gss_adaptive_dash_get_fragment_index (GssAdaptiveLevel * level,
+    guint64 offset)
+{
+  GssIsomTrack *track = level->track;
+  guint64 header_size = track->dash_header_and_sidx_size;
+  int lo = 0;
+  int hi = track->n_fragments;
+
+  if (offset < header_size)
+    return -1;
+
+  /* last fragment starting at or before offset */
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (header_size + track->fragments[mid]->offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
 static void
 gss_adaptive_resource_get_dash_range_fragment (GssTransaction * t,
     GssAdaptive * adaptive, const char *path)
@@ -471,10 +837,13 @@ gss_adaptive_resource_get_dash_range_fragment (GssTransaction * t,
   have_range = soup_message_headers_get_ranges (t->msg->request_headers,
       level->track->dash_size, &ranges, &n_ranges);
 
-  if (have_range) {
-    if (n_ranges != 1) {
-      GST_ERROR ("too many ranges");
-    }
+  if (have_range && n_ranges > GSS_ADAPTIVE_MAX_RANGES) {
+    GST_DEBUG ("%s: %d ranges, sending everything", path, n_ranges);
+    soup_message_headers_free_ranges (t->msg->request_headers, ranges);
+    have_range = FALSE;
+  }
+
+  if (have_range && n_ranges == 1) {
     start = ranges[0].start;
     end = ranges[0].end + 1;
   } else {
@@ -486,12 +855,12 @@ gss_adaptive_resource_get_dash_range_fragment (GssTransaction * t,
   t->end = end;
 
   if (have_range) {
-    soup_message_headers_set_content_range (t->msg->response_headers,
-        ranges[0].start, ranges[0].end, level->track->dash_size);
+    if (n_ranges == 1) {
+      soup_message_headers_set_content_range (t->msg->response_headers,
+          ranges[0].start, ranges[0].end, level->track->dash_size);
+    }
 
     soup_message_set_status (t->msg, SOUP_STATUS_PARTIAL_CONTENT);
-
-    soup_message_headers_free_ranges (t->msg->response_headers, ranges);
   } else {
     soup_message_set_status (t->msg, SOUP_STATUS_OK);
   }
@@ -499,36 +868,164 @@ gss_adaptive_resource_get_dash_range_fragment (GssTransaction * t,
   soup_message_headers_replace (t->msg->response_headers, "Content-Type",
       (path[0] == 'v') ? "video/mp4" : "audio/mp4");
 
+  if ((!have_range || n_ranges == 1) &&
+      gss_adaptive_can_use_mmap (adaptive, level) &&
+      gss_adaptive_send_dash_range_mapped (t, adaptive, level)) {
+    if (have_range)
+      soup_message_headers_free_ranges (t->msg->request_headers, ranges);
+    return;
+  }
+
   {
     GssAdaptiveQuery *query;
 
+    /* players read on-demand representations one fragment per range */
+    if (have_range && n_ranges == 1 && level->track->n_fragments > 0) {
+      int index = gss_adaptive_dash_get_fragment_index (level, end - 1);
+
+      if (index >= 0)
+        gss_adaptive_prefetch_next (t, adaptive, level, index);
+    }
+
     soup_server_pause_message (t->soupserver, t->msg);
 
     query = g_malloc0 (sizeof (GssAdaptiveQuery));
-    query->adaptive = adaptive;
+    query->adaptive = gss_adaptive_ref (adaptive);
     query->level = level;
+    if (have_range && n_ranges > 1) {
+      /* answered with a multipart/byteranges body */
+      query->n_ranges = n_ranges;
+      query->ranges = g_memdup (ranges, n_ranges * sizeof (SoupRange));
+    }
+    if (have_range)
+      soup_message_headers_free_ranges (t->msg->request_headers, ranges);
 
     gss_transaction_process_async (t, gss_adaptive_dash_range_async,
         gss_adaptive_dash_range_async_finish, query);
   }
 }
 
-static void
-gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv)
+/* Builds the response for clear or pre-encrypted content from the
+ * mapped file and the prebuilt headers, without copying or blocking a
+ * worker thread. */
+static gboolean
+gss_adaptive_send_dash_range_mapped (GssTransaction * t,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level)
 {
-  GssAdaptiveQuery *query = priv;
+  SoupMessageBody *body = t->msg->response_body;
+  GMappedFile *mapped;
   guint64 offset;
   guint64 n_bytes;
   guint64 header_size;
-  GssAdaptiveLevel *level = query->level;
+  gboolean ret = TRUE;
   int i;
 
+  mapped = gss_adaptive_map_level (adaptive, level);
+  if (mapped == NULL)
+    return FALSE;
+
   offset = t->start;
   n_bytes = t->end - t->start;
+  header_size = level->track->dash_header_and_sidx_size;
+
+  gss_adaptive_append_clipped_static (body, adaptive,
+      level->track->dash_header_data, offset, n_bytes, 0, header_size);
+
+  for (i = 0; i < level->track->n_fragments; i++) {
+    GssIsomFragment *fragment = level->track->fragments[i];
+    guint64 samples_start;
+
+    if (offset + n_bytes <= fragment->offset)
+      break;
+
+    gss_adaptive_append_clipped_static (body, adaptive, fragment->moof_data,
+        offset, n_bytes, header_size + fragment->offset, fragment->moof_size);
+
+    samples_start = header_size + fragment->offset + fragment->moof_size;
+    if (ranges_overlap (offset, n_bytes, samples_start,
+            fragment->mdat_size - 8)) {
+      ret = gss_adaptive_append_mapped_samples (body, mapped, fragment,
+          offset, n_bytes, samples_start);
+      if (!ret)
+        break;
+    }
+  }
+
+  g_mapped_file_unref (mapped);
+
+  if (!ret) {
+    GST_WARNING ("samples outside of file %s", level->filename);
+    soup_message_body_truncate (body);
+    return FALSE;
+  }
+  soup_message_body_complete (body);
+
+  return TRUE;
+}
+
+/* Appends the bytes [start, start + size) of the sample data of
+ * @fragment (not counting the mdat header).  Reads and encrypts only
+ * those bytes, unless the whole payload is wanted or already cached.
+ * Called from worker threads. */
+static gboolean
+gss_adaptive_append_fragment_range (GssTransaction * t, SoupMessageBody * body,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level,
+    GssIsomFragment * fragment, guint64 start, guint64 size)
+{
+  SoupBuffer *buffer = NULL;
+  SoupBuffer *sub;
+  GssSGList *sglist;
+  guint8 *data;
+
+  if (start == 0 && size == fragment->mdat_size - 8) {
+    buffer = gss_adaptive_get_fragment_payload (t, adaptive, level, fragment);
+    if (buffer == NULL)
+      return FALSE;
+  } else if (adaptive->fragment_cache) {
+    char *key = gss_adaptive_get_fragment_key (adaptive, level, fragment);
+
+    buffer = gss_fragment_cache_lookup (adaptive->fragment_cache, key);
+    g_free (key);
+  }
+  if (buffer) {
+    sub = soup_buffer_new_subbuffer (buffer, 8 + start, size);
+    soup_message_body_append_buffer (body, sub);
+    soup_buffer_free (sub);
+    soup_buffer_free (buffer);
+    return TRUE;
+  }
+
+  sglist = gss_sglist_new_slice (fragment->sglist, start, size);
+  data = g_malloc (size);
+  if (!gss_adaptive_read_samples (t, adaptive, level, sglist, data)) {
+    gss_sglist_free (sglist);
+    g_free (data);
+    return FALSE;
+  }
+  gss_sglist_free (sglist);
+
+  if (gss_adaptive_level_needs_encryption (adaptive, level)) {
+    gss_playready_encrypt_range (fragment, data, start, size,
+        adaptive->content_key);
+  }
+  soup_message_body_append (body, SOUP_MEMORY_TAKE, data, size);
+
+  return TRUE;
+}
+
+/* Appends bytes [offset, offset + n_bytes) of the DASH representation
+ * of @level to @body. */
+static gboolean
+gss_adaptive_dash_append_range (GssTransaction * t, SoupMessageBody * body,
+    GssAdaptive * adaptive, GssAdaptiveLevel * level, guint64 offset,
+    guint64 n_bytes)
+{
+  guint64 header_size;
+  int i;
 
   if (ranges_overlap (offset, n_bytes, 0,
           level->track->dash_header_and_sidx_size)) {
-    gss_soup_message_body_append_clipped (t->msg->response_body,
+    gss_soup_message_body_append_clipped (body,
         SOUP_MEMORY_COPY, level->track->dash_header_data,
         offset, n_bytes, 0, level->track->dash_header_and_sidx_size);
   }
@@ -536,35 +1033,80 @@ gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv)
 
   for (i = 0; i < level->track->n_fragments; i++) {
     GssIsomFragment *fragment = level->track->fragments[i];
-    guint8 *mdat_data;
+    guint64 samples_start;
+    guint64 samples_size;
 
     if (offset + n_bytes <= fragment->offset)
       break;
 
     if (ranges_overlap (offset, n_bytes, header_size + fragment->offset,
             fragment->moof_size)) {
-      gss_soup_message_body_append_clipped (t->msg->response_body,
+      gss_soup_message_body_append_clipped (body,
           SOUP_MEMORY_COPY, fragment->moof_data,
           offset, n_bytes, header_size + fragment->offset, fragment->moof_size);
     }
 
-    if (ranges_overlap (offset, n_bytes, header_size + fragment->offset +
-            fragment->moof_size, fragment->mdat_size)) {
-      mdat_data = gss_adaptive_assemble_chunk (t, query->adaptive, level,
-          fragment);
-      if (query->adaptive->drm_type != GSS_DRM_CLEAR) {
-        gss_playready_encrypt_samples (fragment, mdat_data,
-            query->adaptive->content_key);
-      }
+    samples_start = header_size + fragment->offset + fragment->moof_size;
+    samples_size = fragment->mdat_size - 8;
+    if (ranges_overlap (offset, n_bytes, samples_start, samples_size)) {
+      guint64 start = MAX (offset, samples_start);
+      guint64 end = MIN (offset + n_bytes, samples_start + samples_size);
 
-      gss_soup_message_body_append_clipped (t->msg->response_body,
-          SOUP_MEMORY_COPY, mdat_data + 8,
-          offset, n_bytes, header_size + fragment->offset + fragment->moof_size,
-          fragment->mdat_size - 8);
-      g_free (mdat_data);
+      if (!gss_adaptive_append_fragment_range (t, body, adaptive, level,
+              fragment, start - samples_start, end - start))
+        return FALSE;
     }
   }
 
+  return TRUE;
+}
+
+static void
+gss_adaptive_dash_range_async (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+  GssAdaptiveLevel *level = query->level;
+  SoupMultipart *multipart;
+  int i;
+
+  if (query->n_ranges == 0) {
+    gss_adaptive_dash_append_range (t, t->msg->response_body,
+        query->adaptive, level, t->start, t->end - t->start);
+    return;
+  }
+
+  multipart = soup_multipart_new ("multipart/byteranges");
+  for (i = 0; i < query->n_ranges; i++) {
+    SoupRange *range = &query->ranges[i];
+    SoupMessageHeaders *headers;
+    SoupMessageBody *body;
+    SoupBuffer *buffer;
+    gboolean ret;
+
+    body = soup_message_body_new ();
+    ret = gss_adaptive_dash_append_range (t, body, query->adaptive, level,
+        range->start, range->end + 1 - range->start);
+    if (!ret) {
+      soup_message_body_free (body);
+      soup_multipart_free (multipart);
+      return;
+    }
+
+    headers = soup_message_headers_new (SOUP_MESSAGE_HEADERS_MULTIPART);
+    soup_message_headers_replace (headers, "Content-Type",
+        gss_isom_track_is_video (level->track) ? "video/mp4" : "audio/mp4");
+    soup_message_headers_set_content_range (headers, range->start,
+        range->end, level->track->dash_size);
+    buffer = soup_message_body_flatten (body);
+    soup_multipart_append_part (multipart, headers, buffer);
+    soup_buffer_free (buffer);
+    soup_message_headers_free (headers);
+    soup_message_body_free (body);
+  }
+
+  soup_multipart_to_message (multipart, t->msg->response_headers,
+      t->msg->response_body);
+  soup_multipart_free (multipart);
 }
 
 static void
@@ -574,9 +1116,86 @@ gss_adaptive_dash_range_async_finish (GssTransaction * t, gpointer priv)
 
   soup_message_body_complete (t->msg->response_body);
   soup_server_unpause_message (t->soupserver, t->msg);
+  gss_adaptive_unref (query->adaptive);
+  g_free (query->ranges);
   g_free (query);
 }
 
+/* Returns the duration of all fragments of @levels but the last, which
+ * may be shorter, or 0 if it is not the same throughout, or if the
+ * levels are not fragmented alike. */
+static guint64
+get_constant_duration (GssAdaptiveLevel * levels, int n_levels)
+{
+  guint64 duration;
+  int i;
+  int j;
+
+  if (n_levels == 0 || levels[0].n_fragments == 0)
+    return 0;
+
+  duration = gss_isom_track_get_fragment (levels[0].track, 0)->duration;
+  for (j = 0; j < n_levels; j++) {
+    GssAdaptiveLevel *level = &levels[j];
+
+    if (level->n_fragments != levels[0].n_fragments)
+      return 0;
+    for (i = 0; i < level->n_fragments; i++) {
+      GssIsomFragment *fragment;
+
+      fragment = gss_isom_track_get_fragment (level->track, i);
+      if (fragment->timestamp != i * duration)
+        return 0;
+      if (i < level->n_fragments - 1 ? fragment->duration != duration :
+          fragment->duration > duration)
+        return 0;
+    }
+  }
+
+  return duration;
+}
+
+/* Fragments with a constant duration are addressed by number, so that
+ * the template needs no timeline at all.  Otherwise, fragments are
+ * addressed by start time, listed in a compact SegmentTimeline. */
+static void
+append_segment_template (GString * s, GssAdaptive * adaptive, gboolean video)
+{
+  GssAdaptiveLevel *levels;
+  const char *stream;
+  guint64 duration;
+  int n_levels;
+
+  if (video) {
+    levels = adaptive->video_levels;
+    n_levels = adaptive->n_video_levels;
+    stream = "video";
+  } else {
+    levels = adaptive->audio_levels;
+    n_levels = adaptive->n_audio_levels;
+    stream = "audio";
+  }
+
+  duration = get_constant_duration (levels, n_levels);
+  if (duration) {
+    GSS_P ("    <SegmentTemplate timescale=\"10000000\" "
+        "duration=\"%" G_GUINT64_FORMAT "\" startNumber=\"1\" "
+        "media=\"content?stream=%s&amp;bitrate=$Bandwidth$&amp;number=$Number$\" "
+        "initialization=\"content?stream=%s&amp;bitrate=$Bandwidth$&amp;start_time=init\" />\n",
+        duration, stream, stream);
+    return;
+  }
+
+  GSS_P ("    <SegmentTemplate timescale=\"10000000\" "
+      "media=\"content?stream=%s&amp;bitrate=$Bandwidth$&amp;start_time=$Time$\" "
+      "initialization=\"content?stream=%s&amp;bitrate=$Bandwidth$&amp;start_time=init\">\n",
+      stream, stream);
+  GSS_A ("      <SegmentTimeline>\n");
+  append_timeline (s, &levels[0], "        ", FALSE);
+  GSS_A ("      </SegmentTimeline>\n");
+  GSS_A ("    </SegmentTemplate>\n");
+}
+
 static void
 gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
     GssAdaptive * adaptive)
@@ -612,22 +1231,7 @@ gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
       "segmentAlignment=\"true\" "
       "contentType=\"audio\" " "mimeType=\"audio/mp4\" " "lang=\"en\">\n");
   append_content_protection (t, adaptive, mq.auth_token);
-  GSS_A ("    <SegmentTemplate timescale=\"10000000\" "
-      "media=\"content?stream=audio&amp;bitrate=$Bandwidth$&amp;start_time=$Time$\" "
-      "initialization=\"content?stream=audio&amp;bitrate=$Bandwidth$&amp;start_time=init\">\n");
-  GSS_A ("      <SegmentTimeline>\n");
-  {
-    GssAdaptiveLevel *level = &adaptive->audio_levels[0];
-
-    for (i = 0; i < level->n_fragments; i++) {
-      GssIsomFragment *fragment;
-      fragment = gss_isom_track_get_fragment (level->track, i);
-      GSS_P ("        <S d=\"%" G_GUINT64_FORMAT "\" />\n",
-          (guint64) fragment->duration);
-    }
-  }
-  GSS_A ("      </SegmentTimeline>\n");
-  GSS_A ("    </SegmentTemplate>\n");
+  append_segment_template (s, adaptive, FALSE);
   for (i = 0; i < adaptive->n_audio_levels; i++) {
     GssAdaptiveLevel *level = &adaptive->audio_levels[i];
 
@@ -646,22 +1250,7 @@ gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
       "maxWidth=\"1920\" " "maxHeight=\"1080\" " "startWithSAP=\"1\">\n");
   append_content_protection (t, adaptive, mq.auth_token);
 
-  GSS_A ("    <SegmentTemplate timescale=\"10000000\" "
-      "media=\"content?stream=video&amp;bitrate=$Bandwidth$&amp;start_time=$Time$\" "
-      "initialization=\"content?stream=video&amp;bitrate=$Bandwidth$&amp;start_time=init\">\n");
-  GSS_A ("      <SegmentTimeline>\n");
-  {
-    GssAdaptiveLevel *level = &adaptive->video_levels[0];
-
-    for (i = 0; i < level->n_fragments; i++) {
-      GssIsomFragment *fragment;
-      fragment = gss_isom_track_get_fragment (level->track, i);
-      GSS_P ("        <S d=\"%" G_GUINT64_FORMAT "\" />\n",
-          (guint64) fragment->duration);
-    }
-  }
-  GSS_A ("      </SegmentTimeline>\n");
-  GSS_A ("    </SegmentTemplate>\n");
+  append_segment_template (s, adaptive, TRUE);
   for (i = 0; i < adaptive->n_video_levels; i++) {
     GssAdaptiveLevel *level = &adaptive->video_levels[i];
 
@@ -680,6 +1269,212 @@ gss_adaptive_resource_get_dash_live_mpd (GssTransaction * t,
 
 }
 
+/* Generated manifests, cached in adaptive->manifests.  Entries live as
+ * long as the adaptive, i.e., until the stream is reloaded. */
+typedef struct _GssAdaptiveManifest GssAdaptiveManifest;
+struct _GssAdaptiveManifest
+{
+  char *content_type;
+  SoupBuffer *buffer;
+  char *etag;
+  /* NULL if compression did not make it smaller */
+  SoupBuffer *gzip_buffer;
+  char *gzip_etag;
+};
+
+static void
+gss_adaptive_manifest_free (GssAdaptiveManifest * manifest)
+{
+  g_free (manifest->content_type);
+  soup_buffer_free (manifest->buffer);
+  g_free (manifest->etag);
+  if (manifest->gzip_buffer)
+    soup_buffer_free (manifest->gzip_buffer);
+  g_free (manifest->gzip_etag);
+  g_free (manifest);
+}
+
+static SoupBuffer *
+gss_adaptive_gzip (const guint8 * data, gsize size)
+{
+  GConverter *compressor;
+  GConverterResult result;
+  GError *error = NULL;
+  guint8 *out;
+  gsize alloc;
+  gsize in_offset = 0;
+  gsize out_offset = 0;
+
+  compressor = G_CONVERTER (g_zlib_compressor_new
+      (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+  /* manifests are repetitive XML and usually compress 10:1 or better */
+  alloc = size / 4 + 64;
+  out = g_malloc (alloc);
+
+  do {
+    gsize n_read;
+    gsize n_written;
+
+    if (out_offset == alloc) {
+      alloc *= 2;
+      out = g_realloc (out, alloc);
+    }
+    result = g_converter_convert (compressor, data + in_offset,
+        size - in_offset, out + out_offset, alloc - out_offset,
+        G_CONVERTER_INPUT_AT_END, &n_read, &n_written, &error);
+    if (result == G_CONVERTER_ERROR) {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+        GST_WARNING ("failed to compress manifest: %s", error->message);
+        g_error_free (error);
+        g_object_unref (compressor);
+        g_free (out);
+        return NULL;
+      }
+      g_clear_error (&error);
+      alloc *= 2;
+      out = g_realloc (out, alloc);
+      continue;
+    }
+    in_offset += n_read;
+    out_offset += n_written;
+  } while (result != G_CONVERTER_FINISHED);
+
+  g_object_unref (compressor);
+
+  return soup_buffer_new (SOUP_MEMORY_TAKE, out, out_offset);
+}
+
+/* Two queries that select the same video levels get the same manifest,
+ * so the key is the set of selected levels rather than the raw query
+ * parameters.  The PlayReady header also carries the license URL, which
+ * can be changed at runtime, and the auth token.  Neither the URL nor
+ * the levels contain newlines, so the parts cannot run together. */
+static char *
+gss_adaptive_get_manifest_key (GssAdaptive * adaptive, ManifestQuery * mq)
+{
+  GString *key;
+  int i;
+
+  key = g_string_sized_new (adaptive->n_video_levels + 1);
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    g_string_append_c (key,
+        manifest_query_check_video (mq, &adaptive->video_levels[i]) ?
+        '1' : '0');
+  }
+  if (adaptive->drm_type == GSS_DRM_PLAYREADY) {
+    const char *license_url = adaptive->server->playready->license_url;
+
+    g_string_append_printf (key, "\n%s", license_url ? license_url : "");
+    if (mq->auth_token) {
+      g_string_append_printf (key, "\n%s", mq->auth_token);
+    }
+  }
+
+  return g_string_free (key, FALSE);
+}
+
+static GssAdaptiveManifest *
+gss_adaptive_manifest_new (GssTransaction * t, GString * s)
+{
+  GssAdaptiveManifest *manifest;
+  const char *content_type;
+  char *checksum;
+  gsize len;
+
+  manifest = g_new0 (GssAdaptiveManifest, 1);
+
+  content_type = soup_message_headers_get_one (t->msg->response_headers,
+      "Content-Type");
+  manifest->content_type = g_strdup (content_type);
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+      (guchar *) s->str, s->len);
+  manifest->etag = g_strdup_printf ("\"%.16s\"", checksum);
+
+  len = s->len;
+  manifest->buffer = soup_buffer_new (SOUP_MEMORY_TAKE,
+      g_string_free (s, FALSE), len);
+
+  manifest->gzip_buffer = gss_adaptive_gzip (
+      (guint8 *) manifest->buffer->data, manifest->buffer->length);
+  if (manifest->gzip_buffer &&
+      manifest->gzip_buffer->length >= manifest->buffer->length) {
+    soup_buffer_free (manifest->gzip_buffer);
+    manifest->gzip_buffer = NULL;
+  }
+  if (manifest->gzip_buffer) {
+    manifest->gzip_etag = g_strdup_printf ("\"%.16s-gzip\"", checksum);
+  }
+  g_free (checksum);
+
+  return manifest;
+}
+
+/* Serves a manifest from adaptive->manifests, calling @generate to fill
+ * t->s on a miss.  Manifest requests are handled in the main loop, so
+ * the cache needs no lock. */
+static void
+gss_adaptive_resource_get_cached_manifest (GssTransaction * t,
+    GssAdaptive * adaptive,
+    void (*generate) (GssTransaction * t, GssAdaptive * adaptive))
+{
+  GssAdaptiveManifest *manifest;
+  ManifestQuery mq;
+  SoupBuffer *buffer;
+  const char *etag;
+  char *key;
+
+  parse_manifest_query (&mq, t);
+  key = gss_adaptive_get_manifest_key (adaptive, &mq);
+
+  manifest = g_hash_table_lookup (adaptive->manifests, key);
+  if (manifest == NULL) {
+    generate (t, adaptive);
+    if (t->s == NULL) {
+      g_free (key);
+      return;
+    }
+
+    /* Keys include auth tokens, so bound the table. */
+    if (g_hash_table_size (adaptive->manifests) >=
+        GSS_ADAPTIVE_MAX_MANIFESTS) {
+      g_hash_table_remove_all (adaptive->manifests);
+      adaptive->manifests_size = 0;
+    }
+    manifest = gss_adaptive_manifest_new (t, t->s);
+    t->s = NULL;
+    g_hash_table_insert (adaptive->manifests, key, manifest);
+    adaptive->manifests_size += manifest->buffer->length;
+    if (manifest->gzip_buffer)
+      adaptive->manifests_size += manifest->gzip_buffer->length;
+  } else {
+    g_free (key);
+  }
+
+  if (manifest->content_type) {
+    soup_message_headers_replace (t->msg->response_headers, "Content-Type",
+        manifest->content_type);
+  }
+  soup_message_headers_append (t->msg->response_headers, "Vary",
+      "Accept-Encoding");
+
+  if (manifest->gzip_buffer &&
+      gss_soup_message_accepts_encoding (t->msg, "gzip")) {
+    soup_message_headers_replace (t->msg->response_headers,
+        "Content-Encoding", "gzip");
+    buffer = manifest->gzip_buffer;
+    etag = manifest->gzip_etag;
+  } else {
+    buffer = manifest->buffer;
+    etag = manifest->etag;
+  }
+
+  if (gss_soup_message_check_etag (t->msg, etag))
+    return;
+
+  soup_message_body_append_buffer (t->msg->response_body, buffer);
+}
+
 static gboolean
 parse_guint64 (const char *s, guint64 * value)
 {
@@ -703,8 +1498,10 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
 {
   const char *stream;
   const char *start_time_str;
+  const char *number_str;
   const char *bitrate_str;
   guint64 start_time;
+  guint64 number;
   guint64 bitrate;
   gboolean is_init;
   GssAdaptiveLevel *level;
@@ -723,8 +1520,11 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
     gss_transaction_error_not_found (t, "missing stream parameterr");
     return;
   }
+  /* fragments are addressed by start time, or by number (starting at 1)
+   * in DASH manifests with constant fragment durations */
   start_time_str = g_hash_table_lookup (t->query, "start_time");
-  if (start_time_str == NULL) {
+  number_str = g_hash_table_lookup (t->query, "number");
+  if (start_time_str == NULL && number_str == NULL) {
     gss_transaction_error_not_found (t, "missing start_time parameter");
     return;
   }
@@ -740,9 +1540,17 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
     return;
   }
 
-  if (strcmp (start_time_str, "init") == 0) {
+  number = 0;
+  start_time = 0;
+  if (start_time_str == NULL) {
+    is_init = FALSE;
+    ret = parse_guint64 (number_str, &number);
+    if (!ret || number == 0) {
+      gss_transaction_error_not_found (t, "number is not a positive number");
+      return;
+    }
+  } else if (strcmp (start_time_str, "init") == 0) {
     is_init = TRUE;
-    start_time = 0;
   } else {
     is_init = FALSE;
     ret = parse_guint64 (start_time_str, &start_time);
@@ -753,46 +1561,175 @@ gss_adaptive_resource_get_content (GssTransaction * t, GssAdaptive * adaptive)
     }
   }
 
-  if (strcmp (stream, "audio") != 0 && strcmp (stream, "video") != 0) {
-    gss_transaction_error_not_found (t, "stream is not \"audio\" or \"video\"");
+  if (strcmp (stream, "audio") != 0 && strcmp (stream, "video") != 0) {
+    gss_transaction_error_not_found (t, "stream is not \"audio\" or \"video\"");
+    return;
+  }
+
+  level = gss_adaptive_get_level (adaptive, (stream[0] == 'v'), bitrate);
+  if (level == NULL) {
+    gss_transaction_error_not_found (t,
+        "level not found for stream and bitrate");
+    return;
+  }
+
+  soup_message_headers_replace (t->msg->response_headers, "Content-Type",
+      (stream[0] == 'v') ? "video/mp4" : "audio/mp4");
+
+  if (is_init) {
+    soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
+        level->track->ccff_header_data, level->track->ccff_header_size);
+  } else {
+    GssAdaptiveQuery *query;
+
+    if (number > 0) {
+      fragment = NULL;
+      if (number <= (guint64) level->n_fragments) {
+        fragment = gss_isom_track_get_fragment (level->track, number - 1);
+      }
+    } else {
+      fragment = gss_isom_track_get_fragment_by_timestamp (level->track,
+          start_time);
+    }
+    if (fragment == NULL) {
+      gss_transaction_error_not_found (t, "fragment not found");
+      return;
+    }
+    //GST_ERROR ("frag %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+    //    level->filename, fragment->offset, fragment->size);
+
+    if (gss_adaptive_can_use_mmap (adaptive, level) &&
+        gss_adaptive_send_fragment_mapped (t, adaptive, level, fragment)) {
+      return;
+    }
+
+    gss_adaptive_prefetch_next (t, adaptive, level, fragment->index);
+
+    soup_server_pause_message (t->soupserver, t->msg);
+
+    query = g_malloc0 (sizeof (GssAdaptiveQuery));
+    query->adaptive = gss_adaptive_ref (adaptive);
+    query->level = level;
+    query->fragment = fragment;
+
+    if (!gss_adaptive_read_fragment_uring (t, query)) {
+      gss_transaction_process_async (t, gss_adaptive_async_assemble_chunk,
+          gss_adaptive_async_assemble_chunk_finish, query);
+    }
+  }
+}
+
+/* Serves a clear or pre-encrypted fragment from the mapped file, without
+ * copying or blocking a worker thread. */
+static gboolean
+gss_adaptive_send_fragment_mapped (GssTransaction * t, GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, GssIsomFragment * fragment)
+{
+  SoupMessageBody *body = t->msg->response_body;
+  GMappedFile *mapped;
+  guint8 mdat_header[8];
+  gboolean ret;
+
+  mapped = gss_adaptive_map_level (adaptive, level);
+  if (mapped == NULL)
+    return FALSE;
+
+  /* strip off mdat header at end of moof_data */
+  gss_adaptive_append_clipped_static (body, adaptive, fragment->moof_data,
+      0, fragment->moof_size - 8, 0, fragment->moof_size - 8);
+  GST_WRITE_UINT32_BE (mdat_header, fragment->mdat_size);
+  GST_WRITE_UINT32_LE (mdat_header + 4, GST_MAKE_FOURCC ('m', 'd', 'a', 't'));
+  soup_message_body_append (body, SOUP_MEMORY_COPY, mdat_header, 8);
+
+  ret = gss_adaptive_append_mapped_samples (body, mapped, fragment, 0,
+      fragment->mdat_size - 8, 0);
+  g_mapped_file_unref (mapped);
+
+  if (!ret) {
+    GST_WARNING ("samples outside of file %s", level->filename);
+    soup_message_body_truncate (body);
+    return FALSE;
+  }
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+
+  return TRUE;
+}
+
+static void
+gss_adaptive_uring_read_done (gboolean success, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+  GssTransaction *t = query->transaction;
+  GssAdaptive *adaptive = query->adaptive;
+
+  gss_fd_cache_release (adaptive->fd_cache, query->file);
+  query->file = NULL;
+
+  if (!success) {
+    /* read it again with preadv() in a worker thread */
+    g_free (query->data);
+    query->data = NULL;
+    gss_transaction_process_async (t, gss_adaptive_async_assemble_chunk,
+        gss_adaptive_async_assemble_chunk_finish, query);
     return;
   }
 
-  level = gss_adaptive_get_level (adaptive, (stream[0] == 'v'), bitrate);
-  if (level == NULL) {
-    gss_transaction_error_not_found (t,
-        "level not found for stream and bitrate");
-    return;
+  if (gss_adaptive_level_needs_encryption (adaptive, query->level)) {
+    /* don't encrypt in the main thread */
+    gss_transaction_process_async (t, gss_adaptive_async_store_chunk,
+        gss_adaptive_async_assemble_chunk_finish, query);
+  } else {
+    gss_adaptive_async_store_chunk (t, query);
+    gss_adaptive_async_assemble_chunk_finish (t, query);
   }
+}
 
-  soup_message_headers_replace (t->msg->response_headers, "Content-Type",
-      (stream[0] == 'v') ? "video/mp4" : "audio/mp4");
+/* Reads the payload of a fragment with io_uring, from the main loop,
+ * instead of blocking a worker thread.  Returns FALSE if the worker
+ * thread path should be used instead. */
+static gboolean
+gss_adaptive_read_fragment_uring (GssTransaction * t,
+    GssAdaptiveQuery * query)
+{
+  GssAdaptive *adaptive = query->adaptive;
+  GssIsomFragment *fragment = query->fragment;
+  gboolean ret;
 
-  if (is_init) {
-    soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
-        level->track->ccff_header_data, level->track->ccff_header_size);
-  } else {
-    GssAdaptiveQuery *query;
+  if (adaptive->uring == NULL || adaptive->fd_cache == NULL)
+    return FALSE;
 
-    fragment = gss_isom_track_get_fragment_by_timestamp (level->track,
-        start_time);
-    if (fragment == NULL) {
-      gss_transaction_error_not_found (t, "fragment not found for start_time");
-      return;
+  query->transaction = t;
+
+  if (adaptive->fragment_cache) {
+    query->cache_key = gss_adaptive_get_fragment_key (adaptive, query->level,
+        fragment);
+    query->buffer = gss_fragment_cache_lookup (adaptive->fragment_cache,
+        query->cache_key);
+    if (query->buffer) {
+      gss_adaptive_async_assemble_chunk_finish (t, query);
+      return TRUE;
     }
-    //GST_ERROR ("frag %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-    //    level->filename, fragment->offset, fragment->size);
+  }
 
-    soup_server_pause_message (t->soupserver, t->msg);
+  query->file = gss_fd_cache_open (adaptive->fd_cache, query->level->filename,
+      NULL);
+  if (query->file == NULL)
+    return FALSE;
 
-    query = g_malloc0 (sizeof (GssAdaptiveQuery));
-    query->adaptive = adaptive;
-    query->level = level;
-    query->fragment = fragment;
+  query->data = g_malloc (fragment->mdat_size);
+  GST_WRITE_UINT32_BE (query->data, fragment->mdat_size);
+  GST_WRITE_UINT32_LE (query->data + 4, GST_MAKE_FOURCC ('m', 'd', 'a', 't'));
 
-    gss_transaction_process_async (t, gss_adaptive_async_assemble_chunk,
-        gss_adaptive_async_assemble_chunk_finish, query);
+  ret = gss_uring_read_sglist (adaptive->uring, fragment->sglist,
+      query->file->fd, query->data + 8, gss_adaptive_uring_read_done, query);
+  if (!ret) {
+    g_free (query->data);
+    query->data = NULL;
+    gss_fd_cache_release (adaptive->fd_cache, query->file);
+    query->file = NULL;
   }
+
+  return ret;
 }
 
 static void
@@ -800,12 +1737,18 @@ gss_adaptive_async_assemble_chunk (GssTransaction * t, gpointer priv)
 {
   GssAdaptiveQuery *query = priv;
 
-  query->data = gss_adaptive_assemble_chunk (t,
-      query->adaptive, query->level, query->fragment);
-  if (query->adaptive->drm_type != GSS_DRM_CLEAR) {
-    gss_playready_encrypt_samples (query->fragment, query->data,
-        query->adaptive->content_key);
-  }
+  query->buffer = gss_adaptive_get_fragment_payload (t, query->adaptive,
+      query->level, query->fragment);
+}
+
+static void
+gss_adaptive_async_store_chunk (GssTransaction * t, gpointer priv)
+{
+  GssAdaptiveQuery *query = priv;
+
+  query->buffer = gss_adaptive_store_fragment_payload (query->adaptive,
+      query->level, query->fragment, query->cache_key, query->data, FALSE);
+  query->data = NULL;
 }
 
 static void
@@ -813,13 +1756,17 @@ gss_adaptive_async_assemble_chunk_finish (GssTransaction * t, gpointer priv)
 {
   GssAdaptiveQuery *query = priv;
 
-  soup_message_set_status (t->msg, SOUP_STATUS_OK);
-  /* strip off mdat header at end of moof_data */
-  soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
-      query->fragment->moof_data, query->fragment->moof_size - 8);
-  soup_message_body_append (t->msg->response_body, SOUP_MEMORY_TAKE,
-      query->data, query->fragment->mdat_size);
+  if (query->buffer) {
+    soup_message_set_status (t->msg, SOUP_STATUS_OK);
+    /* strip off mdat header at end of moof_data */
+    soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
+        query->fragment->moof_data, query->fragment->moof_size - 8);
+    soup_message_body_append_buffer (t->msg->response_body, query->buffer);
+    soup_buffer_free (query->buffer);
+  }
   soup_server_unpause_message (t->soupserver, t->msg);
+  gss_adaptive_unref (query->adaptive);
+  g_free (query->cache_key);
   g_free (query);
 }
 
@@ -829,9 +1776,55 @@ gss_adaptive_new (void)
   GssAdaptive *adaptive;
 
   adaptive = g_malloc0 (sizeof (GssAdaptive));
+  adaptive->refcount = 1;
+  adaptive->parsers =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) gss_isom_parser_free);
+  adaptive->manifests = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) gss_adaptive_manifest_free);
+
+  return adaptive;
+
+}
+
+GssAdaptive *
+gss_adaptive_ref (GssAdaptive * adaptive)
+{
+  g_return_val_if_fail (adaptive != NULL, NULL);
+
+  g_atomic_int_inc (&adaptive->refcount);
 
   return adaptive;
+}
+
+/* Pending asynchronous queries hold a reference, so an adaptive
+ * evicted from a cache stays valid until the last one finishes. */
+void
+gss_adaptive_unref (GssAdaptive * adaptive)
+{
+  g_return_if_fail (adaptive != NULL);
+
+  if (g_atomic_int_dec_and_test (&adaptive->refcount)) {
+    gss_adaptive_free (adaptive);
+  }
+}
+
+gsize
+gss_adaptive_get_memory_size (GssAdaptive * adaptive)
+{
+  gsize size;
+  int i;
+
+  size = sizeof (GssAdaptive);
+  size += (adaptive->n_audio_levels + adaptive->n_video_levels) *
+      sizeof (GssAdaptiveLevel);
+  size += adaptive->drm_info.data_len;
+  for (i = 0; i < adaptive->parsers->len; i++) {
+    size += gss_isom_parser_get_memory_size (g_ptr_array_index
+        (adaptive->parsers, i));
+  }
+  size += adaptive->manifests_size;
 
+  return size;
 }
 
 void
@@ -841,9 +1834,7 @@ gss_adaptive_free (GssAdaptive * adaptive)
 
   g_return_if_fail (adaptive != NULL);
 
-  for (i = 0; i < adaptive->n_parsers; i++) {
-    gss_isom_parser_free (adaptive->parsers[i]);
-  }
+  g_ptr_array_unref (adaptive->parsers);
 
   for (i = 0; i < adaptive->n_audio_levels; i++) {
     adaptive->audio_levels[i].track = NULL;
@@ -857,10 +1848,12 @@ gss_adaptive_free (GssAdaptive * adaptive)
     g_free (adaptive->video_levels[i].filename);
     g_free (adaptive->video_levels[i].codec);
   }
+  g_hash_table_unref (adaptive->manifests);
   g_free (adaptive->drm_info.data);
   g_free (adaptive->audio_levels);
   g_free (adaptive->video_levels);
   g_free (adaptive->content_id);
+  g_free (adaptive->version);
   g_free (adaptive->kid);
   g_free (adaptive);
 }
@@ -918,6 +1911,7 @@ parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
   JsonObject *obj;
   JsonNode *n;
   JsonArray *version_array;
+  GPtrArray *filenames;
   int version;
   int len;
   int i;
@@ -973,31 +1967,36 @@ parse_json (GssAdaptive * adaptive, JsonParser * parser, const char *dir,
     if (files_len == 0)
       return FALSE;
 
+    filenames = g_ptr_array_new_with_free_func (g_free);
     for (j = 0; j < files_len; j++) {
       const char *filename;
-      char *full_fn;
 
       n = json_array_get_element (files_array, j);
       if (n == NULL)
-        return FALSE;
+        goto error;
       if (json_node_get_node_type (n) == JSON_NODE_OBJECT) {
         obj = json_node_get_object (n);
         if (obj) {
           n = json_object_get_member (obj, "filename");
           if (n == NULL)
-            return FALSE;
+            goto error;
         }
       }
       filename = json_node_get_string (n);
       if (filename == NULL)
-        return FALSE;
+        goto error;
 
-      full_fn = g_strdup_printf ("%s/%s", dir, filename);
-      load_file (adaptive, full_fn);
-      g_free (full_fn);
+      g_ptr_array_add (filenames, g_strdup_printf ("%s/%s", dir, filename));
     }
 
+    load_files (adaptive, filenames);
+    g_ptr_array_unref (filenames);
+
     return TRUE;
+
+  error:
+    g_ptr_array_unref (filenames);
+    return FALSE;
   }
   GST_ERROR ("requested version not found: %s", requested_version);
   return FALSE;
@@ -1038,6 +2037,7 @@ gss_adaptive_load (GssServer * server, const char *key, const char *dir,
   adaptive->server = server;
 
   adaptive->content_id = g_strdup (key);
+  adaptive->version = g_strdup (version);
   adaptive->kid = create_key_id (key);
   adaptive->kid_len = 16;
   adaptive->drm_type = drm_type;
@@ -1048,7 +2048,7 @@ gss_adaptive_load (GssServer * server, const char *key, const char *dir,
 
   ret = parse_json (adaptive, parser, dir, version);
   if (!ret) {
-    gss_adaptive_free (adaptive);
+    gss_adaptive_unref (adaptive);
     g_object_unref (parser);
     GST_WARNING ("json format error in %s/gss-manifest", dir);
     return NULL;
@@ -1253,6 +2253,12 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
     gss_adaptive_convert_ism (adaptive, movie, track, adaptive->drm_type);
   }
 
+  /* the moofs are serialized, per-sample data is only read when
+   * encrypting from here on */
+  for (i = 0; i < track->n_fragments; i++) {
+    gss_isom_fragment_pack_samples (track->fragments[i]);
+  }
+
   level->track_id = track->tkhd.track_id;
   level->n_fragments = track->n_fragments;
   level->filename = g_strdup (filename);
@@ -1277,26 +2283,65 @@ gss_level_from_track (GssAdaptive * adaptive, GssIsomTrack * track,
   }
 }
 
-static void
-load_file (GssAdaptive * adaptive, const char *filename)
+typedef struct _LoadFilesJob LoadFilesJob;
+struct _LoadFilesJob
 {
-  GssIsomParser *file;
-  GssIsomTrack *video_track;
-  GssIsomTrack *audio_track;
+  GssAdaptive *adaptive;
+  GPtrArray *filenames;
+};
 
-  g_return_if_fail (adaptive != 0);
-  g_return_if_fail (filename != 0);
+/* Parsing and fragmentizing a file only touches its own parser, so
+ * this runs in a thread pool, one file per task. */
+static void
+load_file_parse (gpointer data, gpointer user_data)
+{
+  LoadFilesJob *job = user_data;
+  GssAdaptive *adaptive = job->adaptive;
+  int index = GPOINTER_TO_INT (data) - 1;
+  GssIsomParser *file = g_ptr_array_index (adaptive->parsers, index);
+  const char *filename = g_ptr_array_index (job->filenames, index);
+  int i;
 
-  file = gss_isom_parser_new ();
-  adaptive->parsers[adaptive->n_parsers] = file;
-  adaptive->n_parsers++;
+  /* large moov boxes parse much faster in place.  Sample tables are
+   * only needed to fragmentize, which a valid index makes unnecessary. */
+  file->use_mmap = TRUE;
+  file->lazy_sample_tables = TRUE;
   gss_isom_parser_parse_file (file, filename);
+  if (file->movie == NULL || file->movie->n_tracks == 0) {
+    GST_WARNING ("failed to parse %s", filename);
+    return;
+  }
 
   if (file->movie->tracks[0]->n_fragments == 0) {
-    gss_isom_parser_fragmentize (file,
-        adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
+    gboolean is_dash;
+    char *index_filename;
+
+    is_dash = (adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND ||
         adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_LIVE);
+    index_filename = g_strdup_printf ("%s.gssidx", filename);
+    if (!gss_isom_parser_load_index (file, index_filename, is_dash)) {
+      gss_isom_parser_fragmentize (file, is_dash);
+      gss_isom_parser_save_index (file, index_filename);
+    }
+    g_free (index_filename);
+  }
+
+  /* everything is served from the fragments from here on */
+  for (i = 0; i < file->movie->n_tracks; i++) {
+    gss_isom_track_drop_sample_tables (file->movie->tracks[i]);
   }
+}
+
+static void
+load_file (GssAdaptive * adaptive, GssIsomParser * file)
+{
+  const char *filename = file->filename;
+  GssIsomTrack *video_track;
+  GssIsomTrack *audio_track;
+
+  if (file->movie == NULL || file->movie->n_tracks == 0)
+    return;
+
 #if 0
   if (adaptive->drm_type == GSS_DRM_PLAYREADY &&
       adaptive->stream_type == GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND) {
@@ -1353,6 +2398,335 @@ load_file (GssAdaptive * adaptive, const char *filename)
 
 }
 
+/* Loads the files of a stream, in parallel.  Levels are added in the
+ * order of @filenames regardless of which file finishes first. */
+static void
+load_files (GssAdaptive * adaptive, GPtrArray * filenames)
+{
+  LoadFilesJob job;
+  int i;
+
+  g_return_if_fail (adaptive != NULL);
+  g_return_if_fail (filenames != NULL);
+
+  for (i = 0; i < filenames->len; i++) {
+    g_ptr_array_add (adaptive->parsers, gss_isom_parser_new ());
+  }
+
+  job.adaptive = adaptive;
+  job.filenames = filenames;
+  if (filenames->len == 1) {
+    load_file_parse (GINT_TO_POINTER (1), &job);
+  } else {
+    GThreadPool *pool;
+
+    pool = g_thread_pool_new (load_file_parse, &job,
+        MIN (filenames->len, GSS_ADAPTIVE_LOAD_THREADS), TRUE, NULL);
+    for (i = 0; i < filenames->len; i++) {
+      g_thread_pool_push (pool, GINT_TO_POINTER (i + 1), NULL);
+    }
+    /* waits for all files */
+    g_thread_pool_free (pool, FALSE, TRUE);
+  }
+
+  for (i = 0; i < adaptive->parsers->len; i++) {
+    load_file (adaptive, g_ptr_array_index (adaptive->parsers, i));
+  }
+}
+
+/*
+ * Pre-encrypted storage
+ *
+ * The content key and IVs of a DRM stream are derived from the key
+ * seed and file names, so every request for a fragment encrypts the
+ * same bytes the same way.  Optionally, the encrypted samples of each
+ * level are written once to a file next to the source file:
+ *
+ *   0     "GSSENC\r\n"
+ *   8     version
+ *   12    number of fragments
+ *   16    size and modification time of the source file
+ *   32    size of the sample data
+ *   40    SHA1 of the content key, level IV, DRM and stream type
+ *   60    inode of the source file
+ *   68    nanoseconds of its modification time, or 0
+ *   4096  encrypted samples of all fragments, in order
+ *
+ * all in big endian.  The moof boxes, including the sample encryption
+ * boxes, are serialized in memory at load as before, so only the
+ * sample data is stored.  Levels with a valid file are served from it
+ * without encrypting, and can use the mmap path.
+ */
+
+#define GSS_ADAPTIVE_PRE_ENCRYPTED_MAGIC "GSSENC\r\n"
+#define GSS_ADAPTIVE_PRE_ENCRYPTED_VERSION 2
+#define GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE 72
+#define GSS_ADAPTIVE_PRE_ENCRYPTED_DATA_OFFSET 4096
+
+static char *
+gss_adaptive_get_pre_encrypted_filename (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level)
+{
+  return g_strdup_printf ("%s.%d.%s-%s.gssenc", level->filename,
+      level->track_id, gss_drm_get_drm_name (adaptive->drm_type),
+      gss_adaptive_stream_get_name (adaptive->stream_type));
+}
+
+/* Fills in the header a valid pre-encrypted file of @level would have. */
+static gboolean
+gss_adaptive_pre_encrypted_header (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level, guint8 * header)
+{
+  GssIsomTrack *track = level->track;
+  GChecksum *csum;
+  GStatBuf statbuf;
+  guint8 bytes[20];
+  gsize size;
+  guint64 data_size;
+  int i;
+
+  if (g_stat (level->filename, &statbuf) < 0) {
+    GST_WARNING ("failed to stat \"%s\": %s", level->filename,
+        g_strerror (errno));
+    return FALSE;
+  }
+
+  data_size = 0;
+  for (i = 0; i < track->n_fragments; i++) {
+    data_size += track->fragments[i]->mdat_size - 8;
+  }
+
+  memset (bytes, 0, 20);
+  GST_WRITE_UINT64_BE (bytes, level->iv);
+  GST_WRITE_UINT32_BE (bytes + 8, adaptive->drm_type);
+  GST_WRITE_UINT32_BE (bytes + 12, adaptive->stream_type);
+  csum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (csum, adaptive->content_key, GSS_ADAPTIVE_KEY_LENGTH);
+  g_checksum_update (csum, bytes, 16);
+  size = 20;
+  g_checksum_get_digest (csum, bytes, &size);
+  g_checksum_free (csum);
+
+  memcpy (header, GSS_ADAPTIVE_PRE_ENCRYPTED_MAGIC, 8);
+  GST_WRITE_UINT32_BE (header + 8, GSS_ADAPTIVE_PRE_ENCRYPTED_VERSION);
+  GST_WRITE_UINT32_BE (header + 12, track->n_fragments);
+  GST_WRITE_UINT64_BE (header + 16, statbuf.st_size);
+  GST_WRITE_UINT64_BE (header + 24, statbuf.st_mtime);
+  GST_WRITE_UINT64_BE (header + 32, data_size);
+  memcpy (header + 40, bytes, 20);
+  /* a source replaced by one of the same size, or rewritten within a
+   * second, has a different inode or mtime_nsec */
+  GST_WRITE_UINT64_BE (header + 60, statbuf.st_ino);
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  GST_WRITE_UINT32_BE (header + 68, statbuf.st_mtim.tv_nsec);
+#else
+  GST_WRITE_UINT32_BE (header + 68, 0);
+#endif
+
+  return TRUE;
+}
+
+/* Points the fragments of @level at its pre-encrypted file, if there
+ * is a valid one. */
+static gboolean
+gss_adaptive_open_pre_encrypted_level (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level)
+{
+  GssIsomTrack *track = level->track;
+  guint8 expected[GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE];
+  guint8 header[GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE];
+  struct stat statbuf;
+  char *filename;
+  guint64 offset;
+  gssize n;
+  int fd;
+  int i;
+
+  if (level->pre_encrypted)
+    return TRUE;
+
+  if (!gss_adaptive_pre_encrypted_header (adaptive, level, expected))
+    return FALSE;
+
+  filename = gss_adaptive_get_pre_encrypted_filename (adaptive, level);
+  fd = open (filename, O_RDONLY);
+  if (fd < 0) {
+    g_free (filename);
+    return FALSE;
+  }
+  n = read (fd, header, GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE);
+  if (n != GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE ||
+      memcmp (header, expected, GSS_ADAPTIVE_PRE_ENCRYPTED_HEADER_SIZE) != 0 ||
+      fstat (fd, &statbuf) < 0 ||
+      statbuf.st_size != GSS_ADAPTIVE_PRE_ENCRYPTED_DATA_OFFSET +
+      GST_READ_UINT64_BE (header + 32)) {
+    GST_INFO ("pre-encrypted file %s is stale", filename);
+    close (fd);
+    g_free (filename);
+    return FALSE;
+  }
+  close (fd);
+
+  offset = GSS_ADAPTIVE_PRE_ENCRYPTED_DATA_OFFSET;
+  for (i = 0; i < track->n_fragments; i++) {
+    GssIsomFragment *fragment = track->fragments[i];
+
+    gss_sglist_free (fragment->sglist);
+    fragment->sglist = gss_sglist_new (1);
+    fragment->sglist->chunks[0].offset = offset;
+    fragment->sglist->chunks[0].size = fragment->mdat_size - 8;
+    offset += fragment->mdat_size - 8;
+  }
+
+  g_free (level->filename);
+  level->filename = filename;
+  level->pre_encrypted = TRUE;
+
+  return TRUE;
+}
+
+static gboolean
+gss_adaptive_write_all (int fd, const guint8 * data, gsize size)
+{
+  while (size > 0) {
+    gssize n = write (fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return FALSE;
+    }
+    data += n;
+    size -= n;
+  }
+  return TRUE;
+}
+
+/* Encrypts the samples of @level into a temporary file, and renames
+ * it into place when complete. */
+static gboolean
+gss_adaptive_write_pre_encrypted_level (GssAdaptive * adaptive,
+    GssAdaptiveLevel * level)
+{
+  GssIsomTrack *track = level->track;
+  guint8 header[GSS_ADAPTIVE_PRE_ENCRYPTED_DATA_OFFSET];
+  char *filename;
+  char *tmpname;
+  gboolean ret;
+  int fd;
+  int i;
+
+  memset (header, 0, sizeof (header));
+  if (!gss_adaptive_pre_encrypted_header (adaptive, level, header))
+    return FALSE;
+
+  filename = gss_adaptive_get_pre_encrypted_filename (adaptive, level);
+  tmpname = g_strdup_printf ("%s.%d.tmp", filename, getpid ());
+  fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    GST_WARNING ("failed to create \"%s\": %s", tmpname, g_strerror (errno));
+    g_free (tmpname);
+    g_free (filename);
+    return FALSE;
+  }
+
+  ret = gss_adaptive_write_all (fd, header, sizeof (header));
+  for (i = 0; ret && i < track->n_fragments; i++) {
+    GssIsomFragment *fragment = track->fragments[i];
+    guint8 *data;
+
+    data = gss_adaptive_assemble_chunk (NULL, adaptive, level, fragment);
+    if (data == NULL) {
+      ret = FALSE;
+      break;
+    }
+    gss_playready_encrypt_samples (fragment, data, adaptive->content_key);
+    ret = gss_adaptive_write_all (fd, data + 8, fragment->mdat_size - 8);
+    g_free (data);
+  }
+  if (ret && fsync (fd) < 0)
+    ret = FALSE;
+  if (close (fd) < 0)
+    ret = FALSE;
+
+  if (ret && g_rename (tmpname, filename) < 0)
+    ret = FALSE;
+  if (!ret) {
+    GST_WARNING ("failed to write \"%s\": %s", filename, g_strerror (errno));
+    g_unlink (tmpname);
+  } else {
+    GST_INFO ("wrote pre-encrypted %s", filename);
+  }
+
+  g_free (tmpname);
+  g_free (filename);
+
+  return ret;
+}
+
+/**
+ * gss_adaptive_open_pre_encrypted:
+ * @adaptive: a freshly loaded DRM stream
+ *
+ * Switches each level that has a valid pre-encrypted file over to it.
+ * Must be called before the stream is served.
+ *
+ * Returns: TRUE if all levels are now pre-encrypted
+ */
+gboolean
+gss_adaptive_open_pre_encrypted (GssAdaptive * adaptive)
+{
+  gboolean ret = TRUE;
+  int i;
+
+  g_return_val_if_fail (adaptive != NULL, FALSE);
+  g_return_val_if_fail (adaptive->drm_type != GSS_DRM_CLEAR, FALSE);
+
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    ret &= gss_adaptive_open_pre_encrypted_level (adaptive,
+        &adaptive->video_levels[i]);
+  }
+  for (i = 0; i < adaptive->n_audio_levels; i++) {
+    ret &= gss_adaptive_open_pre_encrypted_level (adaptive,
+        &adaptive->audio_levels[i]);
+  }
+
+  return ret;
+}
+
+/**
+ * gss_adaptive_write_pre_encrypted:
+ * @adaptive: a DRM stream
+ *
+ * Writes pre-encrypted files for the levels of @adaptive that do not
+ * use one.  The stream is not switched over, since it may be serving
+ * requests; the files are used the next time the stream is loaded.
+ * Blocks until done, so should be called from a background thread.
+ *
+ * Returns: TRUE if all files were written
+ */
+gboolean
+gss_adaptive_write_pre_encrypted (GssAdaptive * adaptive)
+{
+  gboolean ret = TRUE;
+  int i;
+
+  g_return_val_if_fail (adaptive != NULL, FALSE);
+  g_return_val_if_fail (adaptive->drm_type != GSS_DRM_CLEAR, FALSE);
+
+  for (i = 0; i < adaptive->n_video_levels; i++) {
+    if (!adaptive->video_levels[i].pre_encrypted)
+      ret &= gss_adaptive_write_pre_encrypted_level (adaptive,
+          &adaptive->video_levels[i]);
+  }
+  for (i = 0; i < adaptive->n_audio_levels; i++) {
+    if (!adaptive->audio_levels[i].pre_encrypted)
+      ret &= gss_adaptive_write_pre_encrypted_level (adaptive,
+          &adaptive->audio_levels[i]);
+  }
+
+  return ret;
+}
+
 void
 gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
     const char *path)
@@ -1376,7 +2750,8 @@ gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
   switch (adaptive->stream_type) {
     case GSS_ADAPTIVE_STREAM_ISM:
       if (strcmp (path, "Manifest") == 0) {
-        gss_adaptive_resource_get_manifest (t, adaptive);
+        gss_adaptive_resource_get_cached_manifest (t, adaptive,
+            gss_adaptive_resource_get_manifest);
       } else if (strcmp (path, "content") == 0) {
         gss_adaptive_resource_get_content (t, adaptive);
       } else {
@@ -1385,7 +2760,8 @@ gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
       break;
     case GSS_ADAPTIVE_STREAM_ISOFF_LIVE:
       if (strcmp (path, "manifest.mpd") == 0) {
-        gss_adaptive_resource_get_dash_live_mpd (t, adaptive);
+        gss_adaptive_resource_get_cached_manifest (t, adaptive,
+            gss_adaptive_resource_get_dash_live_mpd);
       } else if (strcmp (path, "content") == 0) {
         gss_adaptive_resource_get_content (t, adaptive);
       } else {
@@ -1394,7 +2770,8 @@ gss_adaptive_get_resource (GssTransaction * t, GssAdaptive * adaptive,
       break;
     case GSS_ADAPTIVE_STREAM_ISOFF_ONDEMAND:
       if (strcmp (path, "manifest.mpd") == 0) {
-        gss_adaptive_resource_get_dash_range_mpd (t, adaptive);
+        gss_adaptive_resource_get_cached_manifest (t, adaptive,
+            gss_adaptive_resource_get_dash_range_mpd);
       } else if (strncmp (path, "content/", 8) == 0) {
         gss_adaptive_resource_get_dash_range_fragment (t, adaptive, path);
       } else {
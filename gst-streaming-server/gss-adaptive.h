@@ -23,12 +23,22 @@
 
 #include "gss-server.h"
 #include "gss-isom.h"
+#include "gss-fragment-cache.h"
+#include "gss-fd-cache.h"
+#include "gss-prefetch.h"
+#include "gss-uring.h"
 
 G_BEGIN_DECLS
 
 /* 128-bit AES key */
 #define GSS_ADAPTIVE_KEY_LENGTH 16
 
+/* generated manifests kept per stream, one per distinct query */
+#define GSS_ADAPTIVE_MAX_MANIFESTS 32
+
+/* files of a stream parsed in parallel while loading */
+#define GSS_ADAPTIVE_LOAD_THREADS 4
+
 typedef struct _GssAdaptive GssAdaptive;
 typedef struct _GssAdaptiveLevel GssAdaptiveLevel;
 typedef struct _GssAdaptiveQuery GssAdaptiveQuery;
@@ -58,8 +68,10 @@ struct _GssDrmInfo
 
 struct _GssAdaptive
 {
+  int refcount;
   GssServer *server;
   char *content_id;
+  char *version;
   GssDrmType drm_type;
   GssAdaptiveStream stream_type;
   guint64 duration;
@@ -77,10 +89,21 @@ struct _GssAdaptive
   gsize kid_len;
   guint8 content_key[GSS_ADAPTIVE_KEY_LENGTH];
 
-  int n_parsers;
-  GssIsomParser *parsers[20];
+  /* GssIsomParser, one per file */
+  GPtrArray *parsers;
 
   GssDrmInfo drm_info;
+
+  /* manifest cache key -> GssAdaptiveManifest */
+  GHashTable *manifests;
+  gsize manifests_size; /* bytes in manifests, gzip copies included */
+
+  /* shared with other streams, may be NULL */
+  GssFragmentCache *fragment_cache;
+  GssFdCache *fd_cache;
+  GssUring *uring;
+  GssPrefetch *prefetch;
+  gboolean use_mmap;
 };
 
 struct _GssAdaptiveLevel
@@ -101,6 +124,10 @@ struct _GssAdaptiveLevel
   char *codec;
 
   guint64 iv;
+
+  /* samples are read from a pre-encrypted copy, see
+   * gss_adaptive_open_pre_encrypted() */
+  gboolean pre_encrypted;
 };
 
 struct _GssAdaptiveQuery
@@ -109,12 +136,24 @@ struct _GssAdaptiveQuery
   GssAdaptiveLevel *level;
   GssIsomFragment *fragment;
 
+  SoupBuffer *buffer;
+
+  /* for multipart/byteranges responses */
+  int n_ranges;
+  SoupRange *ranges;
+
+  /* for reads with io_uring */
+  GssTransaction *transaction;
+  char *cache_key;
   guint8 *data;
-  gsize size;
+  GssFdCacheFile *file;
 };
 
 GssAdaptive *gss_adaptive_new (void);
 void gss_adaptive_free (GssAdaptive * adaptive);
+GssAdaptive *gss_adaptive_ref (GssAdaptive * adaptive);
+void gss_adaptive_unref (GssAdaptive * adaptive);
+gsize gss_adaptive_get_memory_size (GssAdaptive * adaptive);
 GssAdaptiveLevel *gss_adaptive_get_level (GssAdaptive * adaptive, gboolean video, guint64 bitrate);
 
 GssAdaptiveStream gss_adaptive_get_stream_type (const char *s);
@@ -123,6 +162,8 @@ GssAdaptive * gss_adaptive_load (GssServer * server, const char *key,
     GssAdaptiveStream stream_type);
 void gss_adaptive_get_resource (GssTransaction * t, GssAdaptive *adaptive,
     const char *subpath);
+gboolean gss_adaptive_open_pre_encrypted (GssAdaptive * adaptive);
+gboolean gss_adaptive_write_pre_encrypted (GssAdaptive * adaptive);
 
 const char *gss_adaptive_stream_get_name (GssAdaptiveStream stream_type);
 
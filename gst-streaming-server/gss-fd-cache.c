@@ -0,0 +1,317 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Cache of open file descriptors for VOD source files.
+ *
+ * Fragment requests read from the same few files over and over, so
+ * keep them open instead of paying for open(), a path walk and close()
+ * on every request.  Files are shared between worker threads, so
+ * callers must use pread() rather than seeking.
+ *
+ * An entry is revalidated with stat() at most once per
+ * GSS_FD_CACHE_REVALIDATE_INTERVAL; if the path now refers to a
+ * different inode (the file was replaced), it is reopened.  The number
+ * of cached descriptors is bounded, and kept well below RLIMIT_NOFILE
+ * so that client connections don't run out of descriptors.  Least
+ * recently used files are closed first, once no request is using them.
+ *
+ * Files can also be mapped, once, for serving clear content without
+ * copying.  The mapping is reference counted separately, so it stays
+ * valid after the file is closed.
+ */
+
+#include "config.h"
+
+#include "gss-fd-cache.h"
+#include "gss-log.h"
+
+#include <gst/gst.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define GSS_FD_CACHE_REVALIDATE_INTERVAL (1 * G_TIME_SPAN_SECOND)
+
+struct _GssFdCache
+{
+  GMutex lock;
+  GHashTable *hash;
+  GQueue *lru;                  /* most recently used first */
+  int max_fds;
+};
+
+
+static void
+gss_fd_cache_file_unref (GssFdCacheFile * file)
+{
+  file->refcount--;
+  if (file->refcount == 0) {
+    if (file->mapped)
+      g_mapped_file_unref (file->mapped);
+    close (file->fd);
+    g_free (file->filename);
+    g_free (file);
+  }
+}
+
+static void
+gss_fd_cache_remove (GssFdCache * cache, GssFdCacheFile * file)
+{
+  g_hash_table_remove (cache->hash, file->filename);
+  g_queue_delete_link (cache->lru, file->link);
+  file->link = NULL;
+  gss_fd_cache_file_unref (file);
+}
+
+static void
+gss_fd_cache_trim (GssFdCache * cache)
+{
+  GList *link = cache->lru->tail;
+
+  /* files still in use stay open; they are closed on release */
+  while (link && (int) g_queue_get_length (cache->lru) > cache->max_fds) {
+    GList *prev = link->prev;
+    GssFdCacheFile *file = link->data;
+
+    if (file->refcount == 1) {
+      GST_DEBUG ("closing %s", file->filename);
+      gss_fd_cache_remove (cache, file);
+    }
+    link = prev;
+  }
+}
+
+/**
+ * gss_fd_cache_new:
+ * @max_fds: maximum number of descriptors to keep open
+ *
+ * @max_fds is clamped to a quarter of the process's RLIMIT_NOFILE.
+ *
+ * Returns: a new file descriptor cache
+ */
+GssFdCache *
+gss_fd_cache_new (int max_fds)
+{
+  GssFdCache *cache;
+  struct rlimit rl;
+
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    max_fds = MIN (max_fds, (int) MIN (rl.rlim_cur / 4, G_MAXINT));
+  }
+  max_fds = MAX (max_fds, 1);
+
+  cache = g_new0 (GssFdCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->hash = g_hash_table_new (g_str_hash, g_str_equal);
+  cache->lru = g_queue_new ();
+  cache->max_fds = max_fds;
+
+  GST_DEBUG ("caching up to %d file descriptors", max_fds);
+
+  return cache;
+}
+
+void
+gss_fd_cache_free (GssFdCache * cache)
+{
+  g_return_if_fail (cache != NULL);
+
+  g_queue_foreach (cache->lru, (GFunc) gss_fd_cache_file_unref, NULL);
+  g_queue_free (cache->lru);
+  g_hash_table_unref (cache->hash);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+/**
+ * gss_fd_cache_open:
+ * @cache: a file descriptor cache
+ * @filename: path of the file
+ * @error: return location for a #GError, or NULL
+ *
+ * Returns an open, read-only file, opening it if necessary.  The
+ * descriptor stays valid until the file is passed to
+ * gss_fd_cache_release().  May be called from any thread.
+ *
+ * Returns: the file, or NULL on error
+ */
+GssFdCacheFile *
+gss_fd_cache_open (GssFdCache * cache, const char *filename, GError ** error)
+{
+  GssFdCacheFile *file;
+  struct stat sb;
+  gint64 now;
+  int fd;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&cache->lock);
+  file = g_hash_table_lookup (cache->hash, filename);
+  if (file) {
+    if (now - file->validated_time >= GSS_FD_CACHE_REVALIDATE_INTERVAL) {
+      if (stat (filename, &sb) < 0 || sb.st_dev != file->dev ||
+          sb.st_ino != file->ino) {
+        GST_DEBUG ("%s was replaced, reopening", filename);
+        gss_fd_cache_remove (cache, file);
+        file = NULL;
+      } else {
+        file->validated_time = now;
+      }
+    }
+  }
+  if (file) {
+    g_queue_unlink (cache->lru, file->link);
+    g_queue_push_head_link (cache->lru, file->link);
+    file->refcount++;
+    g_mutex_unlock (&cache->lock);
+    return file;
+  }
+  g_mutex_unlock (&cache->lock);
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    GST_WARNING ("failed to open \"%s\", error=\"%s\"", filename,
+        g_strerror (errno));
+    if (error) {
+      *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
+          "failed to open file");
+    }
+    return NULL;
+  }
+  if (fstat (fd, &sb) < 0) {
+    GST_WARNING ("failed to stat \"%s\", error=\"%s\"", filename,
+        g_strerror (errno));
+    if (error) {
+      *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
+          "failed to stat file");
+    }
+    close (fd);
+    return NULL;
+  }
+
+  file = g_new0 (GssFdCacheFile, 1);
+  file->fd = fd;
+  file->refcount = 2;
+  file->filename = g_strdup (filename);
+  file->dev = sb.st_dev;
+  file->ino = sb.st_ino;
+  file->validated_time = now;
+
+  g_mutex_lock (&cache->lock);
+  {
+    GssFdCacheFile *other = g_hash_table_lookup (cache->hash, filename);
+
+    /* another thread opened the same file meanwhile */
+    if (other)
+      gss_fd_cache_remove (cache, other);
+  }
+  file->link = g_list_alloc ();
+  file->link->data = file;
+  g_queue_push_head_link (cache->lru, file->link);
+  g_hash_table_insert (cache->hash, file->filename, file);
+  gss_fd_cache_trim (cache);
+  g_mutex_unlock (&cache->lock);
+
+  return file;
+}
+
+/**
+ * gss_fd_cache_release:
+ * @cache: a file descriptor cache
+ * @file: a file returned by gss_fd_cache_open()
+ *
+ * Releases a file.  Its descriptor must not be used afterwards.
+ */
+void
+gss_fd_cache_release (GssFdCache * cache, GssFdCacheFile * file)
+{
+  g_return_if_fail (cache != NULL);
+  g_return_if_fail (file != NULL);
+
+  g_mutex_lock (&cache->lock);
+  gss_fd_cache_file_unref (file);
+  gss_fd_cache_trim (cache);
+  g_mutex_unlock (&cache->lock);
+}
+
+/**
+ * gss_fd_cache_file_map:
+ * @cache: a file descriptor cache
+ * @file: a file returned by gss_fd_cache_open()
+ *
+ * Maps @file into memory read-only, or returns the existing mapping.
+ * The mapping is advised for random access, since requests read
+ * fragments from all over the file.
+ *
+ * Returns: a new reference to the mapping, or NULL on error
+ */
+GMappedFile *
+gss_fd_cache_file_map (GssFdCache * cache, GssFdCacheFile * file)
+{
+  GMappedFile *mapped;
+  GError *error = NULL;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (file != NULL, NULL);
+
+  g_mutex_lock (&cache->lock);
+  if (file->mapped == NULL) {
+    file->mapped = g_mapped_file_new_from_fd (file->fd, FALSE, &error);
+    if (file->mapped == NULL) {
+      GST_WARNING ("failed to map \"%s\": %s", file->filename,
+          error->message);
+      g_error_free (error);
+    } else if (g_mapped_file_get_length (file->mapped) > 0) {
+      madvise (g_mapped_file_get_contents (file->mapped),
+          g_mapped_file_get_length (file->mapped), MADV_RANDOM);
+    }
+  }
+  mapped = file->mapped ? g_mapped_file_ref (file->mapped) : NULL;
+  g_mutex_unlock (&cache->lock);
+
+  return mapped;
+}
+
+int
+gss_fd_cache_get_n_open (GssFdCache * cache)
+{
+  int n;
+
+  g_return_val_if_fail (cache != NULL, 0);
+
+  g_mutex_lock (&cache->lock);
+  n = g_queue_get_length (cache->lru);
+  g_mutex_unlock (&cache->lock);
+
+  return n;
+}
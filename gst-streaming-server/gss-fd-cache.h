@@ -0,0 +1,58 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GSS_FD_CACHE_H
+#define _GSS_FD_CACHE_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GssFdCache GssFdCache;
+typedef struct _GssFdCacheFile GssFdCacheFile;
+
+struct _GssFdCacheFile {
+  int fd;
+
+  /*< private >*/
+  int refcount;
+  char *filename;
+  dev_t dev;
+  ino_t ino;
+  gint64 validated_time;
+  GMappedFile *mapped;
+  GList *link;
+};
+
+
+GssFdCache *gss_fd_cache_new (int max_fds);
+void gss_fd_cache_free (GssFdCache *cache);
+GssFdCacheFile *gss_fd_cache_open (GssFdCache *cache, const char *filename,
+    GError **error);
+void gss_fd_cache_release (GssFdCache *cache, GssFdCacheFile *file);
+GMappedFile *gss_fd_cache_file_map (GssFdCache *cache, GssFdCacheFile *file);
+int gss_fd_cache_get_n_open (GssFdCache *cache);
+
+
+G_END_DECLS
+
+#endif
+
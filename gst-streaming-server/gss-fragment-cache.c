@@ -0,0 +1,430 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * In-memory cache of assembled (and, for DRM, encrypted) fragment
+ * payloads, shared by all worker threads.
+ *
+ * The cache is split into shards, each with its own lock, LRU list and
+ * byte budget, so that concurrent lookups of different fragments rarely
+ * contend.  Admission uses TinyLFU: every lookup is counted in a
+ * count-min sketch, and when the shard is full a new fragment only
+ * replaces the least recently used one if it has been requested more
+ * often.  This keeps one-off requests (seeks, crawlers) from flushing
+ * the popular fragments.
+ *
+ * Entries are reference counted.  Lookups return a SoupBuffer that owns
+ * a reference, so an evicted entry stays valid until the last response
+ * using it has been written.
+ */
+
+#include "config.h"
+
+#include "gss-fragment-cache.h"
+
+#include <gst/gst.h>
+#include <string.h>
+
+#define N_SHARDS 16
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096       /* per shard, must be a power of two */
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE_SIZE (10 * SKETCH_WIDTH)
+
+typedef struct _GssFragmentCacheEntry GssFragmentCacheEntry;
+typedef struct _GssFragmentCacheShard GssFragmentCacheShard;
+
+struct _GssFragmentCacheEntry
+{
+  int refcount;
+  guint32 hash;
+  char *key;
+  guint8 *data;
+  gsize size;
+  GList *link;                  /* in shard->lru, if cached */
+};
+
+struct _GssFragmentCacheShard
+{
+  GMutex lock;
+  GHashTable *hash;
+  GQueue *lru;                  /* most recently used first */
+  gsize size;
+  gsize max_size;
+
+  guint8 sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+  int n_sketch_additions;
+
+  guint64 n_hits;
+  guint64 n_misses;
+  guint64 n_insertions;
+  guint64 n_rejections;
+  guint64 n_evictions;
+};
+
+struct _GssFragmentCache
+{
+  GssFragmentCacheShard shards[N_SHARDS];
+};
+
+
+static GssFragmentCacheEntry *
+gss_fragment_cache_entry_ref (GssFragmentCacheEntry * entry)
+{
+  g_atomic_int_inc (&entry->refcount);
+  return entry;
+}
+
+static void
+gss_fragment_cache_entry_unref (GssFragmentCacheEntry * entry)
+{
+  if (g_atomic_int_dec_and_test (&entry->refcount)) {
+    g_free (entry->key);
+    g_free (entry->data);
+    g_free (entry);
+  }
+}
+
+static SoupBuffer *
+gss_fragment_cache_entry_get_buffer (GssFragmentCacheEntry * entry)
+{
+  return soup_buffer_new_with_owner (entry->data, entry->size,
+      gss_fragment_cache_entry_ref (entry),
+      (GDestroyNotify) gss_fragment_cache_entry_unref);
+}
+
+static GssFragmentCacheShard *
+get_shard (GssFragmentCache * cache, guint32 hash)
+{
+  return &cache->shards[(hash ^ (hash >> 16)) % N_SHARDS];
+}
+
+static guint32
+sketch_index (guint32 hash, int row)
+{
+  guint32 hash2 = (hash * 0x9e3779b1) | 1;
+
+  return (hash + row * hash2) & (SKETCH_WIDTH - 1);
+}
+
+static void
+sketch_increment (GssFragmentCacheShard * shard, guint32 hash)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    guint8 *counter = &shard->sketch[i][sketch_index (hash, i)];
+    if (*counter < SKETCH_MAX)
+      (*counter)++;
+  }
+
+  /* Halve all counters periodically, so that popularity reflects
+   * recent requests rather than all time. */
+  shard->n_sketch_additions++;
+  if (shard->n_sketch_additions >= SKETCH_SAMPLE_SIZE) {
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+      for (j = 0; j < SKETCH_WIDTH; j++) {
+        shard->sketch[i][j] >>= 1;
+      }
+    }
+    shard->n_sketch_additions /= 2;
+  }
+}
+
+static int
+sketch_estimate (GssFragmentCacheShard * shard, guint32 hash)
+{
+  int estimate = SKETCH_MAX;
+  int i;
+
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    estimate = MIN (estimate, shard->sketch[i][sketch_index (hash, i)]);
+  }
+
+  return estimate;
+}
+
+static void
+gss_fragment_cache_shard_remove (GssFragmentCacheShard * shard,
+    GssFragmentCacheEntry * entry)
+{
+  g_hash_table_remove (shard->hash, entry->key);
+  g_queue_delete_link (shard->lru, entry->link);
+  entry->link = NULL;
+  shard->size -= entry->size;
+  gss_fragment_cache_entry_unref (entry);
+}
+
+static void
+gss_fragment_cache_shard_trim (GssFragmentCacheShard * shard, gsize size)
+{
+  while (shard->size + size > shard->max_size) {
+    GssFragmentCacheEntry *victim = g_queue_peek_tail (shard->lru);
+
+    if (victim == NULL)
+      break;
+    gss_fragment_cache_shard_remove (shard, victim);
+    shard->n_evictions++;
+  }
+}
+
+/**
+ * gss_fragment_cache_new:
+ * @max_size: total size of cached payloads, in bytes
+ *
+ * Returns: a new fragment cache
+ */
+GssFragmentCache *
+gss_fragment_cache_new (gsize max_size)
+{
+  GssFragmentCache *cache;
+  int i;
+
+  cache = g_new0 (GssFragmentCache, 1);
+  for (i = 0; i < N_SHARDS; i++) {
+    GssFragmentCacheShard *shard = &cache->shards[i];
+
+    g_mutex_init (&shard->lock);
+    shard->hash = g_hash_table_new (g_str_hash, g_str_equal);
+    shard->lru = g_queue_new ();
+    shard->max_size = max_size / N_SHARDS;
+  }
+
+  return cache;
+}
+
+void
+gss_fragment_cache_free (GssFragmentCache * cache)
+{
+  int i;
+
+  g_return_if_fail (cache != NULL);
+
+  for (i = 0; i < N_SHARDS; i++) {
+    GssFragmentCacheShard *shard = &cache->shards[i];
+
+    g_queue_foreach (shard->lru, (GFunc) gss_fragment_cache_entry_unref, NULL);
+    g_queue_free (shard->lru);
+    g_hash_table_unref (shard->hash);
+    g_mutex_clear (&shard->lock);
+  }
+  g_free (cache);
+}
+
+void
+gss_fragment_cache_set_max_size (GssFragmentCache * cache, gsize max_size)
+{
+  int i;
+
+  g_return_if_fail (cache != NULL);
+
+  for (i = 0; i < N_SHARDS; i++) {
+    GssFragmentCacheShard *shard = &cache->shards[i];
+
+    g_mutex_lock (&shard->lock);
+    shard->max_size = max_size / N_SHARDS;
+    gss_fragment_cache_shard_trim (shard, 0);
+    g_mutex_unlock (&shard->lock);
+  }
+}
+
+/**
+ * gss_fragment_cache_lookup:
+ * @cache: a fragment cache
+ * @key: key identifying the fragment payload
+ *
+ * Looks up a fragment payload, and counts the request towards the
+ * popularity of @key.  May be called from any thread.
+ *
+ * Returns: a new #SoupBuffer for the cached payload, or NULL
+ */
+SoupBuffer *
+gss_fragment_cache_lookup (GssFragmentCache * cache, const char *key)
+{
+  GssFragmentCacheShard *shard;
+  GssFragmentCacheEntry *entry;
+  SoupBuffer *buffer = NULL;
+  guint32 hash;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  hash = g_str_hash (key);
+  shard = get_shard (cache, hash);
+
+  g_mutex_lock (&shard->lock);
+  sketch_increment (shard, hash);
+  entry = g_hash_table_lookup (shard->hash, key);
+  if (entry) {
+    g_queue_unlink (shard->lru, entry->link);
+    g_queue_push_head_link (shard->lru, entry->link);
+    shard->n_hits++;
+    buffer = gss_fragment_cache_entry_get_buffer (entry);
+  } else {
+    shard->n_misses++;
+  }
+  g_mutex_unlock (&shard->lock);
+
+  return buffer;
+}
+
+/**
+ * gss_fragment_cache_contains:
+ * @cache: a fragment cache
+ * @key: key identifying the fragment payload
+ *
+ * Unlike gss_fragment_cache_lookup(), this does not count as a request
+ * for @key.  May be called from any thread.
+ *
+ * Returns: TRUE if the payload for @key is cached
+ */
+gboolean
+gss_fragment_cache_contains (GssFragmentCache * cache, const char *key)
+{
+  GssFragmentCacheShard *shard;
+  gboolean ret;
+
+  g_return_val_if_fail (cache != NULL, FALSE);
+  g_return_val_if_fail (key != NULL, FALSE);
+
+  shard = get_shard (cache, g_str_hash (key));
+
+  g_mutex_lock (&shard->lock);
+  ret = (g_hash_table_lookup (shard->hash, key) != NULL);
+  g_mutex_unlock (&shard->lock);
+
+  return ret;
+}
+
+/**
+ * gss_fragment_cache_insert:
+ * @cache: a fragment cache
+ * @key: key identifying the fragment payload
+ * @data: (transfer full): payload, allocated with g_malloc()
+ * @size: size of @data
+ *
+ * Offers a payload to the cache.  It is stored if there is room, or if
+ * @key has been requested more often recently than the least recently
+ * used entry that would be evicted for it.  Either way, the caller gets
+ * a buffer for the data.  May be called from any thread.
+ *
+ * Returns: a new #SoupBuffer for @data
+ */
+SoupBuffer *
+gss_fragment_cache_insert (GssFragmentCache * cache, const char *key,
+    guint8 * data, gsize size)
+{
+  return gss_fragment_cache_insert_full (cache, key, data, size, FALSE);
+}
+
+/**
+ * gss_fragment_cache_insert_full:
+ * @cache: a fragment cache
+ * @key: key identifying the fragment payload
+ * @data: (transfer full): payload, allocated with g_malloc()
+ * @size: size of @data
+ * @force: store the payload even if @key is less popular than the
+ *   entry evicted for it, e.g., because it is about to be requested
+ *
+ * Like gss_fragment_cache_insert().
+ *
+ * Returns: a new #SoupBuffer for @data
+ */
+SoupBuffer *
+gss_fragment_cache_insert_full (GssFragmentCache * cache, const char *key,
+    guint8 * data, gsize size, gboolean force)
+{
+  GssFragmentCacheShard *shard;
+  GssFragmentCacheEntry *entry;
+  GssFragmentCacheEntry *victim;
+  gboolean admit;
+  SoupBuffer *buffer;
+
+  g_return_val_if_fail (cache != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  entry = g_new0 (GssFragmentCacheEntry, 1);
+  entry->refcount = 1;
+  entry->hash = g_str_hash (key);
+  entry->key = g_strdup (key);
+  entry->data = data;
+  entry->size = size;
+
+  shard = get_shard (cache, entry->hash);
+
+  g_mutex_lock (&shard->lock);
+  if (size > shard->max_size) {
+    admit = FALSE;
+  } else if (g_hash_table_lookup (shard->hash, key)) {
+    /* another thread got here first */
+    admit = FALSE;
+  } else if (force || shard->size + size <= shard->max_size) {
+    admit = TRUE;
+  } else {
+    victim = g_queue_peek_tail (shard->lru);
+    admit = (victim == NULL || sketch_estimate (shard, entry->hash) >
+        sketch_estimate (shard, victim->hash));
+  }
+
+  if (admit) {
+    gss_fragment_cache_shard_trim (shard, size);
+    entry->link = g_list_alloc ();
+    entry->link->data = entry;
+    g_queue_push_head_link (shard->lru, entry->link);
+    g_hash_table_insert (shard->hash, entry->key,
+        gss_fragment_cache_entry_ref (entry));
+    shard->size += size;
+    shard->n_insertions++;
+  } else {
+    shard->n_rejections++;
+  }
+  g_mutex_unlock (&shard->lock);
+
+  buffer = gss_fragment_cache_entry_get_buffer (entry);
+  gss_fragment_cache_entry_unref (entry);
+
+  return buffer;
+}
+
+void
+gss_fragment_cache_get_stats (GssFragmentCache * cache,
+    GssFragmentCacheStats * stats)
+{
+  int i;
+
+  g_return_if_fail (cache != NULL);
+  g_return_if_fail (stats != NULL);
+
+  memset (stats, 0, sizeof (*stats));
+  for (i = 0; i < N_SHARDS; i++) {
+    GssFragmentCacheShard *shard = &cache->shards[i];
+
+    g_mutex_lock (&shard->lock);
+    stats->n_hits += shard->n_hits;
+    stats->n_misses += shard->n_misses;
+    stats->n_insertions += shard->n_insertions;
+    stats->n_rejections += shard->n_rejections;
+    stats->n_evictions += shard->n_evictions;
+    stats->size += shard->size;
+    stats->n_entries += g_hash_table_size (shard->hash);
+    g_mutex_unlock (&shard->lock);
+  }
+}
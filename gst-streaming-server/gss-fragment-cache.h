@@ -0,0 +1,63 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_FRAGMENT_CACHE_H
+#define _GSS_FRAGMENT_CACHE_H
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GssFragmentCache GssFragmentCache;
+typedef struct _GssFragmentCacheStats GssFragmentCacheStats;
+
+struct _GssFragmentCacheStats {
+  guint64 n_hits;
+  guint64 n_misses;
+  guint64 n_insertions;
+  guint64 n_rejections;
+  guint64 n_evictions;
+  gsize size;
+  int n_entries;
+};
+
+
+GssFragmentCache *gss_fragment_cache_new (gsize max_size);
+void gss_fragment_cache_free (GssFragmentCache *cache);
+void gss_fragment_cache_set_max_size (GssFragmentCache *cache,
+    gsize max_size);
+SoupBuffer *gss_fragment_cache_lookup (GssFragmentCache *cache,
+    const char *key);
+gboolean gss_fragment_cache_contains (GssFragmentCache *cache,
+    const char *key);
+SoupBuffer *gss_fragment_cache_insert (GssFragmentCache *cache,
+    const char *key, guint8 *data, gsize size);
+SoupBuffer *gss_fragment_cache_insert_full (GssFragmentCache *cache,
+    const char *key, guint8 *data, gsize size, gboolean force);
+void gss_fragment_cache_get_stats (GssFragmentCache *cache,
+    GssFragmentCacheStats *stats);
+
+
+G_END_DECLS
+
+#endif
+
@@ -22,8 +22,16 @@
 #include "config.h"
 
 #include "gss-server.h"
+#include "gss-soup.h"
 #include "gss-utils.h"
 
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* CAN-SKIP-UNTIL, in units of the target duration.  Six is the minimum
+ * allowed by the HLS specification. */
+#define GSS_HLS_SKIP_TARGET_DURATIONS 6
 
 
 enum
@@ -34,9 +42,11 @@ enum
 
 static void gss_hls_handle_m3u8 (GssTransaction * t);
 static void gss_hls_handle_stream_m3u8 (GssTransaction * t);
-static void gss_hls_handle_ts_chunk (GssTransaction * t);
+static void gss_hls_handle_segment (GssTransaction * t);
+static void gss_hls_handle_key (GssTransaction * t);
 
-void gss_program_add_hls_chunk (GssStream * stream, SoupBuffer * buf);
+GssHLSSegment *gss_program_add_hls_chunk (GssStream * stream,
+    SoupBuffer * buf, double duration);
 
 #if GST_CHECK_VERSION(1,0,0)
 static GstPadProbeReturn sink_probe_callback (GstPad * pad,
@@ -60,6 +70,7 @@ gss_stream_add_hls (GssStream * stream)
   if (!program->enable_hls) {
 
     program->hls.target_duration = 4;
+    program->hls.epoch = g_random_int ();
 
     program->enable_hls = TRUE;
 
@@ -116,14 +127,43 @@ gss_stream_add_hls (GssStream * stream)
   stream->is_hls = TRUE;
 
   stream->adapter = gst_adapter_new ();
+  gss_mpegts_scanner_init (&stream->hls.scanner);
+  stream->hls.key_index = -1;
+  /* A pushed stream that restarts is a new GssStream that counts its
+   * segments and playlist versions from 0 again, under the same URLs.
+   * The epoch keeps those apart from what caches hold of the old one. */
+  stream->hls.epoch = g_random_int ();
 
   s = g_strdup_printf ("/%s-%dx%d-%dkbps%s.m3u8", GSS_OBJECT_NAME (program),
       stream->width, stream->height, stream->bitrate / 1000,
       gss_stream_type_get_mod (stream->type));
-  gss_server_add_resource (GSS_OBJECT_SERVER (program), s, 0,
+  stream->hls.index_resource =
+      gss_server_add_resource (GSS_OBJECT_SERVER (program), s, 0,
       "video/x-mpegurl", gss_hls_handle_stream_m3u8, NULL, NULL, stream);
   g_free (s);
 
+  /* All segments of the stream are served by one prefix resource, so
+   * adding a segment does not touch the server's resource table. */
+  s = g_strdup_printf ("/%s-%dx%d-%dkbps%s/", GSS_OBJECT_NAME (program),
+      stream->width, stream->height, stream->bitrate / 1000,
+      gss_stream_type_get_mod (stream->type));
+  stream->hls.segment_resource =
+      gss_server_add_resource (GSS_OBJECT_SERVER (program), s,
+      GSS_RESOURCE_PREFIX, "video/mp2t", gss_hls_handle_segment, NULL, NULL,
+      stream);
+  g_free (s);
+
+  /* AES-128 keys are only handed out over HTTPS; anyone who can read
+   * them over plain HTTP can also read the segments. */
+  s = g_strdup_printf ("/%s-%dx%d-%dkbps%s-keys/", GSS_OBJECT_NAME (program),
+      stream->width, stream->height, stream->bitrate / 1000,
+      gss_stream_type_get_mod (stream->type));
+  stream->hls.key_resource =
+      gss_server_add_resource (GSS_OBJECT_SERVER (program), s,
+      GSS_RESOURCE_PREFIX | GSS_RESOURCE_HTTPS_ONLY, NULL, gss_hls_handle_key,
+      NULL, NULL, stream);
+  g_free (s);
+
   gss_hls_update_variant (program);
 }
 
@@ -134,63 +174,177 @@ struct _ChunkCallback
   GssStream *stream;
   guint8 *data;
   int n;
+  double duration;
+  gboolean is_encrypted;
+  int key_index;
+  guint8 key[16];
 };
 
 static gboolean
 gss_program_add_hls_chunk_callback (gpointer data)
 {
   ChunkCallback *chunk_callback = (ChunkCallback *) data;
+  GssHLSSegment *segment;
   SoupBuffer *buffer;
 
   buffer =
       soup_buffer_new (SOUP_MEMORY_TAKE, chunk_callback->data,
       chunk_callback->n);
-  gss_program_add_hls_chunk (chunk_callback->stream, buffer);
+  segment = gss_program_add_hls_chunk (chunk_callback->stream, buffer,
+      chunk_callback->duration);
+  if (chunk_callback->is_encrypted) {
+    segment->is_encrypted = TRUE;
+    segment->key_index = chunk_callback->key_index;
+    memcpy (segment->key, chunk_callback->key, 16);
+  }
 
   g_free (chunk_callback);
 
   return FALSE;
 }
 
+/* Keys are served by an HTTPS-only resource, at an absolute URI, so
+ * both an HTTPS server and a host name for it are needed. */
+static gboolean
+gss_hls_can_serve_keys (GssServer * server)
+{
+  return server->ssl_server != NULL && server->base_url_https[0] != '\0';
+}
+
+/* Called in the streaming thread when the scanner finds a keyframe.
+ * Everything before it is in the adapter, followed by the first @keep
+ * bytes of the keyframe packet if it started in the previous buffer. */
+static void
+gss_hls_finish_segment (GssStream * stream, gsize keep)
+{
+  GssMpegtsScanner *scanner = &stream->hls.scanner;
+  ChunkCallback *chunk_callback;
+  double duration;
+  int n;
+
+  if (!stream->hls.have_segment_start) {
+    stream->hls.have_segment_start = scanner->have_pcr;
+    stream->hls.segment_start_pcr = scanner->pcr;
+  }
+
+  n = gst_adapter_available (stream->adapter) - keep;
+  if (n < 188 * 100) {
+    /* skipped (too early) */
+    return;
+  }
+
+  if (stream->hls.have_segment_start && scanner->have_pcr) {
+    duration = gss_mpegts_pcr_elapsed (stream->hls.segment_start_pcr,
+        scanner->pcr);
+  } else {
+    duration = stream->program->hls.target_duration;
+  }
+  stream->hls.have_segment_start = scanner->have_pcr;
+  stream->hls.segment_start_pcr = scanner->pcr;
+
+  chunk_callback = g_malloc0 (sizeof (ChunkCallback));
+  chunk_callback->data = gst_adapter_take (stream->adapter, n);
+  chunk_callback->n = n;
+  chunk_callback->duration = duration;
+  chunk_callback->stream = stream;
+
+  /* Segments are encrypted once here, in the streaming thread, so the
+   * cost is independent of the number of viewers and stays out of the
+   * main loop. */
+  if (stream->program->hls.is_encrypted &&
+      !gss_hls_can_serve_keys (GSS_OBJECT_SERVER (stream->program))) {
+    if (!stream->hls.warned_no_https) {
+      GST_WARNING ("hls-encrypt is set for %s, but keys can only be served "
+          "over HTTPS, and the server has no HTTPS port or host name; "
+          "publishing unencrypted segments",
+          GSS_OBJECT_NAME (stream->program));
+      stream->hls.warned_no_https = TRUE;
+    }
+  } else if (stream->program->hls.is_encrypted) {
+    int rotation = stream->program->hls.key_rotation;
+    int key_index;
+
+    key_index = (rotation > 0) ? stream->hls.n_published / rotation : 0;
+    if (key_index != stream->hls.key_index) {
+      gss_utils_get_random_bytes (stream->hls.key, 16);
+      stream->hls.key_index = key_index;
+    }
+
+    chunk_callback->data = g_realloc (chunk_callback->data, n + 16);
+    chunk_callback->n = gss_hls_encrypt_segment (chunk_callback->data, n,
+        stream->hls.key, stream->hls.n_published);
+    chunk_callback->is_encrypted = TRUE;
+    chunk_callback->key_index = key_index;
+    memcpy (chunk_callback->key, stream->hls.key, 16);
+  }
+  stream->hls.n_published++;
+
+  g_idle_add (gss_program_add_hls_chunk_callback, chunk_callback);
+}
+
+static void
+gss_hls_push_region (GssStream * stream, GstBuffer * buffer, gsize offset,
+    gsize size)
+{
+  if (size == 0)
+    return;
+#if GST_CHECK_VERSION(1,0,0)
+  gst_adapter_push (stream->adapter, gst_buffer_copy_region (buffer,
+          GST_BUFFER_COPY_MEMORY, offset, size));
+#else
+  gst_adapter_push (stream->adapter, gst_buffer_create_sub (buffer, offset,
+          size));
+#endif
+}
+
+/* Walks every packet in the buffer, so that segments are split exactly
+ * at the first packet of a keyframe even when it is in the middle of a
+ * buffer, or straddles two buffers. */
+static void
+gss_hls_scan_buffer (GssStream * stream, GstBuffer * buffer,
+    const guint8 * data, gsize size)
+{
+  gsize pushed = 0;
+  gsize offset = 0;
+  gssize split;
+
+  while (gss_mpegts_scanner_scan (&stream->hls.scanner, data, size, &offset,
+          &split)) {
+    if (split < 0) {
+      /* the keyframe packet started in the previous buffer */
+      gss_hls_finish_segment (stream, -split);
+    } else {
+      gss_hls_push_region (stream, buffer, pushed, split - pushed);
+      pushed = split;
+      gss_hls_finish_segment (stream, 0);
+    }
+  }
+
+  if (pushed == 0) {
+    gst_adapter_push (stream->adapter, gst_buffer_ref (buffer));
+  } else {
+    gss_hls_push_region (stream, buffer, pushed, size - pushed);
+  }
+}
+
 #if GST_CHECK_VERSION(1,0,0)
 static GstPadProbeReturn
 sink_probe_callback (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
   GssStream *stream = GSS_STREAM (user_data);
 
-  if (info->type == GST_PAD_PROBE_TYPE_BUFFER) {
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
     GstBuffer *buffer = GST_BUFFER (info->data);
     GstMapInfo mapinfo;
-    guint8 *data;
-    gboolean ret;
 
-    ret = gst_buffer_map (buffer, &mapinfo, GST_MAP_READ);
-    if (!ret) {
+    if (!gst_buffer_map (buffer, &mapinfo, GST_MAP_READ)) {
       GST_ERROR ("failed map");
+      return GST_PAD_PROBE_OK;
     }
-    data = mapinfo.data;
-
-    if (((data[3] >> 4) & 2) && ((data[5] >> 6) & 1)) {
-      int n;
 
-      n = gst_adapter_available (stream->adapter);
-      if (n < 188 * 100) {
-        /* skipped (too early) */
-      } else {
-        ChunkCallback *chunk_callback;
-
-        chunk_callback = g_malloc0 (sizeof (ChunkCallback));
-        chunk_callback->data = gst_adapter_take (stream->adapter, n);
-        chunk_callback->n = n;
-        chunk_callback->stream = stream;
-
-        g_idle_add (gss_program_add_hls_chunk_callback, chunk_callback);
-      }
-    }
+    gss_hls_scan_buffer (stream, buffer, mapinfo.data, mapinfo.size);
 
     gst_buffer_unmap (buffer, &mapinfo);
-
-    gst_adapter_push (stream->adapter, gst_buffer_ref (buffer));
   }
 
   return GST_PAD_PROBE_OK;
@@ -203,27 +357,9 @@ sink_data_probe_callback (GstPad * pad, GstMiniObject * mo, gpointer user_data)
 
   if (GST_IS_BUFFER (mo)) {
     GstBuffer *buffer = GST_BUFFER (mo);
-    guint8 *data = GST_BUFFER_DATA (buffer);
-
-    if (((data[3] >> 4) & 2) && ((data[5] >> 6) & 1)) {
-      int n;
-
-      n = gst_adapter_available (stream->adapter);
-      if (n < 188 * 100) {
-        /* skipped (too early) */
-      } else {
-        ChunkCallback *chunk_callback;
-
-        chunk_callback = g_malloc0 (sizeof (ChunkCallback));
-        chunk_callback->data = gst_adapter_take (stream->adapter, n);
-        chunk_callback->n = n;
-        chunk_callback->stream = stream;
-
-        g_idle_add (gss_program_add_hls_chunk_callback, chunk_callback);
-      }
-    }
 
-    gst_adapter_push (stream->adapter, gst_buffer_ref (buffer));
+    gss_hls_scan_buffer (stream, buffer, GST_BUFFER_DATA (buffer),
+        GST_BUFFER_SIZE (buffer));
   } else {
     /* got event */
   }
@@ -232,32 +368,50 @@ sink_data_probe_callback (GstPad * pad, GstMiniObject * mo, gpointer user_data)
 }
 #endif
 
-void
-gss_program_add_hls_chunk (GssStream * stream, SoupBuffer * buf)
+/* Segments are cut at keyframes, so a long GOP makes a segment longer
+ * than the target duration.  EXTINF rounded to the nearest second must
+ * not exceed EXT-X-TARGETDURATION, so the target duration of the
+ * program is raised to match, and every playlist of the program is
+ * regenerated with a new ETag.  max-age and CAN-SKIP-UNTIL follow. */
+static void
+gss_hls_update_target_duration (GssProgram * program, double duration)
+{
+  int target_duration = (int) (duration + 0.5);
+  GList *g;
+
+  if (target_duration <= program->hls.target_duration)
+    return;
+
+  GST_INFO ("%s: segment of %.3f s, raising target duration to %d",
+      GSS_OBJECT_NAME (program), duration, target_duration);
+  program->hls.target_duration = target_duration;
+
+  for (g = program->streams; g; g = g_list_next (g)) {
+    GssStream *stream = g->data;
+
+    if (stream->is_hls)
+      stream->hls.need_index_update = TRUE;
+  }
+}
+
+GssHLSSegment *
+gss_program_add_hls_chunk (GssStream * stream, SoupBuffer * buf,
+    double duration)
 {
   GssHLSSegment *segment;
 
   segment = &stream->chunks[stream->n_chunks % GSS_STREAM_HLS_CHUNKS];
 
   if (segment->buffer) {
-    gss_server_remove_resource (GSS_OBJECT_SERVER (stream->program),
-        segment->location);
-    g_free (segment->location);
     soup_buffer_free (segment->buffer);
   }
   segment->index = stream->n_chunks;
   segment->buffer = buf;
-  segment->location = g_strdup_printf ("/%s-%dx%d-%dkbps%s-%05d.ts",
-      GSS_OBJECT_NAME (stream->program), stream->width, stream->height,
-      stream->bitrate / 1000, gss_stream_type_get_mod (stream->type),
-      stream->n_chunks);
-  segment->duration = stream->program->hls.target_duration;
+  segment->duration = duration;
+  segment->is_encrypted = FALSE;
 
   stream->hls.need_index_update = TRUE;
-
-  gss_server_add_resource (GSS_OBJECT_SERVER (stream->program),
-      segment->location, 0, "video/mp2t", gss_hls_handle_ts_chunk, NULL, NULL,
-      segment);
+  gss_hls_update_target_duration (stream->program, duration);
 
   stream->n_chunks++;
   stream->program->n_hls_chunks = stream->n_chunks;
@@ -266,62 +420,163 @@ gss_program_add_hls_chunk (GssStream * stream, SoupBuffer * buf)
     gss_hls_update_variant (stream->program);
   }
 
+  return segment;
+}
+
+/**
+ * gss_hls_encrypt_segment:
+ * @data: segment data, followed by room for 16 bytes of padding
+ * @size: size of the segment
+ * @key: 16 byte AES key
+ * @sequence: media sequence number of the segment
+ *
+ * Encrypts a segment in place with AES-128-CBC and PKCS7 padding, as
+ * specified for EXT-X-KEY:METHOD=AES-128.  The IV is the media
+ * sequence number, which is what clients use when EXT-X-KEY has no
+ * IV attribute.  OpenSSL uses AES-NI when the CPU has it.
+ *
+ * Returns: the size of the encrypted segment
+ */
+gsize
+gss_hls_encrypt_segment (guint8 * data, gsize size, const guint8 * key,
+    guint64 sequence)
+{
+  EVP_CIPHER_CTX *ctx;
+  guint8 iv[16];
+  int len = 0;
+  int final_len = 0;
+
+  memset (iv, 0, 8);
+  GST_WRITE_UINT64_BE (iv + 8, sequence);
+
+  ctx = EVP_CIPHER_CTX_new ();
+  EVP_EncryptInit_ex (ctx, EVP_aes_128_cbc (), NULL, key, iv);
+  EVP_EncryptUpdate (ctx, data, &len, data, size);
+  EVP_EncryptFinal_ex (ctx, data + len, &final_len);
+  EVP_CIPHER_CTX_free (ctx);
+
+  return len + final_len;
 }
 
 
 static void
-gss_hls_update_index (GssStream * stream)
+gss_hls_append_index_header (GString * s, GssStream * stream, int version,
+    int seq_num)
 {
   GssProgram *program = stream->program;
-  GString *s;
-  int i;
-  int seq_num = MAX (0, program->n_hls_chunks - 5);
-
-  s = g_string_new ("#EXTM3U\n");
 
+  g_string_append (s, "#EXTM3U\n");
+  g_string_append_printf (s, "#EXT-X-VERSION:%d\n", version);
   g_string_append_printf (s, "#EXT-X-TARGETDURATION:%d\n",
       program->hls.target_duration);
   g_string_append_printf (s, "#EXT-X-MEDIA-SEQUENCE:%d\n", seq_num);
-  if (program->hls.is_encrypted) {
-    g_string_append_printf (s, "#EXT-X-KEY:METHOD=AES-128,URI=\"%s\"",
-        program->hls.key_uri);
-    if (program->hls.have_iv) {
-      g_string_append_printf (s, ",IV=0x%08x%08x%08x%08x",
-          program->hls.init_vector[0], program->hls.init_vector[1],
-          program->hls.init_vector[2], program->hls.init_vector[3]);
-    } else {
-      g_string_append (s, "\n");
-    }
-  } else {
-    g_string_append (s, "#EXT-X-KEY:METHOD=NONE\n");
+  if (!stream->hls.at_eos) {
+    g_string_append_printf (s, "#EXT-X-SERVER-CONTROL:CAN-SKIP-UNTIL=%d\n",
+        GSS_HLS_SKIP_TARGET_DURATIONS * program->hls.target_duration);
   }
-
   if (0) {
     g_string_append (s, "#EXT-X-PROGRAM-DATE-TIME:YYYY-MM-DDThh:mm:ssZ\n");
   }
-  g_string_append (s, "#EXT-X-ALLOW-CACHE:NO\n");
-  g_string_append (s, "#EXT-X-VERSION:1\n");
+}
+
+static void
+gss_hls_append_index_segments (GString * s, GssStream * stream, int start,
+    int end)
+{
+  const char *prefix = stream->hls.segment_resource->location + 1;
+  const char *base_url_https =
+      GSS_OBJECT_SERVER (stream->program)->base_url_https;
+  GssHLSSegment *prev = NULL;
+  int i;
 
-  for (i = seq_num; i < stream->n_chunks; i++) {
+  /* Segment URIs are relative to the playlist, so the cached playlist
+   * is valid for every host name and for both HTTP and HTTPS.  Key
+   * URIs are absolute, since keys are only served over HTTPS. */
+  for (i = start; i < end; i++) {
     GssHLSSegment *segment = &stream->chunks[i % GSS_STREAM_HLS_CHUNKS];
+    char duration[G_ASCII_DTOSTR_BUF_SIZE];
+
+    /* EXT-X-KEY applies until the next one, so it is only needed at the
+     * start of the list and where the key changes. */
+    if (segment->is_encrypted) {
+      if (prev == NULL || !prev->is_encrypted ||
+          prev->key_index != segment->key_index) {
+        g_string_append_printf (s, "#EXT-X-KEY:METHOD=AES-128,"
+            "URI=\"%s%s%d.key\"\n", base_url_https,
+            stream->hls.key_resource->location, segment->key_index);
+      }
+    } else if (prev && prev->is_encrypted) {
+      g_string_append (s, "#EXT-X-KEY:METHOD=NONE\n");
+    }
+    prev = segment;
 
-    g_string_append_printf (s,
-        "#EXTINF:%d,\n"
-        "%s%s\n",
-        segment->duration, GSS_OBJECT_SERVER (program)->base_url,
-        segment->location);
+    g_ascii_formatd (duration, sizeof (duration), "%.3f", segment->duration);
+    g_string_append_printf (s, "#EXTINF:%s,\n%s%08x-%05d.ts\n", duration,
+        prefix, stream->hls.epoch, segment->index);
   }
 
   if (stream->hls.at_eos) {
     g_string_append (s, "#EXT-X-ENDLIST\n");
   }
+}
+
+static void
+gss_hls_update_index (GssStream * stream)
+{
+  GssProgram *program = stream->program;
+  GString *s;
+  int i;
+  int seq_num;
+  int n_skipped;
+  int skip_until;
+  double remaining;
+
+  seq_num = MAX (0, stream->n_chunks - program->hls.window);
+
+  /* A delta update may replace segments that start more than
+   * CAN-SKIP-UNTIL seconds before the end of the playlist. */
+  skip_until = GSS_HLS_SKIP_TARGET_DURATIONS * program->hls.target_duration;
+  n_skipped = 0;
+  remaining = 0;
+  for (i = stream->n_chunks - 1; i >= seq_num; i--) {
+    if (remaining >= skip_until) {
+      n_skipped = i - seq_num + 1;
+      break;
+    }
+    remaining += stream->chunks[i % GSS_STREAM_HLS_CHUNKS].duration;
+  }
+
+  stream->hls.index_version++;
 
+  s = g_string_new (NULL);
+  gss_hls_append_index_header (s, stream, 3, seq_num);
+  gss_hls_append_index_segments (s, stream, seq_num, stream->n_chunks);
   if (stream->hls.index_buffer) {
     soup_buffer_free (stream->hls.index_buffer);
   }
   stream->hls.index_buffer = soup_buffer_new (SOUP_MEMORY_TAKE, s->str, s->len);
   g_string_free (s, FALSE);
 
+  s = g_string_new (NULL);
+  gss_hls_append_index_header (s, stream, 9, seq_num);
+  if (n_skipped > 0) {
+    g_string_append_printf (s, "#EXT-X-SKIP:SKIPPED-SEGMENTS=%d\n", n_skipped);
+  }
+  gss_hls_append_index_segments (s, stream, seq_num + n_skipped,
+      stream->n_chunks);
+  if (stream->hls.delta_buffer) {
+    soup_buffer_free (stream->hls.delta_buffer);
+  }
+  stream->hls.delta_buffer = soup_buffer_new (SOUP_MEMORY_TAKE, s->str, s->len);
+  g_string_free (s, FALSE);
+
+  g_free (stream->hls.index_etag);
+  stream->hls.index_etag = g_strdup_printf ("\"%08x-%u\"",
+      stream->hls.epoch, stream->hls.index_version);
+  g_free (stream->hls.delta_etag);
+  stream->hls.delta_etag = g_strdup_printf ("\"%08x-%u-skip\"",
+      stream->hls.epoch, stream->hls.index_version);
+
   stream->hls.need_index_update = FALSE;
 }
 
@@ -347,8 +602,7 @@ gss_hls_update_variant (GssProgram * program)
         "CODECS=\"%s\",RESOLUTION=\"%dx%d\"\n",
         stream->program_id,
         stream->bitrate, stream->codecs, stream->width, stream->height);
-    g_string_append_printf (s, "%s/%s-%dx%d-%dkbps%s.m3u8\n",
-        GSS_OBJECT_SERVER (program)->base_url,
+    g_string_append_printf (s, "%s-%dx%d-%dkbps%s.m3u8\n",
         GSS_OBJECT_NAME (program),
         stream->width, stream->height, stream->bitrate / 1000,
         gss_stream_type_get_mod (stream->type));
@@ -360,6 +614,20 @@ gss_hls_update_variant (GssProgram * program)
       soup_buffer_new (SOUP_MEMORY_TAKE, s->str, s->len);
   g_string_free (s, FALSE);
 
+  program->hls.variant_version++;
+  g_free (program->hls.variant_etag);
+  program->hls.variant_etag = g_strdup_printf ("\"%08x-v%u\"",
+      program->hls.epoch, program->hls.variant_version);
+}
+
+static void
+gss_hls_set_max_age (GssTransaction * t, int max_age)
+{
+  char *s;
+
+  s = g_strdup_printf ("max-age=%d", MAX (1, max_age));
+  soup_message_headers_replace (t->msg->response_headers, "Cache-Control", s);
+  g_free (s);
 }
 
 static void
@@ -369,9 +637,11 @@ gss_hls_handle_m3u8 (GssTransaction * t)
 
   g_assert (program->hls.variant_buffer != NULL);
 
+  gss_hls_set_max_age (t, program->hls.target_duration);
+  if (gss_soup_message_check_etag (t->msg, program->hls.variant_etag))
+    return;
+
   soup_message_set_status (t->msg, SOUP_STATUS_OK);
-  soup_message_headers_replace (t->msg->response_headers,
-      "Cache-Control", "no-store");
   soup_message_body_append_buffer (t->msg->response_body,
       program->hls.variant_buffer);
 }
@@ -380,28 +650,136 @@ static void
 gss_hls_handle_stream_m3u8 (GssTransaction * t)
 {
   GssStream *stream = (GssStream *) t->resource->priv;
+  const char *skip = NULL;
+  SoupBuffer *buffer;
+  const char *etag;
 
   if (stream->hls.index_buffer == NULL || stream->hls.need_index_update) {
     gss_hls_update_index (stream);
   }
 
+  if (t->query) {
+    skip = g_hash_table_lookup (t->query, "_HLS_skip");
+  }
+  if (skip && (strcmp (skip, "YES") == 0 || strcmp (skip, "v2") == 0)) {
+    buffer = stream->hls.delta_buffer;
+    etag = stream->hls.delta_etag;
+  } else {
+    buffer = stream->hls.index_buffer;
+    etag = stream->hls.index_etag;
+  }
+
+  /* A new segment shows up every target duration, so half of that keeps
+   * caches from serving a playlist that is more than one segment stale. */
+  gss_hls_set_max_age (t, stream->program->hls.target_duration / 2);
+  if (gss_soup_message_check_etag (t->msg, etag))
+    return;
+
   soup_message_set_status (t->msg, SOUP_STATUS_OK);
-  soup_message_headers_replace (t->msg->response_headers,
-      "Cache-Control", "no-store");
-  soup_message_body_append_buffer (t->msg->response_body,
-      stream->hls.index_buffer);
+  soup_message_body_append_buffer (t->msg->response_body, buffer);
 }
 
 static void
-gss_hls_handle_ts_chunk (GssTransaction * t)
+gss_hls_handle_key (GssTransaction * t)
 {
-  GssHLSSegment *segment = (GssHLSSegment *) t->resource->priv;
+  GssStream *stream = (GssStream *) t->resource->priv;
+  const char *name = t->path + strlen (t->resource->location);
+  char *end;
+  long key_index;
+  int i;
 
-  soup_message_set_status (t->msg, SOUP_STATUS_OK);
+  key_index = strtol (name, &end, 10);
+  if (!g_ascii_isdigit (name[0]) || strcmp (end, ".key") != 0) {
+    gss_transaction_error_not_found (t, "bad key name");
+    return;
+  }
 
+  /* Keys live as long as a segment that uses them is in the ring */
+  for (i = 0; i < GSS_STREAM_HLS_CHUNKS; i++) {
+    GssHLSSegment *segment = &stream->chunks[i];
+
+    if (segment->buffer && segment->is_encrypted &&
+        segment->key_index == key_index) {
+      soup_message_headers_replace (t->msg->response_headers,
+          "Content-Type", "application/octet-stream");
+      soup_message_headers_replace (t->msg->response_headers,
+          "Cache-Control", "private, no-store");
+      soup_message_set_status (t->msg, SOUP_STATUS_OK);
+      soup_message_body_append (t->msg->response_body, SOUP_MEMORY_COPY,
+          segment->key, 16);
+      return;
+    }
+  }
+
+  if (key_index > stream->hls.key_index) {
+    gss_transaction_error_not_found (t, "key not available yet");
+  } else {
+    t->debug_message = "key expired";
+    soup_message_set_status (t->msg, SOUP_STATUS_GONE);
+  }
   soup_message_headers_replace (t->msg->response_headers,
-      "Cache-Control", "no-store");
+      "Cache-Control", "no-cache");
+}
+
+static void
+gss_hls_handle_segment (GssTransaction * t)
+{
+  GssStream *stream = (GssStream *) t->resource->priv;
+  GssHLSSegment *segment;
+  const char *name;
+  char *end;
+  gulong epoch;
+  gulong index;
+
+  name = t->path + strlen (t->resource->location);
+  if (!g_ascii_isxdigit (name[0])) {
+    gss_transaction_error_not_found (t, "bad segment name");
+    return;
+  }
+  epoch = strtoul (name, &end, 16);
+  if (end[0] != '-' || !g_ascii_isdigit (end[1])) {
+    gss_transaction_error_not_found (t, "bad segment name");
+    return;
+  }
+  index = strtoul (end + 1, &end, 10);
+  if (strcmp (end, ".ts") != 0) {
+    gss_transaction_error_not_found (t, "bad segment name");
+    return;
+  }
+
+  if (epoch != stream->hls.epoch) {
+    /* from an earlier instance of the stream */
+    t->debug_message = "segment expired";
+    soup_message_set_status (t->msg, SOUP_STATUS_GONE);
+    soup_message_headers_replace (t->msg->response_headers,
+        "Cache-Control", "no-cache");
+    return;
+  }
+
+  if (index >= (gulong) stream->n_chunks) {
+    gss_transaction_error_not_found (t, "segment not available yet");
+    soup_message_headers_replace (t->msg->response_headers,
+        "Cache-Control", "no-cache");
+    return;
+  }
+
+  segment = &stream->chunks[index % GSS_STREAM_HLS_CHUNKS];
+  if (segment->buffer == NULL || segment->index != (int) index) {
+    t->debug_message = "segment expired";
+    soup_message_set_status (t->msg, SOUP_STATUS_GONE);
+    soup_message_headers_replace (t->msg->response_headers,
+        "Cache-Control", "no-cache");
+    return;
+  }
 
+  /* A segment stays in the ring for GSS_STREAM_HLS_CHUNKS target
+   * durations, and its contents never change while it is there.  Its
+   * name includes the stream epoch, so it is never reused for other
+   * contents after a restart. */
+  gss_hls_set_max_age (t,
+      GSS_STREAM_HLS_CHUNKS * stream->program->hls.target_duration);
+
+  soup_message_set_status (t->msg, SOUP_STATUS_OK);
   soup_message_body_append_buffer (t->msg->response_body, segment->buffer);
 }
 
@@ -40,6 +40,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <openssl/aes.h>
 
@@ -88,6 +89,8 @@ const guint8 uuid_gss_sample_encryption[16] = {
 
 static gboolean file_read (GssIsomParser * parser, guint8 * buffer,
     guint64 offset, guint64 n_bytes);
+static const guint8 *gss_isom_parser_get_box_data (GssIsomParser * parser,
+    guint64 offset, guint64 size);
 static void gss_isom_parse_ftyp (GssIsomParser * parser, guint64 offset,
     guint64 size);
 static void gss_isom_parse_moof (GssIsomParser * parser,
@@ -129,6 +132,8 @@ static void gss_isom_parser_fragmentize_track_audio (GssIsomTrack * audio_track,
 
 static guint64 gss_isom_moof_get_duration (GssIsomFragment * fragment);
 
+#define GSS_ISOM_TIMESTAMP_TOLERANCE 10
+
 
 #define CHECK_END(br) do { \
   if ((br)->byte < (br)->size) \
@@ -154,10 +159,14 @@ gss_isom_parser_new (void)
 void
 gss_isom_parser_free (GssIsomParser * parser)
 {
-  gss_isom_movie_free (parser->movie);
+  if (parser->movie)
+    gss_isom_movie_free (parser->movie);
 
   g_free (parser->filename);
   g_free (parser->data);
+  if (parser->map) {
+    munmap (parser->map, parser->file_size);
+  }
   if (parser->fd > 0) {
     close (parser->fd);
   }
@@ -170,15 +179,47 @@ gss_isom_track_get_fragment (GssIsomTrack * track, int index)
   return track->fragments[index];
 }
 
+/* Fragments are stored in presentation order, so they can be found
+ * with a binary search.  Clients don't always compute start times with
+ * the same rounding as the manifest, so a timestamp within
+ * 1/GSS_ISOM_TIMESTAMP_TOLERANCE of a fragment's duration from its
+ * start also matches it. */
 GssIsomFragment *
 gss_isom_track_get_fragment_by_timestamp (GssIsomTrack * track,
     guint64 timestamp)
 {
-  int i;
+  GssIsomFragment *fragment;
+  int low = 0;
+  int high = track->n_fragments;
 
-  for (i = 0; i < track->n_fragments; i++) {
-    if (track->fragments[i]->timestamp == timestamp) {
-      return track->fragments[i];
+  /* find the first fragment that starts after timestamp */
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+
+    if (track->fragments[mid]->timestamp <= timestamp) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (low > 0) {
+    /* empty fragments share a timestamp with the next one */
+    while (low > 1 && track->fragments[low - 2]->timestamp ==
+        track->fragments[low - 1]->timestamp) {
+      low--;
+    }
+    fragment = track->fragments[low - 1];
+    if (timestamp - fragment->timestamp <=
+        fragment->duration / GSS_ISOM_TIMESTAMP_TOLERANCE) {
+      return fragment;
+    }
+  }
+  if (low < track->n_fragments) {
+    fragment = track->fragments[low];
+    if (fragment->timestamp - timestamp <=
+        fragment->duration / GSS_ISOM_TIMESTAMP_TOLERANCE) {
+      return fragment;
     }
   }
 
@@ -229,6 +270,55 @@ gss_isom_parser_load_chunk (GssIsomParser * parser, guint64 offset,
   file_read (parser, parser->data, parser->data_offset, parser->data_size);
 }
 
+/* Returns the @size bytes at @offset, pointing into the mapped file if
+ * there is one, or else read into parser->data.  Valid until the next
+ * call. */
+static const guint8 *
+gss_isom_parser_get_box_data (GssIsomParser * parser, guint64 offset,
+    guint64 size)
+{
+  if (parser->map) {
+    if (offset + size > parser->file_size) {
+      GST_ERROR ("box at offset %" G_GUINT64_FORMAT " extends past end "
+          "of file", offset);
+      parser->error = TRUE;
+      return NULL;
+    }
+    return parser->map + offset;
+  }
+
+  gss_isom_parser_load_chunk (parser, offset, size);
+  if (parser->error)
+    return NULL;
+  return parser->data;
+}
+
+static void
+gss_isom_parser_close (GssIsomParser * parser)
+{
+  g_free (parser->data);
+  parser->data = NULL;
+  parser->data_size = 0;
+  if (parser->map) {
+    munmap (parser->map, parser->file_size);
+    parser->map = NULL;
+  }
+  close (parser->fd);
+  parser->fd = -1;
+}
+
+/**
+ * gss_isom_parser_parse_file:
+ * @parser: a parser
+ * @filename: the file to parse
+ *
+ * Parses the boxes of @filename.  If parser->use_mmap is set, the file
+ * is mapped and parsed in place, which avoids a read() and a copy for
+ * every box.  Otherwise, or if mapping fails, boxes are read into a
+ * buffer.
+ *
+ * Returns: TRUE on success
+ */
 gboolean
 gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
 {
@@ -253,6 +343,19 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
     parser->file_size = sb.st_size;
   }
 
+  if (parser->use_mmap && parser->file_size > 0) {
+    parser->map = mmap (NULL, parser->file_size, PROT_READ, MAP_PRIVATE,
+        parser->fd, 0);
+    if (parser->map == MAP_FAILED) {
+      GST_WARNING ("failed to map %s, reading instead: %s", filename,
+          g_strerror (errno));
+      parser->map = NULL;
+    } else {
+      /* boxes are visited front to back, and mdats are skipped */
+      madvise (parser->map, parser->file_size, MADV_SEQUENTIAL);
+    }
+  }
+
   parser->offset = 0;
   while (!parser->error && parser->offset < parser->file_size) {
     guint8 buffer[16];
@@ -274,17 +377,25 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
       size = size32;
     }
 
-    if (atom == GST_MAKE_FOURCC ('f', 't', 'y', 'p')) {
-      gss_isom_parser_load_chunk (parser, parser->offset, size);
+    if (size < 8) {
+      GST_ERROR ("bad box size %" G_GUINT64_FORMAT " at offset %"
+          G_GUINT64_FORMAT, size, parser->offset);
+      parser->error = TRUE;
+      break;
+    }
 
+    if (atom == GST_MAKE_FOURCC ('f', 't', 'y', 'p')) {
       gss_isom_parse_ftyp (parser, parser->offset, size);
     } else if (atom == GST_MAKE_FOURCC ('m', 'o', 'o', 'f')) {
       GstByteReader br;
       GssIsomFragment *fragment;
       GssIsomTrack *track;
+      const guint8 *data;
 
-      gss_isom_parser_load_chunk (parser, parser->offset, size);
-      gst_byte_reader_init (&br, parser->data + 8, size - 8);
+      data = gss_isom_parser_get_box_data (parser, parser->offset, size);
+      if (data == NULL)
+        break;
+      gst_byte_reader_init (&br, data + 8, size - 8);
 
       fragment = gss_isom_fragment_new ();
       gss_isom_parse_moof (parser, fragment, &br);
@@ -313,8 +424,7 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
       if (parser->is_isml && parser->current_fragment == NULL) {
         GST_ERROR ("mdat with no moof, broken file");
         parser->error = TRUE;
-        close (parser->fd);
-        parser->fd = -1;
+        gss_isom_parser_close (parser);
         return FALSE;
       }
 
@@ -329,18 +439,20 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
       gss_isom_parse_mfra (parser, parser->offset, size);
     } else if (atom == GST_MAKE_FOURCC ('m', 'o', 'o', 'v')) {
       GstByteReader br;
-      guint8 *data;
+      const guint8 *data;
       GssIsomMovie *movie;
 
-      data = g_malloc (size);
-      file_read (parser, data, parser->offset, size);
+      data = gss_isom_parser_get_box_data (parser, parser->offset, size);
+      if (data == NULL)
+        break;
       gst_byte_reader_init (&br, data + 8, size - 8);
 
       movie = gss_isom_movie_new ();
+      parser->box_data = data;
       gss_isom_parse_moov (parser, movie, &br);
+      parser->box_data = NULL;
 
       parser->movie = movie;
-      g_free (data);
     } else if (atom == GST_MAKE_FOURCC ('u', 'u', 'i', 'd')) {
       guint8 uuid[16];
 
@@ -364,19 +476,27 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
     } else if (atom == GST_MAKE_FOURCC ('s', 'i', 'd', 'x')) {
       GST_FIXME ("sidx");
     } else if (atom == GST_MAKE_FOURCC ('p', 'd', 'i', 'n')) {
-      gss_isom_parser_load_chunk (parser, parser->offset, size);
+      const guint8 *data;
+
+      data = gss_isom_parser_get_box_data (parser, parser->offset, size);
+      if (data == NULL)
+        break;
 
       parser->pdin.present = TRUE;
       parser->pdin.atom = atom;
       parser->pdin.size = size - 8;
-      gst_byte_reader_dup_data (&br, size - 8, &parser->pdin.data);
+      parser->pdin.data = g_memdup (data + 8, size - 8);
     } else if (atom == GST_MAKE_FOURCC ('b', 'l', 'o', 'c')) {
-      gss_isom_parser_load_chunk (parser, parser->offset, size);
+      const guint8 *data;
+
+      data = gss_isom_parser_get_box_data (parser, parser->offset, size);
+      if (data == NULL)
+        break;
 
       parser->bloc.present = TRUE;
       parser->bloc.atom = atom;
       parser->bloc.size = size - 8;
-      gst_byte_reader_dup_data (&br, size - 8, &parser->bloc.data);
+      parser->bloc.data = g_memdup (data + 8, size - 8);
     } else {
       GST_WARNING ("unknown atom %" GST_FOURCC_FORMAT
           " at offset %" G_GINT64_MODIFIER "x, size %" G_GUINT64_FORMAT,
@@ -388,15 +508,13 @@ gss_isom_parser_parse_file (GssIsomParser * parser, const char *filename)
 
   if (parser->error) {
     GST_ERROR ("file error");
-    close (parser->fd);
-    parser->fd = -1;
+    gss_isom_parser_close (parser);
     return FALSE;
   }
 
   gss_isom_parser_fixup (parser);
 
-  close (parser->fd);
-  parser->fd = -1;
+  gss_isom_parser_close (parser);
   return TRUE;
 }
 
@@ -429,6 +547,19 @@ gss_isom_track_new (void)
   return track;
 }
 
+static void
+gss_isom_track_free_sample_index (GssIsomTrack * track)
+{
+  g_free (track->stts_first_sample);
+  track->stts_first_sample = NULL;
+  g_free (track->stts_first_timestamp);
+  track->stts_first_timestamp = NULL;
+  g_free (track->ctts_first_sample);
+  track->ctts_first_sample = NULL;
+  g_free (track->chunk_first_sample);
+  track->chunk_first_sample = NULL;
+}
+
 void
 gss_isom_track_free (GssIsomTrack * track)
 {
@@ -450,6 +581,7 @@ gss_isom_track_free (GssIsomTrack * track)
   g_free (track->stss.sample_numbers);
   g_free (track->stsc.entries);
   g_free (track->stsh.entries);
+  gss_isom_track_free_sample_index (track);
   g_free (track->esds_store.data);
   g_free (track->ccff_header_data);
   g_free (track->dash_header_data);
@@ -462,6 +594,205 @@ gss_isom_track_get_n_samples (GssIsomTrack * track)
   return track->stsz.sample_count;
 }
 
+static void
+gss_isom_pack_uint (GByteArray * array, guint32 value)
+{
+  guint8 b;
+
+  while (value >= 0x80) {
+    b = (value & 0x7f) | 0x80;
+    g_byte_array_append (array, &b, 1);
+    value >>= 7;
+  }
+  b = value;
+  g_byte_array_append (array, &b, 1);
+}
+
+static void
+gss_isom_pack_sint (GByteArray * array, gint32 value)
+{
+  gss_isom_pack_uint (array, ((guint32) value << 1) ^ (guint32) (value >> 31));
+}
+
+static void
+gss_isom_pack_runs (GByteArray * array, const guint32 * values, int n)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && values[j] == values[i]; j++);
+    gss_isom_pack_uint (array, j - i);
+    gss_isom_pack_uint (array, values[i]);
+  }
+}
+
+static guint32
+gss_isom_unpack_uint (const guint8 ** p)
+{
+  guint32 value = 0;
+  int shift = 0;
+
+  while (**p & 0x80) {
+    value |= (guint32) (**p & 0x7f) << shift;
+    shift += 7;
+    (*p)++;
+  }
+  value |= (guint32) (**p) << shift;
+  (*p)++;
+
+  return value;
+}
+
+static gint32
+gss_isom_unpack_sint (const guint8 ** p)
+{
+  guint32 value = gss_isom_unpack_uint (p);
+
+  return (gint32) ((value >> 1) ^ (0 - (value & 1)));
+}
+
+/* Decodes the columns packed by gss_isom_fragment_pack_samples().
+ * @sample_flags is left alone if the fragment has no sdtp flags. */
+static void
+gss_isom_fragment_unpack_samples (GssIsomFragment * fragment,
+    GssBoxTrunSample * samples, guint8 * sample_flags)
+{
+  const guint8 *p = fragment->packed_samples;
+  int n = fragment->trun.sample_count;
+  gboolean has_sample_flags;
+  guint32 size;
+  int i;
+
+  has_sample_flags = (*p++ & 1);
+
+  size = 0;
+  for (i = 0; i < n; i++) {
+    size += gss_isom_unpack_sint (&p);
+    samples[i].size = size;
+  }
+  for (i = 0; i < n;) {
+    guint32 count = gss_isom_unpack_uint (&p);
+    guint32 value = gss_isom_unpack_uint (&p);
+
+    for (; count > 0 && i < n; count--, i++)
+      samples[i].duration = value;
+  }
+  for (i = 0; i < n;) {
+    guint32 count = gss_isom_unpack_uint (&p);
+    guint32 value = gss_isom_unpack_uint (&p);
+
+    for (; count > 0 && i < n; count--, i++)
+      samples[i].flags = value;
+  }
+  for (i = 0; i < n; i++) {
+    samples[i].composition_time_offset = gss_isom_unpack_sint (&p);
+  }
+  if (has_sample_flags) {
+    for (i = 0; i < n;) {
+      guint32 count = gss_isom_unpack_uint (&p);
+      guint32 value = gss_isom_unpack_uint (&p);
+
+      for (; count > 0 && i < n; count--, i++)
+        sample_flags[i] = value;
+    }
+  }
+}
+
+static gsize
+gss_isom_fragment_get_memory_size (GssIsomFragment * fragment)
+{
+  gsize size;
+  int i;
+
+  size = sizeof (GssIsomFragment);
+  size += fragment->moof_size + fragment->mdat_header_size;
+  if (fragment->trun.samples) {
+    size += fragment->trun.sample_count * sizeof (GssBoxTrunSample);
+  }
+  if (fragment->sdtp.sample_flags) {
+    size += fragment->trun.sample_count;
+  }
+  size += fragment->packed_samples_size;
+  size += fragment->sample_encryption.sample_count *
+      sizeof (GssBoxUUIDSampleEncryptionSample);
+  for (i = 0; i < fragment->sample_encryption.sample_count; i++) {
+    size += fragment->sample_encryption.samples[i].num_entries *
+        sizeof (GssBoxUUIDSampleEncryptionSampleEntry);
+  }
+  if (fragment->sglist) {
+    size += sizeof (GssSGList) +
+        fragment->sglist->n_chunks * sizeof (GssSGChunk);
+  }
+
+  return size;
+}
+
+/* Approximate heap usage of a track: sample tables, fragments and
+ * serialized headers. */
+gsize
+gss_isom_track_get_memory_size (GssIsomTrack * track)
+{
+  gsize size;
+  int i;
+
+  size = sizeof (GssIsomTrack);
+  if (track->stts.entries) {
+    size += track->stts.entry_count * sizeof (GssBoxSttsEntry);
+  }
+  if (track->ctts.entries) {
+    size += track->ctts.entry_count * sizeof (GssBoxCttsEntry);
+  }
+  if (track->stss.sample_numbers) {
+    size += track->stss.entry_count * sizeof (guint32);
+  }
+  if (track->stsz.sample_sizes) {
+    size += track->stsz.sample_count * sizeof (guint32);
+  }
+  if (track->stsc.entries) {
+    size += track->stsc.entry_count * sizeof (GssBoxStscEntry);
+  }
+  if (track->stco.chunk_offsets) {
+    size += track->stco.entry_count * sizeof (guint64);
+  }
+  if (track->stts_first_sample) {
+    size += (track->stts.entry_count + 1) * (sizeof (guint32) +
+        sizeof (guint64));
+    size += (track->ctts.entry_count + 1) * sizeof (guint32);
+    size += (track->stco.entry_count + 1) * sizeof (guint32);
+  }
+
+  size += track->n_fragments_alloc * sizeof (GssIsomFragment *);
+  for (i = 0; i < track->n_fragments; i++) {
+    size += gss_isom_fragment_get_memory_size (track->fragments[i]);
+  }
+
+  size += track->ccff_header_size;
+  size += track->dash_header_and_sidx_size;
+
+  return size;
+}
+
+gsize
+gss_isom_parser_get_memory_size (GssIsomParser * parser)
+{
+  gsize size;
+  int i;
+
+  size = sizeof (GssIsomParser);
+  if (parser->data) {
+    size += parser->data_size;
+  }
+  if (parser->movie) {
+    size += sizeof (GssIsomMovie);
+    for (i = 0; i < parser->movie->n_tracks; i++) {
+      size += gss_isom_track_get_memory_size (parser->movie->tracks[i]);
+    }
+  }
+
+  return size;
+}
+
 GssIsomMovie *
 gss_isom_movie_new (void)
 {
@@ -510,6 +841,7 @@ gss_isom_fragment_free (GssIsomFragment * fragment)
   int i;
   g_free (fragment->trun.samples);
   g_free (fragment->sdtp.sample_flags);
+  g_free (fragment->packed_samples);
   for (i = 0; i < fragment->sample_encryption.sample_count; i++) {
     g_free (fragment->sample_encryption.samples[i].entries);
   }
@@ -528,6 +860,18 @@ file_read (GssIsomParser * file, guint8 * buffer, guint64 offset,
   off_t ret;
   ssize_t n;
 
+  if (file->map) {
+    if (offset > file->file_size) {
+      GST_ERROR ("read at offset %" G_GUINT64_FORMAT " past end of file",
+          offset);
+      file->error = TRUE;
+      return FALSE;
+    }
+    memcpy (buffer, file->map + offset, MIN (n_bytes,
+            file->file_size - offset));
+    return TRUE;
+  }
+
   ret = lseek (file->fd, offset, SEEK_SET);
   if (ret < 0) {
     GST_ERROR ("seek to %" G_GUINT64_FORMAT " failed", offset);
@@ -555,14 +899,12 @@ static void
 gss_isom_parse_ftyp (GssIsomParser * file, guint64 offset, guint64 size)
 {
   GstByteReader br;
-  guint8 *data;
+  const guint8 *data;
   guint32 atom = 0;
   guint32 tmp = 0;
-  gboolean ret;
 
-  data = g_malloc (size);
-  ret = file_read (file, data, file->offset, size);
-  if (!ret) {
+  data = gss_isom_parser_get_box_data (file, offset, size);
+  if (data == NULL) {
     return;
   }
 
@@ -610,7 +952,6 @@ gss_isom_parse_ftyp (GssIsomParser * file, guint64 offset, guint64 size)
           GST_FOURCC_ARGS (atom));
     }
   }
-  g_free (data);
 }
 
 static void
@@ -945,7 +1286,6 @@ gss_isom_fragment_set_sample_encryption (GssIsomFragment * fragment,
     int n_samples, guint64 * init_vectors, gboolean is_video)
 {
   GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
-  GssBoxTrun *trun = &fragment->trun;
   int i;
 
   se->present = TRUE;
@@ -958,8 +1298,11 @@ gss_isom_fragment_set_sample_encryption (GssIsomFragment * fragment,
   }
 
   if (is_video) {
+    int *sizes;
+
     /* This actually is for just H.264, not all video */
     se->flags |= 0x0002;
+    sizes = gss_isom_fragment_get_sample_sizes (fragment);
     for (i = 0; i < n_samples; i++) {
       int clear_bytes;
       se->samples[i].num_entries = 1;
@@ -969,11 +1312,12 @@ gss_isom_fragment_set_sample_encryption (GssIsomFragment * fragment,
       /* x264 header is around 750 bytes */
       if (fragment->timestamp == 0 && i == 0)
         clear_bytes = 1000;
-      clear_bytes = MIN (clear_bytes, trun->samples[i].size);
+      clear_bytes = MIN (clear_bytes, sizes[i]);
       se->samples[i].entries[0].bytes_of_clear_data = clear_bytes;
       se->samples[i].entries[0].bytes_of_encrypted_data =
-          trun->samples[i].size - clear_bytes;
+          sizes[i] - clear_bytes;
     }
+    g_free (sizes);
 
   }
 
@@ -1343,6 +1687,29 @@ gss_isom_parse_dref (GssIsomParser * file, GssIsomTrack * track,
   CHECK_END (br);
 }
 
+/* Notes where the contents of a sample table box are in the file.
+ * Returns TRUE if decoding its entries should be left to
+ * gss_isom_parser_load_sample_tables(). */
+static gboolean
+gss_isom_parser_defer_table (GssIsomParser * file, GssIsomTrack * track,
+    GstByteReader * br, GssIsomTable table, guint32 atom)
+{
+  GssIsomTableRef *ref = &track->table_refs[table];
+
+  if (file->box_data == NULL)
+    return FALSE;
+
+  ref->atom = atom;
+  ref->offset = file->offset + (br->data - file->box_data);
+  ref->size = br->size;
+
+  if (file->lazy_sample_tables) {
+    track->tables_deferred = TRUE;
+    return TRUE;
+  }
+  return FALSE;
+}
+
 static void
 gss_isom_parse_stts (GssIsomParser * file, GssIsomTrack * track,
     GstByteReader * br)
@@ -1353,6 +1720,9 @@ gss_isom_parse_stts (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &stts->version);
   gst_byte_reader_get_uint24_be (br, &stts->flags);
   gst_byte_reader_get_uint32_be (br, &stts->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STTS,
+          GST_MAKE_FOURCC ('s', 't', 't', 's')))
+    return;
   stts->entries = g_malloc0 (sizeof (GssBoxSttsEntry) * stts->entry_count);
   for (i = 0; i < stts->entry_count; i++) {
     gst_byte_reader_get_uint32_be (br, &stts->entries[i].sample_count);
@@ -1372,6 +1742,9 @@ gss_isom_parse_ctts (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &ctts->version);
   gst_byte_reader_get_uint24_be (br, &ctts->flags);
   gst_byte_reader_get_uint32_be (br, &ctts->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_CTTS,
+          GST_MAKE_FOURCC ('c', 't', 't', 's')))
+    return;
   ctts->entries = g_malloc0 (sizeof (GssBoxCttsEntry) * ctts->entry_count);
   for (i = 0; i < ctts->entry_count; i++) {
     gst_byte_reader_get_uint32_be (br, &ctts->entries[i].sample_count);
@@ -1392,6 +1765,9 @@ gss_isom_parse_stsz (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint24_be (br, &stsz->flags);
   gst_byte_reader_get_uint32_be (br, &stsz->sample_size);
   gst_byte_reader_get_uint32_be (br, &stsz->sample_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STSZ,
+          GST_MAKE_FOURCC ('s', 't', 's', 'z')))
+    return;
   if (stsz->sample_size == 0) {
     stsz->sample_sizes = g_malloc0 (sizeof (guint32) * stsz->sample_count);
     for (i = 0; i < stsz->sample_count; i++) {
@@ -1412,6 +1788,9 @@ gss_isom_parse_stsc (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &stsc->version);
   gst_byte_reader_get_uint24_be (br, &stsc->flags);
   gst_byte_reader_get_uint32_be (br, &stsc->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STSC,
+          GST_MAKE_FOURCC ('s', 't', 's', 'c')))
+    return;
   stsc->entries = g_malloc0 (sizeof (GssBoxStscEntry) * stsc->entry_count);
   for (i = 0; i < stsc->entry_count; i++) {
     gst_byte_reader_get_uint32_be (br, &stsc->entries[i].first_chunk);
@@ -1434,6 +1813,9 @@ gss_isom_parse_stco (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &stco->version);
   gst_byte_reader_get_uint24_be (br, &stco->flags);
   gst_byte_reader_get_uint32_be (br, &stco->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STCO,
+          GST_MAKE_FOURCC ('s', 't', 'c', 'o')))
+    return;
   stco->chunk_offsets = g_malloc0 (sizeof (guint64) * stco->entry_count);
   for (i = 0; i < stco->entry_count; i++) {
     gst_byte_reader_get_uint32_be (br, &tmp);
@@ -1453,6 +1835,9 @@ gss_isom_parse_co64 (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &stco->version);
   gst_byte_reader_get_uint24_be (br, &stco->flags);
   gst_byte_reader_get_uint32_be (br, &stco->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STCO,
+          GST_MAKE_FOURCC ('c', 'o', '6', '4')))
+    return;
   stco->chunk_offsets = g_malloc0 (sizeof (guint64) * stco->entry_count);
   for (i = 0; i < stco->entry_count; i++) {
     gst_byte_reader_get_uint64_be (br, &stco->chunk_offsets[i]);
@@ -1471,6 +1856,9 @@ gss_isom_parse_stss (GssIsomParser * file, GssIsomTrack * track,
   gst_byte_reader_get_uint8 (br, &stss->version);
   gst_byte_reader_get_uint24_be (br, &stss->flags);
   gst_byte_reader_get_uint32_be (br, &stss->entry_count);
+  if (gss_isom_parser_defer_table (file, track, br, GSS_ISOM_TABLE_STSS,
+          GST_MAKE_FOURCC ('s', 't', 's', 's')))
+    return;
   stss->sample_numbers = g_malloc0 (sizeof (guint32) * stss->entry_count);
   for (i = 0; i < stss->entry_count; i++) {
     gst_byte_reader_get_uint32_be (br, &stss->sample_numbers[i]);
@@ -1827,6 +2215,126 @@ gss_isom_parse_container (GssIsomParser * file, GssIsomTrack * track,
   CHECK_END_BOX (br, parent_atom);
 }
 
+/**
+ * gss_isom_parser_load_sample_tables:
+ * @file: the parser that parsed @track
+ * @track: a track
+ *
+ * Decodes the sample tables of @track, if they were left undecoded by
+ * parsing with lazy_sample_tables set or dropped since.  The tables
+ * are only needed to fragmentize a progressive file, so for streams
+ * with a valid index they are never decoded.
+ *
+ * Returns: TRUE if the tables are decoded
+ */
+gboolean
+gss_isom_parser_load_sample_tables (GssIsomParser * file, GssIsomTrack * track)
+{
+  static void (*const parse[GSS_ISOM_N_TABLES]) (GssIsomParser *,
+      GssIsomTrack *, GstByteReader *) = {
+    gss_isom_parse_stts, gss_isom_parse_ctts, gss_isom_parse_stsz,
+    gss_isom_parse_stsc, gss_isom_parse_stco, gss_isom_parse_stss
+  };
+  GssIsomParser loader = { 0 };
+  gboolean ret = TRUE;
+  int fd;
+  int i;
+
+  g_return_val_if_fail (file != NULL, FALSE);
+  g_return_val_if_fail (track != NULL, FALSE);
+
+  if (!track->tables_deferred)
+    return TRUE;
+
+  fd = open (file->filename, O_RDONLY);
+  if (fd < 0) {
+    GST_ERROR ("cannot open %s", file->filename);
+    return FALSE;
+  }
+
+  for (i = 0; ret && i < GSS_ISOM_N_TABLES; i++) {
+    GssIsomTableRef *ref = &track->table_refs[i];
+    GstByteReader br;
+    guint8 *data;
+
+    if (ref->atom == 0)
+      continue;
+
+    data = g_malloc (ref->size);
+    if (pread (fd, data, ref->size, ref->offset) != ref->size) {
+      GST_ERROR ("failed to read %" GST_FOURCC_FORMAT " of %s",
+          GST_FOURCC_ARGS (ref->atom), file->filename);
+      ret = FALSE;
+    } else {
+      gst_byte_reader_init (&br, data, ref->size);
+      if (ref->atom == GST_MAKE_FOURCC ('c', 'o', '6', '4')) {
+        gss_isom_parse_co64 (&loader, track, &br);
+      } else {
+        parse[i] (&loader, track, &br);
+      }
+    }
+    g_free (data);
+  }
+  close (fd);
+
+  track->tables_deferred = !ret;
+
+  return ret;
+}
+
+/**
+ * gss_isom_track_drop_sample_tables:
+ * @track: a track
+ *
+ * Frees the decoded entries of the sample tables of @track, which
+ * gss_isom_parser_load_sample_tables() can decode again.  Box headers,
+ * such as the number of entries, are kept.
+ */
+void
+gss_isom_track_drop_sample_tables (GssIsomTrack * track)
+{
+  int i;
+
+  g_return_if_fail (track != NULL);
+
+  gss_isom_track_free_sample_index (track);
+  if (track->tables_deferred)
+    return;
+
+  for (i = 0; i < GSS_ISOM_N_TABLES; i++) {
+    if (track->table_refs[i].atom == 0)
+      continue;
+
+    switch (i) {
+      case GSS_ISOM_TABLE_STTS:
+        g_free (track->stts.entries);
+        track->stts.entries = NULL;
+        break;
+      case GSS_ISOM_TABLE_CTTS:
+        g_free (track->ctts.entries);
+        track->ctts.entries = NULL;
+        break;
+      case GSS_ISOM_TABLE_STSZ:
+        g_free (track->stsz.sample_sizes);
+        track->stsz.sample_sizes = NULL;
+        break;
+      case GSS_ISOM_TABLE_STSC:
+        g_free (track->stsc.entries);
+        track->stsc.entries = NULL;
+        break;
+      case GSS_ISOM_TABLE_STCO:
+        g_free (track->stco.chunk_offsets);
+        track->stco.chunk_offsets = NULL;
+        break;
+      case GSS_ISOM_TABLE_STSS:
+        g_free (track->stss.sample_numbers);
+        track->stss.sample_numbers = NULL;
+        break;
+    }
+  }
+  track->tables_deferred = TRUE;
+}
+
 static void
 gss_isom_parse_container_udta (GssIsomParser * file, GssIsomMovie * movie,
     GstByteReader * br, Container * atoms, guint32 parent_atom)
@@ -2109,7 +2617,8 @@ gss_isom_tfdt_serialize (GssBoxTfdt * tfdt, GstByteWriter * bw)
 }
 
 static void
-gss_isom_trun_serialize (GssBoxTrun * trun, GstByteWriter * bw)
+gss_isom_trun_serialize (GssBoxTrun * trun, const GssBoxTrunSample * samples,
+    GstByteWriter * bw)
 {
   int offset;
   int i;
@@ -2131,17 +2640,16 @@ gss_isom_trun_serialize (GssBoxTrun * trun, GstByteWriter * bw)
 
   for (i = 0; i < trun->sample_count; i++) {
     if (trun->flags & TR_SAMPLE_DURATION) {
-      gst_byte_writer_put_uint32_be (bw, trun->samples[i].duration);
+      gst_byte_writer_put_uint32_be (bw, samples[i].duration);
     }
     if (trun->flags & TR_SAMPLE_SIZE) {
-      gst_byte_writer_put_uint32_be (bw, trun->samples[i].size);
+      gst_byte_writer_put_uint32_be (bw, samples[i].size);
     }
     if (trun->flags & TR_SAMPLE_FLAGS) {
-      gst_byte_writer_put_uint32_be (bw, trun->samples[i].flags);
+      gst_byte_writer_put_uint32_be (bw, samples[i].flags);
     }
     if (trun->flags & TR_SAMPLE_COMPOSITION_TIME_OFFSETS) {
-      gst_byte_writer_put_uint32_be (bw,
-          trun->samples[i].composition_time_offset);
+      gst_byte_writer_put_uint32_be (bw, samples[i].composition_time_offset);
     }
   }
 
@@ -2194,8 +2702,8 @@ gss_isom_trik_serialize (GssBoxTrik * trik, GstByteWriter * bw)
 }
 
 static void
-gss_isom_sdtp_serialize (GssBoxSdtp * sdtp, GstByteWriter * bw,
-    int sample_count)
+gss_isom_sdtp_serialize (GssBoxSdtp * sdtp, const guint8 * sample_flags,
+    GstByteWriter * bw, int sample_count)
 {
   int offset;
   int i;
@@ -2208,7 +2716,7 @@ gss_isom_sdtp_serialize (GssBoxSdtp * sdtp, GstByteWriter * bw,
   gst_byte_writer_put_uint8 (bw, sdtp->version);
   gst_byte_writer_put_uint24_be (bw, sdtp->flags);
   for (i = 0; i < sample_count; i++) {
-    gst_byte_writer_put_uint8 (bw, sdtp->sample_flags[i]);
+    gst_byte_writer_put_uint8 (bw, sample_flags[i]);
   }
 
   BOX_FINISH (bw, offset);
@@ -2344,18 +2852,33 @@ static void
 gss_isom_traf_serialize (GssIsomFragment * fragment, GstByteWriter * bw,
     gboolean is_video)
 {
+  GssBoxTrunSample *samples = fragment->trun.samples;
+  guint8 *sample_flags = fragment->sdtp.sample_flags;
   int offset;
 
+  if (fragment->packed_samples) {
+    samples = g_malloc (sizeof (GssBoxTrunSample) *
+        fragment->trun.sample_count);
+    sample_flags = g_malloc0 (fragment->trun.sample_count);
+    gss_isom_fragment_unpack_samples (fragment, samples, sample_flags);
+  }
+
   offset = BOX_INIT (bw, GST_MAKE_FOURCC ('t', 'r', 'a', 'f'));
 
   gss_isom_tfhd_serialize (&fragment->tfhd, bw);
   gss_isom_tfdt_serialize (&fragment->tfdt, bw);
-  gss_isom_trun_serialize (&fragment->trun, bw);
+  gss_isom_trun_serialize (&fragment->trun, samples, bw);
   if (0 && is_video) {
     gss_isom_avcn_serialize (&fragment->avcn, bw);
     gss_isom_trik_serialize (&fragment->trik, bw);
   }
-  gss_isom_sdtp_serialize (&fragment->sdtp, bw, fragment->trun.sample_count);
+  gss_isom_sdtp_serialize (&fragment->sdtp, sample_flags, bw,
+      fragment->trun.sample_count);
+
+  if (fragment->packed_samples) {
+    g_free (samples);
+    g_free (sample_flags);
+  }
 
   gss_isom_sample_encryption_serialize (&fragment->sample_encryption, bw);
 
@@ -3561,12 +4084,95 @@ gss_isom_fragment_get_sample_sizes (GssIsomFragment * fragment)
   GssBoxTrun *trun = &fragment->trun;
 
   s = g_malloc (sizeof (int) * trun->sample_count);
+  if (fragment->packed_samples) {
+    const guint8 *p = fragment->packed_samples + 1;
+    guint32 size = 0;
+
+    /* sizes are the first column */
+    for (i = 0; i < trun->sample_count; i++) {
+      size += gss_isom_unpack_sint (&p);
+      s[i] = size;
+    }
+    return s;
+  }
+
   for (i = 0; i < trun->sample_count; i++) {
     s[i] = trun->samples[i].size;
   }
   return s;
 }
 
+/**
+ * gss_isom_fragment_pack_samples:
+ * @fragment: a fragment
+ *
+ * Replaces the trun samples and sdtp flags of @fragment with a compact
+ * copy, and merges the chunks of its sample list that are adjacent in
+ * the file.  Once the moof of a fragment is serialized, these are only
+ * needed for the sample sizes when encrypting, which
+ * gss_isom_fragment_get_sample_sizes() decodes from the packed copy,
+ * and when serializing again.
+ */
+void
+gss_isom_fragment_pack_samples (GssIsomFragment * fragment)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  GByteArray *array;
+  guint32 *column;
+  guint8 header;
+  guint32 size;
+  int i;
+
+  if (fragment->sglist) {
+    gss_sglist_compact (fragment->sglist);
+  }
+  if (fragment->packed_samples || trun->samples == NULL) {
+    return;
+  }
+
+  /* one column after the other: sizes as differences from the
+   * previous sample, runs of durations and flags, which rarely
+   * change within a fragment, and composition offsets.  Numbers are
+   * stored as varints, signed ones zigzag encoded. */
+  array = g_byte_array_new ();
+  header = (fragment->sdtp.sample_flags != NULL) ? 1 : 0;
+  g_byte_array_append (array, &header, 1);
+
+  size = 0;
+  for (i = 0; i < trun->sample_count; i++) {
+    gss_isom_pack_sint (array, trun->samples[i].size - size);
+    size = trun->samples[i].size;
+  }
+
+  column = g_malloc (sizeof (guint32) * MAX (trun->sample_count, 1));
+  for (i = 0; i < trun->sample_count; i++) {
+    column[i] = trun->samples[i].duration;
+  }
+  gss_isom_pack_runs (array, column, trun->sample_count);
+  for (i = 0; i < trun->sample_count; i++) {
+    column[i] = trun->samples[i].flags;
+  }
+  gss_isom_pack_runs (array, column, trun->sample_count);
+  for (i = 0; i < trun->sample_count; i++) {
+    gss_isom_pack_sint (array, trun->samples[i].composition_time_offset);
+  }
+  if (fragment->sdtp.sample_flags) {
+    for (i = 0; i < trun->sample_count; i++) {
+      column[i] = fragment->sdtp.sample_flags[i];
+    }
+    gss_isom_pack_runs (array, column, trun->sample_count);
+  }
+  g_free (column);
+
+  fragment->packed_samples_size = array->len;
+  fragment->packed_samples = g_byte_array_free (array, FALSE);
+
+  g_free (trun->samples);
+  trun->samples = NULL;
+  g_free (fragment->sdtp.sample_flags);
+  fragment->sdtp.sample_flags = NULL;
+}
+
 GssIsomTrack *
 gss_isom_movie_get_video_track (GssIsomMovie * movie)
 {
@@ -3595,12 +4201,134 @@ gss_isom_movie_get_audio_track (GssIsomMovie * movie)
   return NULL;
 }
 
+static void
+gss_isom_track_setup_fragments (GssIsomTrack * track, int track_id,
+    int n_fragments)
+{
+  track->tkhd.track_id = track_id;
+  track->trex.track_id = track_id;
+  track->trex.default_sample_description_index = 1;
+
+  track->fragments = g_malloc0 (sizeof (GssIsomFragment *) * n_fragments);
+  track->n_fragments = n_fragments;
+  track->n_fragments_alloc = n_fragments;
+}
+
+/* Everything about a fragment except its samples and timing, which
+ * come from the sample tables or the index file. */
+static GssIsomFragment *
+gss_isom_fragment_new_video (GssIsomTrack * video_track, int index,
+    int n_samples, gboolean is_dash)
+{
+  GssIsomFragment *video_fragment;
+  int j;
+
+  video_fragment = gss_isom_fragment_new ();
+  video_fragment->index = index;
+
+  video_fragment->mfhd.sequence_number = index;
+
+  if (is_dash) {
+    video_fragment->tfdt.present = TRUE;
+  }
+  video_fragment->tfhd.track_id = video_track->tkhd.track_id;
+  video_fragment->tfhd.flags = 0;
+  video_fragment->tfhd.default_sample_duration = 0x061a80;
+  video_fragment->tfhd.default_sample_size = 0;
+  video_fragment->tfhd.default_sample_flags = 0x000100c0;
+
+  video_fragment->tfdt.version = 1;
+
+  video_fragment->trun.version = 1;
+  video_fragment->trun.sample_count = n_samples;
+  video_fragment->trun.data_offset = 12;
+  video_fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) *
+      n_samples);
+  /* FIXME not all strictly necessary, should be handled in serializer */
+  video_fragment->trun.flags =
+      TR_SAMPLE_SIZE | TR_SAMPLE_DURATION | TR_DATA_OFFSET |
+      TR_SAMPLE_COMPOSITION_TIME_OFFSETS;
+  video_fragment->trun.flags = 0x0b01;
+  video_fragment->trun.first_sample_flags = 0x40;
+
+  video_fragment->mdat_size = 8;
+  video_fragment->sglist = gss_sglist_new (n_samples);
+
+  video_fragment->sdtp.present = TRUE;
+  video_fragment->sdtp.sample_flags = g_malloc0 (sizeof (guint8) * n_samples);
+  video_fragment->sdtp.sample_flags[0] = 0x14;
+  for (j = 1; j < n_samples; j++) {
+    video_fragment->sdtp.sample_flags[j] = 0x1c;
+  }
+
+  return video_fragment;
+}
+
+static GssIsomFragment *
+gss_isom_fragment_new_audio (GssIsomTrack * audio_track, int index,
+    int n_samples, gboolean is_dash)
+{
+  GssIsomFragment *audio_fragment;
+
+  audio_fragment = gss_isom_fragment_new ();
+  audio_fragment->index = index;
+  audio_fragment->mfhd.sequence_number = index;
+
+  if (is_dash) {
+    audio_fragment->tfdt.present = TRUE;
+  }
+  audio_fragment->tfhd.track_id = audio_track->tkhd.track_id;
+  audio_fragment->tfhd.flags = 0;
+  audio_fragment->tfhd.default_sample_duration = 0;
+  audio_fragment->tfhd.default_sample_size = 0;
+  audio_fragment->tfhd.default_sample_flags = 0xc0;
+
+  audio_fragment->mdat_size = 8;
+  audio_fragment->sglist = gss_sglist_new (n_samples);
+
+  audio_fragment->trun.sample_count = n_samples;
+  audio_fragment->trun.data_offset = 12;
+  audio_fragment->trun.samples = g_malloc0 (sizeof (GssBoxTrunSample) *
+      n_samples);
+  audio_fragment->trun.version = 1;
+  /* FIXME not all strictly necessary, should be handled in serializer */
+  audio_fragment->trun.flags =
+      TR_SAMPLE_DURATION | TR_SAMPLE_SIZE | TR_DATA_OFFSET;
+
+  audio_fragment->sdtp.present = TRUE;
+  audio_fragment->sdtp.sample_flags = g_malloc0 (sizeof (guint32) * n_samples);
+
+  return audio_fragment;
+}
+
+static void
+gss_isom_parser_fragmentize_finish (GssIsomParser * file,
+    GssIsomTrack * video_track, GssIsomTrack * audio_track)
+{
+  int n_fragments;
+
+  video_track->filename = file->filename;
+  audio_track->filename = file->filename;
+
+  file->movie->mvhd.timescale = 10000000;
+  fixup_track (video_track, TRUE);
+  fixup_track (audio_track, FALSE);
+
+  file->movie->mehd.version = 1;
+  n_fragments = video_track->n_fragments;
+  file->movie->mehd.fragment_duration =
+      video_track->fragments[n_fragments - 1]->timestamp +
+      video_track->fragments[n_fragments - 1]->duration;
+  file->movie->mvhd.duration =
+      video_track->fragments[n_fragments - 1]->timestamp +
+      video_track->fragments[n_fragments - 1]->duration;
+}
+
 void
 gss_isom_parser_fragmentize (GssIsomParser * file, gboolean is_dash)
 {
   GssIsomTrack *video_track;
   GssIsomTrack *audio_track;
-  int n_fragments;
 
   video_track = gss_isom_movie_get_video_track (file->movie);
   if (video_track == NULL) {
@@ -3618,6 +4346,9 @@ gss_isom_parser_fragmentize (GssIsomParser * file, gboolean is_dash)
     return;
   }
 
+  if (!gss_isom_parser_load_sample_tables (file, video_track))
+    return;
+
   video_track->filename = file->filename;
 
   gss_isom_parser_fragmentize_track_video (video_track, is_dash);
@@ -3628,23 +4359,12 @@ gss_isom_parser_fragmentize (GssIsomParser * file, gboolean is_dash)
     return;
   }
 
-  audio_track->filename = file->filename;
+  if (!gss_isom_parser_load_sample_tables (file, audio_track))
+    return;
 
   gss_isom_parser_fragmentize_track_audio (audio_track, video_track, is_dash);
 
-  file->movie->mvhd.timescale = 10000000;
-  fixup_track (video_track, TRUE);
-  fixup_track (audio_track, FALSE);
-
-  file->movie->mehd.version = 1;
-  /* FIXME */
-  n_fragments = video_track->stss.entry_count;
-  file->movie->mehd.fragment_duration =
-      video_track->fragments[n_fragments - 1]->timestamp +
-      video_track->fragments[n_fragments - 1]->duration;
-  file->movie->mvhd.duration =
-      video_track->fragments[n_fragments - 1]->timestamp +
-      video_track->fragments[n_fragments - 1]->duration;
+  gss_isom_parser_fragmentize_finish (file, video_track, audio_track);
 }
 
 
@@ -3662,13 +4382,7 @@ gss_isom_parser_fragmentize_track_audio (GssIsomTrack * audio_track,
 
   n_fragments = video_track->stss.entry_count;
 
-  audio_track->tkhd.track_id = 2;
-  audio_track->trex.track_id = 2;
-  audio_track->trex.default_sample_description_index = 1;
-
-  audio_track->fragments = g_malloc0 (sizeof (GssIsomFragment *) * n_fragments);
-  audio_track->n_fragments = n_fragments;
-  audio_track->n_fragments_alloc = n_fragments;
+  gss_isom_track_setup_fragments (audio_track, 2, n_fragments);
 
   gss_isom_sample_iter_init (&audio_iter, audio_track);
 
@@ -3679,38 +4393,18 @@ gss_isom_parser_fragmentize_track_audio (GssIsomTrack * audio_track,
     GssBoxTrunSample *samples;
     int j;
 
-    audio_fragment = gss_isom_fragment_new ();
-    audio_track->fragments[i] = audio_fragment;
-    audio_fragment->index = i;
-    audio_fragment->mfhd.sequence_number = i;
-
     video_timestamp = video_track->fragments[i]->timestamp +
         video_track->fragments[i]->duration;
     audio_index_end = gss_isom_track_get_index_from_timestamp (audio_track,
         gst_util_uint64_scale_int (video_timestamp,
             audio_track->mdhd.timescale, 10000000));
 
-    if (is_dash) {
-      audio_fragment->tfdt.present = TRUE;
-    }
-    audio_fragment->tfhd.track_id = audio_track->tkhd.track_id;
-    audio_fragment->tfhd.flags = 0;
-    audio_fragment->tfhd.default_sample_duration = 0;
-    audio_fragment->tfhd.default_sample_size = 0;
-    audio_fragment->tfhd.default_sample_flags = 0xc0;
-
     n_samples = audio_index_end - audio_index;
 
-    audio_fragment->mdat_size = 8;
-    audio_fragment->sglist = gss_sglist_new (n_samples);
-
-    audio_fragment->trun.sample_count = n_samples;
-    audio_fragment->trun.data_offset = 12;
-    samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
-
-    audio_fragment->sdtp.present = TRUE;
-    audio_fragment->sdtp.sample_flags =
-        g_malloc0 (sizeof (guint32) * n_samples);
+    audio_fragment = gss_isom_fragment_new_audio (audio_track, i, n_samples,
+        is_dash);
+    audio_track->fragments[i] = audio_fragment;
+    samples = audio_fragment->trun.samples;
 
     audio_fragment->timestamp = audio_timestamp;
     audio_fragment->tfdt.start_time = audio_timestamp;
@@ -3736,11 +4430,6 @@ gss_isom_parser_fragmentize_track_audio (GssIsomTrack * audio_track,
 
       gss_isom_sample_iter_iterate (&audio_iter);
     }
-    audio_fragment->trun.samples = samples;
-    audio_fragment->trun.version = 1;
-    /* FIXME not all strictly necessary, should be handled in serializer */
-    audio_fragment->trun.flags =
-        TR_SAMPLE_DURATION | TR_SAMPLE_SIZE | TR_DATA_OFFSET;
     audio_fragment->duration = audio_timestamp - audio_fragment->timestamp;
 
     audio_index += n_samples;
@@ -3757,15 +4446,9 @@ gss_isom_parser_fragmentize_track_video (GssIsomTrack * video_track,
   guint64 video_timescale_ts = 0;
   GssIsomSampleIterator video_iter;
 
-  video_track->tkhd.track_id = 1;
-  video_track->trex.track_id = 1;
-  video_track->trex.default_sample_description_index = 1;
-
   n_fragments = video_track->stss.entry_count;
 
-  video_track->fragments = g_malloc0 (sizeof (GssIsomFragment *) * n_fragments);
-  video_track->n_fragments = n_fragments;
-  video_track->n_fragments_alloc = n_fragments;
+  gss_isom_track_setup_fragments (video_track, 1, n_fragments);
 
   gss_isom_sample_iter_init (&video_iter, video_track);
 
@@ -3777,45 +4460,18 @@ gss_isom_parser_fragmentize_track_video (GssIsomTrack * video_track,
     int sample_offset;
     int j;
 
-    video_fragment = gss_isom_fragment_new ();
-    video_track->fragments[i] = video_fragment;
-    video_fragment->index = i;
-
-    video_fragment->mfhd.sequence_number = i;
-
-    if (is_dash) {
-      video_fragment->tfdt.present = TRUE;
-    }
-    video_fragment->tfhd.track_id = video_track->tkhd.track_id;
-    video_fragment->tfhd.flags = 0;
-    video_fragment->tfhd.default_sample_duration = 0x061a80;
-    video_fragment->tfhd.default_sample_size = 0;
-    video_fragment->tfhd.default_sample_flags = 0x000100c0;
-
-    video_fragment->tfdt.version = 1;
-
-    video_fragment->trun.version = 1;
-
     sample_offset = video_track->stss.sample_numbers[i] - 1;
     if (i == n_fragments - 1) {
       n_samples = gss_isom_track_get_n_samples (video_track) - sample_offset;
     } else {
       n_samples = (video_track->stss.sample_numbers[i + 1] - 1) - sample_offset;
     }
-    video_fragment->trun.sample_count = n_samples;
-    video_fragment->trun.data_offset = 12;
-
-    video_fragment->mdat_size = 8;
-    video_fragment->sglist = gss_sglist_new (n_samples);
 
-    video_fragment->sdtp.present = TRUE;
-    video_fragment->sdtp.sample_flags = g_malloc0 (sizeof (guint8) * n_samples);
-    video_fragment->sdtp.sample_flags[0] = 0x14;
-    for (j = 1; j < n_samples; j++) {
-      video_fragment->sdtp.sample_flags[j] = 0x1c;
-    }
+    video_fragment = gss_isom_fragment_new_video (video_track, i, n_samples,
+        is_dash);
+    video_track->fragments[i] = video_fragment;
+    samples = video_fragment->trun.samples;
 
-    samples = g_malloc0 (sizeof (GssBoxTrunSample) * n_samples);
     video_fragment->timestamp = video_timestamp;
     video_fragment->tfdt.start_time = video_timestamp;
     for (j = 0; j < n_samples; j++) {
@@ -3842,18 +4498,365 @@ gss_isom_parser_fragmentize_track_video (GssIsomTrack * video_track,
 
       gss_isom_sample_iter_iterate (&video_iter);
     }
-    video_fragment->trun.samples = samples;
-    /* FIXME not all strictly necessary, should be handled in serializer */
-    video_fragment->trun.flags =
-        TR_SAMPLE_SIZE | TR_SAMPLE_DURATION | TR_DATA_OFFSET |
-        TR_SAMPLE_COMPOSITION_TIME_OFFSETS;
-    video_fragment->trun.flags = 0x0b01;
-    video_fragment->trun.first_sample_flags = 0x40;
     video_fragment->duration = video_timestamp - video_fragment->timestamp;
 
   }
 }
 
+/*
+ * Fragment index files
+ *
+ * Fragmentizing a progressive MP4 file walks every sample of every
+ * track.  The result only depends on the file, so after the first load
+ * it is saved next to the file as "<filename>.gssidx" and read back on
+ * later loads.  An index is only used if it was written for a file
+ * with the same inode, size and modification time (to the nanosecond
+ * where the system records it), by the same index version on a host
+ * with the same byte order and word size, and if its checksum matches.
+ * Anything else is ignored and the index is rewritten.
+ *
+ * Layout, in host byte order:
+ *   GssIsomIndexHeader
+ *   for the video track, then the audio track:
+ *     GssIsomIndexTrack
+ *     n_fragments x GssIsomIndexFragment
+ *     for each fragment:
+ *       n_samples x GssBoxTrunSample
+ *       n_samples x GssSGChunk
+ */
+
+#define GSS_ISOM_INDEX_MAGIC "GSSIDX\r\n"
+#define GSS_ISOM_INDEX_VERSION 2
+#define GSS_ISOM_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct _GssIsomIndexHeader GssIsomIndexHeader;
+struct _GssIsomIndexHeader
+{
+  char magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint32 word_size;
+  guint32 reserved;
+  guint64 file_size;
+  gint64 file_mtime;
+  gint64 file_mtime_nsec;
+  guint64 file_inode;
+  guint8 checksum[16];          /* MD5 of everything after the header */
+};
+
+typedef struct _GssIsomIndexTrack GssIsomIndexTrack;
+struct _GssIsomIndexTrack
+{
+  guint32 n_fragments;
+  guint32 reserved;
+};
+
+typedef struct _GssIsomIndexFragment GssIsomIndexFragment;
+struct _GssIsomIndexFragment
+{
+  guint64 timestamp;
+  guint64 duration;
+  guint32 n_samples;
+  guint32 mdat_size;
+};
+
+static void
+gss_isom_index_header_init (GssIsomIndexHeader * header,
+    GssIsomParser * file)
+{
+  struct stat sb;
+
+  memset (header, 0, sizeof (*header));
+  memcpy (header->magic, GSS_ISOM_INDEX_MAGIC, 8);
+  header->version = GSS_ISOM_INDEX_VERSION;
+  header->byte_order = GSS_ISOM_INDEX_BYTE_ORDER;
+  header->word_size = sizeof (gsize);
+  /* the file is closed once parsed */
+  if (stat (file->filename, &sb) == 0) {
+    header->file_size = sb.st_size;
+    header->file_mtime = sb.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    header->file_mtime_nsec = sb.st_mtim.tv_nsec;
+#endif
+    header->file_inode = sb.st_ino;
+  }
+}
+
+static void
+gss_isom_index_checksum (const guint8 * data, gsize size, guint8 * digest)
+{
+  GChecksum *checksum;
+  gsize len = 16;
+
+  checksum = g_checksum_new (G_CHECKSUM_MD5);
+  g_checksum_update (checksum, data, size);
+  g_checksum_get_digest (checksum, digest, &len);
+  g_checksum_free (checksum);
+}
+
+static void
+gss_isom_index_append_track (GByteArray * array, GssIsomTrack * track)
+{
+  GssIsomIndexTrack index_track;
+  int i;
+
+  memset (&index_track, 0, sizeof (index_track));
+  index_track.n_fragments = track->n_fragments;
+  g_byte_array_append (array, (guint8 *) & index_track, sizeof (index_track));
+
+  for (i = 0; i < track->n_fragments; i++) {
+    GssIsomFragment *fragment = track->fragments[i];
+    GssIsomIndexFragment index_fragment;
+
+    memset (&index_fragment, 0, sizeof (index_fragment));
+    index_fragment.timestamp = fragment->timestamp;
+    index_fragment.duration = fragment->duration;
+    index_fragment.n_samples = fragment->trun.sample_count;
+    index_fragment.mdat_size = fragment->mdat_size;
+    g_byte_array_append (array, (guint8 *) & index_fragment,
+        sizeof (index_fragment));
+  }
+  for (i = 0; i < track->n_fragments; i++) {
+    GssIsomFragment *fragment = track->fragments[i];
+
+    g_byte_array_append (array, (guint8 *) fragment->trun.samples,
+        fragment->trun.sample_count * sizeof (GssBoxTrunSample));
+    g_byte_array_append (array, (guint8 *) fragment->sglist->chunks,
+        fragment->trun.sample_count * sizeof (GssSGChunk));
+  }
+}
+
+/**
+ * gss_isom_parser_save_index:
+ * @file: a parser that has been fragmentized
+ * @index_filename: file to write
+ *
+ * Saves the fragments of @file, so that a later load can use
+ * gss_isom_parser_load_index() instead of fragmentizing again.  The
+ * index does not depend on the @is_dash argument of
+ * gss_isom_parser_fragmentize(), so ISM and DASH share it.  The file
+ * is replaced atomically.
+ *
+ * Returns: TRUE on success
+ */
+gboolean
+gss_isom_parser_save_index (GssIsomParser * file, const char *index_filename)
+{
+  GssIsomIndexHeader header;
+  GssIsomTrack *video_track;
+  GssIsomTrack *audio_track;
+  GError *error = NULL;
+  GByteArray *array;
+  gboolean ret;
+
+  g_return_val_if_fail (file != NULL, FALSE);
+  g_return_val_if_fail (index_filename != NULL, FALSE);
+
+  video_track = gss_isom_movie_get_video_track (file->movie);
+  audio_track = gss_isom_movie_get_audio_track (file->movie);
+  if (video_track == NULL || audio_track == NULL ||
+      video_track->n_fragments == 0 ||
+      audio_track->n_fragments != video_track->n_fragments) {
+    return FALSE;
+  }
+
+  gss_isom_index_header_init (&header, file);
+
+  array = g_byte_array_new ();
+  g_byte_array_append (array, (guint8 *) & header, sizeof (header));
+  gss_isom_index_append_track (array, video_track);
+  gss_isom_index_append_track (array, audio_track);
+
+  gss_isom_index_checksum (array->data + sizeof (header),
+      array->len - sizeof (header), header.checksum);
+  memcpy (array->data, &header, sizeof (header));
+
+  ret = g_file_set_contents (index_filename, (gchar *) array->data,
+      array->len, &error);
+  if (!ret) {
+    GST_DEBUG ("failed to write %s: %s", index_filename, error->message);
+    g_error_free (error);
+  }
+  g_byte_array_free (array, TRUE);
+
+  return ret;
+}
+
+static const guint8 *
+gss_isom_index_read (const guint8 ** p, const guint8 * end, gsize size)
+{
+  const guint8 *data = *p;
+
+  if ((gsize) (end - data) < size)
+    return NULL;
+  *p += size;
+  return data;
+}
+
+static void
+gss_isom_track_free_fragments (GssIsomTrack * track)
+{
+  int i;
+
+  for (i = 0; i < track->n_fragments; i++) {
+    if (track->fragments[i])
+      gss_isom_fragment_free (track->fragments[i]);
+  }
+  g_free (track->fragments);
+  track->fragments = NULL;
+  track->n_fragments = 0;
+  track->n_fragments_alloc = 0;
+}
+
+static gboolean
+gss_isom_index_read_track (GssIsomTrack * track, int track_id,
+    gboolean is_video, gboolean is_dash, const guint8 ** p,
+    const guint8 * end)
+{
+  const GssIsomIndexTrack *index_track;
+  const GssIsomIndexFragment *index_fragments;
+  int i;
+
+  index_track = (const GssIsomIndexTrack *) gss_isom_index_read (p, end,
+      sizeof (GssIsomIndexTrack));
+  if (index_track == NULL || index_track->n_fragments == 0 ||
+      index_track->n_fragments > G_MAXINT / sizeof (GssIsomIndexFragment))
+    return FALSE;
+  index_fragments = (const GssIsomIndexFragment *) gss_isom_index_read (p,
+      end, index_track->n_fragments * sizeof (GssIsomIndexFragment));
+  if (index_fragments == NULL)
+    return FALSE;
+
+  gss_isom_track_setup_fragments (track, track_id, index_track->n_fragments);
+
+  for (i = 0; i < track->n_fragments; i++) {
+    const GssIsomIndexFragment *index_fragment = &index_fragments[i];
+    GssIsomFragment *fragment;
+    const guint8 *samples;
+    const guint8 *chunks;
+    int n_samples = index_fragment->n_samples;
+
+    if (n_samples <= 0 ||
+        (gsize) n_samples > G_MAXINT / sizeof (GssBoxTrunSample))
+      goto error;
+    samples = gss_isom_index_read (p, end,
+        n_samples * sizeof (GssBoxTrunSample));
+    chunks = gss_isom_index_read (p, end, n_samples * sizeof (GssSGChunk));
+    if (samples == NULL || chunks == NULL)
+      goto error;
+
+    if (is_video) {
+      fragment = gss_isom_fragment_new_video (track, i, n_samples, is_dash);
+    } else {
+      fragment = gss_isom_fragment_new_audio (track, i, n_samples, is_dash);
+    }
+    track->fragments[i] = fragment;
+
+    memcpy (fragment->trun.samples, samples,
+        n_samples * sizeof (GssBoxTrunSample));
+    memcpy (fragment->sglist->chunks, chunks, n_samples * sizeof (GssSGChunk));
+    fragment->timestamp = index_fragment->timestamp;
+    fragment->tfdt.start_time = index_fragment->timestamp;
+    fragment->duration = index_fragment->duration;
+    fragment->mdat_size = index_fragment->mdat_size;
+  }
+
+  return TRUE;
+
+error:
+  gss_isom_track_free_fragments (track);
+  return FALSE;
+}
+
+/**
+ * gss_isom_parser_load_index:
+ * @file: a parser for a progressive file, not yet fragmentized
+ * @index_filename: file written by gss_isom_parser_save_index()
+ * @is_dash: the value that would be passed to
+ *   gss_isom_parser_fragmentize()
+ *
+ * Sets up the fragments of @file from an index file, with the same
+ * result as gss_isom_parser_fragmentize().  Fails, leaving @file
+ * untouched, if the index is missing, damaged, or was written for a
+ * different version of the file.
+ *
+ * Returns: TRUE on success
+ */
+gboolean
+gss_isom_parser_load_index (GssIsomParser * file, const char *index_filename,
+    gboolean is_dash)
+{
+  GssIsomIndexHeader expected;
+  const GssIsomIndexHeader *header;
+  GssIsomTrack *video_track;
+  GssIsomTrack *audio_track;
+  GMappedFile *mapped;
+  const guint8 *data;
+  const guint8 *p;
+  const guint8 *end;
+  guint8 digest[16];
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (file != NULL, FALSE);
+  g_return_val_if_fail (index_filename != NULL, FALSE);
+
+  video_track = gss_isom_movie_get_video_track (file->movie);
+  audio_track = gss_isom_movie_get_audio_track (file->movie);
+  if (video_track == NULL || audio_track == NULL ||
+      video_track->n_fragments > 0 || audio_track->n_fragments > 0) {
+    return FALSE;
+  }
+
+  mapped = g_mapped_file_new (index_filename, FALSE, NULL);
+  if (mapped == NULL) {
+    return FALSE;
+  }
+  data = (const guint8 *) g_mapped_file_get_contents (mapped);
+  p = data;
+  end = data + g_mapped_file_get_length (mapped);
+
+  gss_isom_index_header_init (&expected, file);
+  header = (const GssIsomIndexHeader *) gss_isom_index_read (&p, end,
+      sizeof (GssIsomIndexHeader));
+  if (header == NULL ||
+      memcmp (header->magic, expected.magic, 8) != 0 ||
+      header->version != expected.version ||
+      header->byte_order != expected.byte_order ||
+      header->word_size != expected.word_size ||
+      header->file_size != expected.file_size ||
+      header->file_mtime != expected.file_mtime ||
+      header->file_mtime_nsec != expected.file_mtime_nsec ||
+      header->file_inode != expected.file_inode) {
+    GST_DEBUG ("%s is stale or not an index file", index_filename);
+    goto out;
+  }
+
+  gss_isom_index_checksum (p, end - p, digest);
+  if (memcmp (digest, header->checksum, 16) != 0) {
+    GST_WARNING ("%s: checksum mismatch", index_filename);
+    goto out;
+  }
+
+  if (!gss_isom_index_read_track (video_track, 1, TRUE, is_dash, &p, end))
+    goto damaged;
+  if (!gss_isom_index_read_track (audio_track, 2, FALSE, is_dash, &p, end) ||
+      audio_track->n_fragments != video_track->n_fragments) {
+    gss_isom_track_free_fragments (audio_track);
+    gss_isom_track_free_fragments (video_track);
+    goto damaged;
+  }
+
+  gss_isom_parser_fragmentize_finish (file, video_track, audio_track);
+  ret = TRUE;
+  goto out;
+
+damaged:
+  GST_WARNING ("%s: damaged index file", index_filename);
+out:
+  g_mapped_file_unref (mapped);
+  return ret;
+}
+
 #if 0
 void
 gss_isom_track_prepare_streaming (GssIsomMovie * movie, GssIsomTrack * track,
@@ -3893,94 +4896,163 @@ gss_isom_track_prepare_streaming (GssIsomMovie * movie, GssIsomTrack * track,
 }
 #endif
 
+static void
+gss_isom_track_build_sample_index (GssIsomTrack * track)
+{
+  guint32 n_samples;
+  guint64 timestamp;
+  int stsc_index;
+  int i;
+
+  n_samples = 0;
+  timestamp = 0;
+  track->stts_first_sample = g_malloc (sizeof (guint32) *
+      (track->stts.entry_count + 1));
+  track->stts_first_timestamp = g_malloc (sizeof (guint64) *
+      (track->stts.entry_count + 1));
+  for (i = 0; i < track->stts.entry_count; i++) {
+    track->stts_first_sample[i] = n_samples;
+    track->stts_first_timestamp[i] = timestamp;
+    n_samples += track->stts.entries[i].sample_count;
+    timestamp += (guint64) track->stts.entries[i].sample_count *
+        (guint32) track->stts.entries[i].sample_delta;
+  }
+  track->stts_first_sample[i] = n_samples;
+  track->stts_first_timestamp[i] = timestamp;
+
+  n_samples = 0;
+  track->ctts_first_sample = g_malloc (sizeof (guint32) *
+      (track->ctts.entry_count + 1));
+  for (i = 0; i < track->ctts.entry_count; i++) {
+    track->ctts_first_sample[i] = n_samples;
+    n_samples += track->ctts.entries[i].sample_count;
+  }
+  track->ctts_first_sample[i] = n_samples;
+
+  /* stsc lists runs of chunks with the same number of samples, by
+   * the 1-based index of the first chunk of each run */
+  n_samples = 0;
+  stsc_index = 0;
+  track->chunk_first_sample = g_malloc (sizeof (guint32) *
+      (track->stco.entry_count + 1));
+  for (i = 0; i < track->stco.entry_count; i++) {
+    while (stsc_index + 1 < track->stsc.entry_count &&
+        i >= track->stsc.entries[stsc_index + 1].first_chunk - 1) {
+      stsc_index++;
+    }
+    track->chunk_first_sample[i] = n_samples;
+    if (track->stsc.entry_count > 0) {
+      n_samples += track->stsc.entries[stsc_index].samples_per_chunk;
+    }
+  }
+  track->chunk_first_sample[i] = n_samples;
+}
+
+/* Finds the entry of a table that @sample_index falls in, given the
+ * first sample of each of the @n_entries entries and the total.
+ * Returns -1 if @sample_index is past the end of the table. */
+static int
+gss_isom_find_entry (const guint32 * first_sample, int n_entries,
+    guint32 sample_index)
+{
+  int lo = 0;
+  int hi = n_entries;
+
+  if (n_entries == 0 || sample_index >= first_sample[n_entries])
+    return -1;
+
+  /* last entry starting at or before sample_index; empty entries
+   * start where the next one does, and are skipped over */
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+
+    if (first_sample[mid] <= sample_index) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
 int
 gss_isom_track_get_index_from_timestamp (GssIsomTrack * track,
     guint64 timestamp)
 {
-  int i;
-  int offset;
-  guint64 ts;
-  GssBoxSttsEntry *entries;
+  const guint64 *first_timestamp;
+  int lo = 0;
+  int hi = track->stts.entry_count;
+  guint32 delta;
 
-  ts = 0;
-  offset = 0;
-  entries = track->stts.entries;
-  for (i = 0; i < track->stts.entry_count; i++) {
-    if (timestamp - ts >= entries[i].sample_count * entries[i].sample_delta) {
-      ts += entries[i].sample_count * entries[i].sample_delta;
-      offset += entries[i].sample_count;
+  if (track->stts_first_sample == NULL) {
+    gss_isom_track_build_sample_index (track);
+  }
+  first_timestamp = track->stts_first_timestamp;
+
+  if (hi == 0 || timestamp >= first_timestamp[hi]) {
+    return track->stsz.sample_count;
+  }
+
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+
+    if (first_timestamp[mid] <= timestamp) {
+      lo = mid;
     } else {
-      offset += (timestamp - ts) / entries[i].sample_delta;
-      return offset;
+      hi = mid;
     }
   }
 
-  return track->stsz.sample_count;
+  delta = track->stts.entries[lo].sample_delta;
+  return track->stts_first_sample[lo] +
+      (timestamp - first_timestamp[lo]) / delta;
 }
 
 void
 gss_isom_track_get_sample (GssIsomTrack * track, GssIsomSample * sample,
     int sample_index)
 {
-  int i;
-  int offset;
   int chunk_index;
-  int index_in_chunk;
+  int i;
 
-  offset = 0;
-  sample->duration = 0;
-  for (i = 0; i < track->stts.entry_count; i++) {
-    if (sample_index < offset + track->stts.entries[i].sample_count) {
-      sample->duration = track->stts.entries[i].sample_delta;
-      break;
-    }
-    offset += track->stts.entries[i].sample_count;
+  if (track->stts_first_sample == NULL) {
+    gss_isom_track_build_sample_index (track);
   }
 
+  i = gss_isom_find_entry (track->stts_first_sample, track->stts.entry_count,
+      sample_index);
+  sample->duration = (i >= 0) ? track->stts.entries[i].sample_delta : 0;
+
   if (track->stsz.sample_size == 0) {
     sample->size = track->stsz.sample_sizes[sample_index];
   } else {
     sample->size = track->stsz.sample_size;
   }
 
-  offset = 0;
-  sample->composition_time_offset = 0;
-  for (i = 0; i < track->ctts.entry_count; i++) {
-    if (sample_index < offset + track->ctts.entries[i].sample_count) {
-      sample->composition_time_offset = track->ctts.entries[i].sample_offset;
-      break;
-    }
-    offset += track->ctts.entries[i].sample_count;
-  }
-
-  offset = 0;
-  chunk_index = 0;
-  index_in_chunk = 0;
-  GST_ERROR ("looking up sample_index %d", sample_index);
-  for (i = 0; i < track->stsc.entry_count; i++) {
-    int n_chunks;
+  i = gss_isom_find_entry (track->ctts_first_sample, track->ctts.entry_count,
+      sample_index);
+  sample->composition_time_offset =
+      (i >= 0) ? track->ctts.entries[i].sample_offset : 0;
 
-    if (i == track->stsc.entry_count - 1) {
-      /* don't actually care */
-      n_chunks = 0;
-    } else {
-      n_chunks = track->stsc.entries[i + 1].first_chunk -
-          track->stsc.entries[i].first_chunk;
-    }
-    chunk_index = (track->stsc.entries[i].first_chunk - 1);
-    index_in_chunk = sample_index - offset;
-    chunk_index += index_in_chunk / track->stsc.entries[i].samples_per_chunk;
-    index_in_chunk = index_in_chunk % track->stsc.entries[i].samples_per_chunk;
-
-    offset += track->stsc.entries[i].samples_per_chunk * n_chunks;
-  }
-
-  /* FIXME */
-  if (index_in_chunk != 0) {
-    GST_ERROR ("fixme index_in_chunk != 0 (%d)", index_in_chunk);
+  chunk_index = gss_isom_find_entry (track->chunk_first_sample,
+      track->stco.entry_count, sample_index);
+  if (chunk_index < 0) {
+    GST_WARNING ("sample %d is not in any chunk", sample_index);
+    sample->offset = 0;
+    return;
   }
 
+  /* the samples of a chunk are stored back to back */
   sample->offset = track->stco.chunk_offsets[chunk_index];
+  if (track->stsz.sample_size == 0) {
+    for (i = track->chunk_first_sample[chunk_index]; i < sample_index; i++) {
+      sample->offset += track->stsz.sample_sizes[i];
+    }
+  } else {
+    sample->offset += (guint64) track->stsz.sample_size *
+        (sample_index - track->chunk_first_sample[chunk_index]);
+  }
 }
 
 void
@@ -4047,7 +5119,6 @@ gss_isom_sample_iter_get_sample (GssIsomSampleIterator * iter,
   sample->duration = track->stts.entries[iter->stts_index].sample_delta;
 
   if (track->stsz.sample_size > 0) {
-    g_assert (0);
     sample->size = track->stsz.sample_size;
   } else {
     sample->size = track->stsz.sample_sizes[iter->sample_index];
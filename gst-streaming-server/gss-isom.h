@@ -70,6 +70,11 @@ struct _GssIsomFragment {
   GssBoxSaiz saiz;
   GssBoxSaio saio;
 
+  /* trun samples and sdtp flags, once packed by
+   * gss_isom_fragment_pack_samples(); trun.samples and
+   * sdtp.sample_flags are NULL then */
+  guint8 *packed_samples;
+  int packed_samples_size;
 };
 
 struct _GssIsomMovie
@@ -98,6 +103,25 @@ struct _GssIsomMovie
   GssBoxPssh pssh;
 };
 
+/* sample tables that can be decoded on demand */
+typedef enum {
+  GSS_ISOM_TABLE_STTS,
+  GSS_ISOM_TABLE_CTTS,
+  GSS_ISOM_TABLE_STSZ,
+  GSS_ISOM_TABLE_STSC,
+  GSS_ISOM_TABLE_STCO,
+  GSS_ISOM_TABLE_STSS,
+  GSS_ISOM_N_TABLES
+} GssIsomTable;
+
+typedef struct _GssIsomTableRef GssIsomTableRef;
+struct _GssIsomTableRef
+{
+  guint32 atom;                 /* 0 if not in the file */
+  guint32 size;
+  guint64 offset;               /* of the box contents */
+};
+
 struct _GssIsomTrack
 {
   GssBoxTkhd tkhd;
@@ -130,6 +154,22 @@ struct _GssIsomTrack
   GssBoxStsh stsh;
   GssBoxStdp stdp;
 
+  /* where the sample tables above are in the file.  If
+   * tables_deferred is set, their entries have not been decoded, see
+   * gss_isom_parser_load_sample_tables(). */
+  GssIsomTableRef table_refs[GSS_ISOM_N_TABLES];
+  gboolean tables_deferred;
+
+  /* cumulative counts over the sample tables, for looking up samples
+   * by index or timestamp without walking the tables: the first
+   * sample (and timestamp) of each stts and ctts entry, and the first
+   * sample of each chunk.  Each has one more element than entries,
+   * holding the totals.  Built on first use. */
+  guint32 *stts_first_sample;
+  guint64 *stts_first_timestamp;
+  guint32 *ctts_first_sample;
+  guint32 *chunk_first_sample;
+
   /* inside mdia/minf/stbl/stsd */
   GssBoxMp4v mp4v;
   GssBoxMp4a mp4a;
@@ -170,6 +210,12 @@ struct _GssIsomParser
   char *filename;
   guint64 file_size;
   guint64 offset;
+  /* set before parsing to parse the file in place */
+  gboolean use_mmap;
+  guint8 *map;
+  /* set before parsing to leave sample tables undecoded */
+  gboolean lazy_sample_tables;
+  const guint8 *box_data;
   GssIsomFtyp ftyp;
   guint32 ftyp_atom;
   gboolean is_isml;
@@ -218,6 +264,9 @@ GssIsomParser *gss_isom_parser_new (void);
 void gss_isom_parser_free (GssIsomParser *file);
 gboolean gss_isom_parser_parse_file (GssIsomParser *file,
     const char *filename);
+gboolean gss_isom_parser_load_sample_tables (GssIsomParser *file,
+    GssIsomTrack *track);
+void gss_isom_track_drop_sample_tables (GssIsomTrack *track);
 guint64 gss_isom_movie_get_duration (GssIsomMovie *movie);
 GssIsomFragment * gss_isom_track_get_fragment (GssIsomTrack * track, int index);
 GssIsomFragment * gss_isom_track_get_fragment_by_timestamp (GssIsomTrack *track,
@@ -239,6 +288,7 @@ int * gss_isom_fragment_get_sample_sizes (GssIsomFragment *fragment);
 void gss_isom_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
     guint8 *content_key);
 int gss_isom_fragment_get_n_samples (GssIsomFragment *fragment);
+void gss_isom_fragment_pack_samples (GssIsomFragment *fragment);
 
 GssIsomMovie *gss_isom_movie_new (void);
 void gss_isom_movie_free (GssIsomMovie * movie);
@@ -246,16 +296,25 @@ GssIsomTrack * gss_isom_movie_get_video_track (GssIsomMovie * movie);
 GssIsomTrack * gss_isom_movie_get_audio_track (GssIsomMovie * movie);
 GssIsomTrack * gss_isom_movie_get_track_by_id (GssIsomMovie * movie, int track_id);
 
+GssIsomTrack *gss_isom_track_new (void);
+void gss_isom_track_free (GssIsomTrack * track);
+
 GssIsomFragment *gss_isom_fragment_new (void);
 void gss_isom_fragment_free (GssIsomFragment * fragment);
 
 void gss_isom_parser_fragmentize (GssIsomParser *file, gboolean is_dash);
+gboolean gss_isom_parser_load_index (GssIsomParser *file,
+    const char *index_filename, gboolean is_dash);
+gboolean gss_isom_parser_save_index (GssIsomParser *file,
+    const char *index_filename);
 #if 0
 void gss_isom_track_prepare_streaming (GssIsomMovie *movie, GssIsomTrack *track,
     const GssBoxPssh *pssh);
 #endif
 
 guint64 gss_isom_track_get_n_samples (GssIsomTrack *track);
+gsize gss_isom_track_get_memory_size (GssIsomTrack *track);
+gsize gss_isom_parser_get_memory_size (GssIsomParser *parser);
 
 void gss_isom_track_get_sample (GssIsomTrack *track, GssIsomSample *sample,
     int sample_index);
@@ -0,0 +1,320 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include "config.h"
+
+#include "gss-mpegts.h"
+
+#include <gst/gst.h>
+#include <string.h>
+
+/* Transport stream packet header, read as one big-endian word:
+ *   sync_byte                     8   0xff000000
+ *   transport_error_indicator     1   0x00800000
+ *   payload_unit_start_indicator  1   0x00400000
+ *   transport_priority            1   0x00200000
+ *   PID                          13   0x001fff00
+ *   transport_scrambling_control  2   0x000000c0
+ *   adaptation_field_control      2   0x00000030
+ *   continuity_counter            4   0x0000000f
+ */
+#define TS_HEADER_SYNC(h) ((h) >> 24)
+#define TS_HEADER_PUSI(h) (((h) >> 22) & 1)
+#define TS_HEADER_PID(h) (((h) >> 8) & 0x1fff)
+#define TS_HEADER_HAS_ADAPTATION(h) ((h) & 0x20)
+#define TS_HEADER_HAS_PAYLOAD(h) ((h) & 0x10)
+
+#define TS_AF_RANDOM_ACCESS 0x40
+#define TS_AF_PCR 0x10
+
+#define TS_PID_PAT 0x0000
+#define TS_PCR_WRAP ((G_GUINT64_CONSTANT (1) << 33) * 300)
+
+
+static void gss_mpegts_scanner_parse_psi (GssMpegtsScanner * scanner,
+    const guint8 * data, guint32 header);
+
+
+static guint64
+read_pcr (const guint8 * data)
+{
+  guint64 base;
+  int ext;
+
+  base = ((guint64) data[0] << 25) | (data[1] << 17) | (data[2] << 9) |
+      (data[3] << 1) | (data[4] >> 7);
+  ext = ((data[4] & 1) << 8) | data[5];
+
+  return base * 300 + ext;
+}
+
+/* Parses the 4-byte header and the adaptation field flags of the packet
+ * at data.  data must point to a whole packet.  Returns FALSE if the
+ * packet does not start with a sync byte. */
+gboolean
+gss_mpegts_packet_parse (const guint8 * data, GssMpegtsPacket * packet)
+{
+  guint32 header = GST_READ_UINT32_BE (data);
+
+  if (TS_HEADER_SYNC (header) != GSS_MPEGTS_SYNC_BYTE)
+    return FALSE;
+
+  packet->pid = TS_HEADER_PID (header);
+  packet->payload_unit_start = TS_HEADER_PUSI (header);
+  packet->random_access = FALSE;
+  packet->has_pcr = FALSE;
+  packet->pcr = 0;
+
+  if (TS_HEADER_HAS_ADAPTATION (header) && data[4] > 0) {
+    packet->random_access = (data[5] & TS_AF_RANDOM_ACCESS) != 0;
+    if ((data[5] & TS_AF_PCR) && data[4] >= 7) {
+      packet->has_pcr = TRUE;
+      packet->pcr = read_pcr (data + 6);
+    }
+  }
+
+  return TRUE;
+}
+
+void
+gss_mpegts_scanner_init (GssMpegtsScanner * scanner)
+{
+  memset (scanner, 0, sizeof (*scanner));
+  scanner->pmt_pid = -1;
+  scanner->video_pid = -1;
+  scanner->pcr_pid = -1;
+}
+
+static gsize
+gss_mpegts_resync (const guint8 * data, gsize size, gsize offset)
+{
+  const guint8 *p;
+
+  while (offset < size) {
+    p = memchr (data + offset, GSS_MPEGTS_SYNC_BYTE, size - offset);
+    if (p == NULL)
+      return size;
+    offset = p - data;
+    if (offset + GSS_MPEGTS_PACKET_SIZE >= size ||
+        data[offset + GSS_MPEGTS_PACKET_SIZE] == GSS_MPEGTS_SYNC_BYTE)
+      return offset;
+    offset++;
+  }
+  return size;
+}
+
+/* Looks at one whole packet, whose sync byte has been checked.
+ * Returns TRUE if it starts a random access point (a keyframe) in the
+ * video elementary stream.  Until the PMT has been seen, a random
+ * access point on any PID is accepted. */
+static gboolean
+gss_mpegts_scanner_handle_packet (GssMpegtsScanner * scanner,
+    const guint8 * data)
+{
+  GssMpegtsPacket packet;
+
+  scanner->n_packets++;
+  gss_mpegts_packet_parse (data, &packet);
+
+  if (G_UNLIKELY (packet.pid == TS_PID_PAT || packet.pid == scanner->pmt_pid)) {
+    if (packet.payload_unit_start) {
+      gss_mpegts_scanner_parse_psi (scanner, data, GST_READ_UINT32_BE (data));
+    }
+    return FALSE;
+  }
+
+  if (packet.has_pcr && (scanner->pcr_pid < 0 ||
+          packet.pid == scanner->pcr_pid)) {
+    scanner->pcr = packet.pcr;
+    scanner->have_pcr = TRUE;
+  }
+
+  return packet.random_access && packet.payload_unit_start &&
+      (scanner->video_pid < 0 || packet.pid == scanner->video_pid);
+}
+
+/**
+ * gss_mpegts_scanner_scan:
+ * @scanner: a scanner
+ * @data: a buffer of the transport stream
+ * @size: size of @data
+ * @offset: (inout): where to start scanning in @data, 0 for a new
+ *   buffer.  Set to where to resume.
+ * @split: (out): offset of the keyframe packet in @data
+ *
+ * Walks the packets of @data, and stops at the first packet that starts
+ * a random access point (a keyframe) in the video elementary stream.
+ * The PCR carried by that packet, if any, is already accounted for in
+ * scanner->pcr.
+ *
+ * Buffers do not need to start or end on packet boundaries: a packet
+ * left incomplete at the end of @data is kept, and completed from the
+ * start of the next buffer.  If that packet is the keyframe, @split is
+ * negative, and the packet starts -@split bytes before @data.
+ *
+ * Only the header and the adaptation field flags of each packet are
+ * examined, unless the packet belongs to the PAT/PMT, so the cost is a
+ * few loads and compares per 188 bytes.
+ *
+ * Returns: TRUE if a keyframe was found
+ */
+gboolean
+gss_mpegts_scanner_scan (GssMpegtsScanner * scanner, const guint8 * data,
+    gsize size, gsize * offset, gssize * split)
+{
+  gsize pos = *offset;
+
+  if (pos == 0 && scanner->partial_size > 0) {
+    gsize n = GSS_MPEGTS_PACKET_SIZE - scanner->partial_size;
+    int partial_size = scanner->partial_size;
+
+    if (size < n) {
+      memcpy (scanner->partial + scanner->partial_size, data, size);
+      scanner->partial_size += size;
+      *offset = size;
+      return FALSE;
+    }
+
+    memcpy (scanner->partial + scanner->partial_size, data, n);
+    scanner->partial_size = 0;
+    pos = n;
+    if (gss_mpegts_scanner_handle_packet (scanner, scanner->partial)) {
+      *offset = pos;
+      *split = -partial_size;
+      return TRUE;
+    }
+  }
+
+  while (pos + GSS_MPEGTS_PACKET_SIZE <= size) {
+    const guint8 *p = data + pos;
+
+    if (G_UNLIKELY (p[0] != GSS_MPEGTS_SYNC_BYTE)) {
+      scanner->n_resyncs++;
+      pos = gss_mpegts_resync (data, size, pos + 1);
+      continue;
+    }
+
+    pos += GSS_MPEGTS_PACKET_SIZE;
+    if (gss_mpegts_scanner_handle_packet (scanner, p)) {
+      *offset = pos;
+      *split = pos - GSS_MPEGTS_PACKET_SIZE;
+      return TRUE;
+    }
+  }
+
+  if (pos < size && data[pos] != GSS_MPEGTS_SYNC_BYTE) {
+    scanner->n_resyncs++;
+    pos = gss_mpegts_resync (data, size, pos + 1);
+  }
+  if (pos < size) {
+    memcpy (scanner->partial, data + pos, size - pos);
+    scanner->partial_size = size - pos;
+  }
+  *offset = size;
+
+  return FALSE;
+}
+
+/* Handles single-packet PAT and PMT sections, which is all that muxers
+ * generate for the one-program streams we serve. */
+static void
+gss_mpegts_scanner_parse_psi (GssMpegtsScanner * scanner, const guint8 * data,
+    guint32 header)
+{
+  int offset = 4;
+  int end;
+  int section_length;
+
+  if (!TS_HEADER_HAS_PAYLOAD (header))
+    return;
+  if (TS_HEADER_HAS_ADAPTATION (header))
+    offset += 1 + data[4];
+  if (offset >= GSS_MPEGTS_PACKET_SIZE)
+    return;
+  offset += 1 + data[offset];   /* pointer_field */
+  if (offset + 8 > GSS_MPEGTS_PACKET_SIZE)
+    return;
+
+  section_length = ((data[offset + 1] & 0x0f) << 8) | data[offset + 2];
+  /* exclude CRC_32 */
+  end = MIN (offset + 3 + section_length - 4, GSS_MPEGTS_PACKET_SIZE);
+
+  if (data[offset] == 0x00 && TS_HEADER_PID (header) == TS_PID_PAT) {
+    int i;
+
+    for (i = offset + 8; i + 4 <= end; i += 4) {
+      int program_number = (data[i] << 8) | data[i + 1];
+
+      if (program_number != 0) {
+        int pmt_pid = ((data[i + 2] & 0x1f) << 8) | data[i + 3];
+
+        if (pmt_pid != scanner->pmt_pid) {
+          GST_DEBUG ("PMT on PID 0x%04x", pmt_pid);
+          scanner->pmt_pid = pmt_pid;
+          scanner->video_pid = -1;
+        }
+        break;
+      }
+    }
+  } else if (data[offset] == 0x02) {
+    int program_info_length;
+    int i;
+
+    if (offset + 12 > end)
+      return;
+    scanner->pcr_pid = ((data[offset + 8] & 0x1f) << 8) | data[offset + 9];
+    program_info_length =
+        ((data[offset + 10] & 0x0f) << 8) | data[offset + 11];
+
+    for (i = offset + 12 + program_info_length; i + 5 <= end;) {
+      int stream_type = data[i];
+      int pid = ((data[i + 1] & 0x1f) << 8) | data[i + 2];
+      int es_info_length = ((data[i + 3] & 0x0f) << 8) | data[i + 4];
+
+      /* MPEG-2 video, H.264, H.265 */
+      if (stream_type == 0x02 || stream_type == 0x1b || stream_type == 0x24) {
+        if (pid != scanner->video_pid) {
+          GST_DEBUG ("video on PID 0x%04x, PCR on PID 0x%04x", pid,
+              scanner->pcr_pid);
+          scanner->video_pid = pid;
+        }
+        break;
+      }
+      i += 5 + es_info_length;
+    }
+  }
+}
+
+/* Returns the time between two PCR values in seconds, allowing for the
+ * 33-bit wraparound of the PCR base. */
+double
+gss_mpegts_pcr_elapsed (guint64 start, guint64 end)
+{
+  guint64 diff;
+
+  if (end >= start) {
+    diff = end - start;
+  } else {
+    diff = TS_PCR_WRAP - start + end;
+  }
+
+  return (double) diff / GSS_MPEGTS_PCR_CLOCK;
+}
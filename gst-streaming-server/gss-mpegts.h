@@ -0,0 +1,72 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GSS_MPEGTS_H
+#define _GSS_MPEGTS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define GSS_MPEGTS_PACKET_SIZE 188
+#define GSS_MPEGTS_SYNC_BYTE 0x47
+#define GSS_MPEGTS_PCR_CLOCK 27000000
+
+typedef struct _GssMpegtsPacket GssMpegtsPacket;
+typedef struct _GssMpegtsScanner GssMpegtsScanner;
+
+struct _GssMpegtsPacket {
+  int pid;
+  gboolean payload_unit_start;
+  gboolean random_access;
+  gboolean has_pcr;
+  guint64 pcr; /* in 27 MHz units */
+};
+
+struct _GssMpegtsScanner {
+  int pmt_pid; /* -1 until the PAT has been seen */
+  int video_pid; /* -1 until the PMT has been seen */
+  int pcr_pid;
+
+  gboolean have_pcr;
+  guint64 pcr; /* most recent PCR on pcr_pid */
+
+  guint64 n_packets;
+  guint64 n_resyncs;
+
+  /* start of a packet that continues in the next buffer */
+  guint8 partial[GSS_MPEGTS_PACKET_SIZE];
+  int partial_size;
+};
+
+
+gboolean gss_mpegts_packet_parse (const guint8 *data, GssMpegtsPacket *packet);
+
+void gss_mpegts_scanner_init (GssMpegtsScanner *scanner);
+gboolean gss_mpegts_scanner_scan (GssMpegtsScanner *scanner,
+    const guint8 *data, gsize size, gsize *offset, gssize *split);
+double gss_mpegts_pcr_elapsed (guint64 start, guint64 end);
+
+
+G_END_DECLS
+
+#endif
+
@@ -61,6 +61,10 @@ enum
 #define DEFAULT_KEY_SEED "5D5068BEC9B384FF6044867159F16D6B755544FCD5116989B1ACC4278E88"
 #define DEFAULT_ALLOW_CLEAR FALSE
 
+#define GSS_PLAYREADY_ENCRYPT_THREADS 4
+/* smallest piece of a fragment worth encrypting in its own thread */
+#define GSS_PLAYREADY_ENCRYPT_PIECE_SIZE (256 * 1024)
+
 
 static void gss_playready_finalize (GObject * object);
 static void gss_playready_set_property (GObject * object, guint prop_id,
@@ -515,97 +519,290 @@ gss_playready_generate_checksum (guint8 * key_id, guint8 * content_key)
   return g_base64_encode (dest, 8);
 }
 
-#if OPENSSL_VERSION_NUMBER >= 0x100010fL
-void
-gss_playready_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
-    guint8 * content_key)
+/* AES-128-CTR with the key schedule set up once and reused for all the
+ * samples of a fragment.  Only the counter is reset for each sample. */
+typedef struct _GssPlayreadyCtr GssPlayreadyCtr;
+struct _GssPlayreadyCtr
 {
-  GssBoxTrun *trun = &fragment->trun;
-  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
-  guint64 sample_offset;
-  int i;
-  int bytes = 0;
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
   EVP_CIPHER_CTX *ctx;
+#else
+  AES_KEY key;
+  unsigned char iv[16];
+  unsigned char ecount_buf[16];
+  unsigned int num;
+#endif
+};
 
-  sample_offset = 8;
+static void
+gss_playready_ctr_init (GssPlayreadyCtr * ctr, const guint8 * content_key)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  ctr->ctx = EVP_CIPHER_CTX_new ();
+  EVP_EncryptInit_ex (ctr->ctx, EVP_aes_128_ctr (), NULL, content_key, NULL);
+#else
+  AES_set_encrypt_key (content_key, 16 * 8, &ctr->key);
+#endif
+}
+
+static void
+gss_playready_ctr_clear (GssPlayreadyCtr * ctr)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  EVP_CIPHER_CTX_free (ctr->ctx);
+#endif
+}
+
+/* Moves to @position in the key stream of a sample with initialization
+ * vector @iv. */
+static void
+gss_playready_ctr_seek (GssPlayreadyCtr * ctr, guint64 iv, guint64 position)
+{
+  unsigned char raw_iv[16];
 
-  ctx = EVP_CIPHER_CTX_new ();
-  for (i = 0; i < trun->sample_count; i++) {
-    unsigned char raw_iv[16];
+  GST_WRITE_UINT64_BE (raw_iv, iv);
+  GST_WRITE_UINT64_BE (raw_iv + 8, position / 16);
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  {
+    unsigned char skip[16] = { 0 };
     int len;
 
-    memset (raw_iv, 0, 16);
-    GST_WRITE_UINT64_BE (raw_iv, se->samples[i].iv);
+    /* keeps the key schedule */
+    EVP_EncryptInit_ex (ctr->ctx, NULL, NULL, NULL, raw_iv);
+    if (position % 16) {
+      EVP_EncryptUpdate (ctr->ctx, skip, &len, skip, position % 16);
+    }
+  }
+#else
+  memcpy (ctr->iv, raw_iv, 16);
+  memset (ctr->ecount_buf, 0, 16);
+  ctr->num = position % 16;
+  if (ctr->num > 0) {
+    /* AES_ctr128_encrypt() continues from the middle of ecount_buf */
+    AES_encrypt (ctr->iv, ctr->ecount_buf, &ctr->key);
+    GST_WRITE_UINT64_BE (ctr->iv + 8, position / 16 + 1);
+  }
+#endif
+}
 
-    EVP_EncryptInit_ex (ctx, EVP_aes_128_ctr (), NULL, content_key, raw_iv);
+static void
+gss_playready_ctr_encrypt (GssPlayreadyCtr * ctr, guint8 * data, gsize size)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x100010fL
+  int len;
 
-    if (se->samples[i].num_entries == 0) {
-      EVP_EncryptUpdate (ctx,
-          mdat_data + sample_offset, &len,
-          mdat_data + sample_offset, trun->samples[i].size);
-      bytes += trun->samples[i].size;
-    } else {
-      guint64 offset;
-      int j;
-      offset = sample_offset;
-      for (j = 0; j < se->samples[i].num_entries; j++) {
+  EVP_EncryptUpdate (ctr->ctx, data, &len, data, size);
+#else
+  AES_ctr128_encrypt (data, data, size, &ctr->key, ctr->iv, ctr->ecount_buf,
+      &ctr->num);
+#endif
+}
+
+static void
+gss_playready_encrypt_range_ctr (GssPlayreadyCtr * ctr,
+    GssIsomFragment * fragment, guint8 * data, guint64 start, guint64 size)
+{
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  guint64 end = start + size;
+  guint64 sample_offset = 0;
+  int n_samples;
+  int *sizes;
+  int i;
+
+  n_samples = gss_isom_fragment_get_n_samples (fragment);
+  sizes = gss_isom_fragment_get_sample_sizes (fragment);
+  for (i = 0; i < n_samples && sample_offset < end; i++) {
+    guint64 offset = sample_offset;
+    guint64 position = 0;
+    gboolean seeked = FALSE;
+    int j;
+
+    if (sample_offset + sizes[i] <= start) {
+      sample_offset += sizes[i];
+      continue;
+    }
+
+    /* walk the encrypted regions of the sample; the key stream
+     * continues from one region to the next */
+    for (j = 0; j < MAX (se->samples[i].num_entries, 1); j++) {
+      guint64 region_size;
+      guint64 s, e;
+
+      if (se->samples[i].num_entries == 0) {
+        region_size = sizes[i];
+      } else {
         offset += se->samples[i].entries[j].bytes_of_clear_data;
-        EVP_EncryptUpdate (ctx,
-            mdat_data + offset, &len,
-            mdat_data + offset,
-            se->samples[i].entries[j].bytes_of_encrypted_data);
-        offset += se->samples[i].entries[j].bytes_of_encrypted_data;
-        bytes += se->samples[i].entries[j].bytes_of_encrypted_data;
+        region_size = se->samples[i].entries[j].bytes_of_encrypted_data;
       }
+
+      s = MAX (start, offset);
+      e = MIN (end, offset + region_size);
+      if (s < e) {
+        /* later regions start where the previous one ended */
+        if (!seeked) {
+          gss_playready_ctr_seek (ctr, se->samples[i].iv,
+              position + (s - offset));
+          seeked = TRUE;
+        }
+        gss_playready_ctr_encrypt (ctr, data + (s - start), e - s);
+      }
+      offset += region_size;
+      position += region_size;
     }
-    sample_offset += trun->samples[i].size;
+    sample_offset += sizes[i];
   }
-  EVP_CIPHER_CTX_free (ctx);
+  g_free (sizes);
 }
-#else
+
+/**
+ * gss_playready_encrypt_range:
+ * @fragment: a fragment
+ * @data: sample data to encrypt in place
+ * @start: offset of @data in the sample data of @fragment, not
+ *   counting the mdat header
+ * @size: size of @data
+ * @content_key: content key
+ *
+ * Encrypts part of the sample data of a fragment, producing the same
+ * bytes as the corresponding part of gss_playready_encrypt_samples().
+ * The counter is set up to start in the middle of a sample where
+ * needed, so that byte range requests only need to read and encrypt
+ * the requested bytes.
+ */
+void
+gss_playready_encrypt_range (GssIsomFragment * fragment, guint8 * data,
+    guint64 start, guint64 size, guint8 * content_key)
+{
+  GssPlayreadyCtr ctr;
+
+  gss_playready_ctr_init (&ctr, content_key);
+  gss_playready_encrypt_range_ctr (&ctr, fragment, data, start, size);
+  gss_playready_ctr_clear (&ctr);
+}
+
+/* Large fragments are split into pieces that are encrypted in
+ * parallel.  Each piece sets up its counters from its offset in the
+ * fragment, so the result is the same as encrypting in one go. */
+typedef struct _GssPlayreadyEncryptBatch GssPlayreadyEncryptBatch;
+typedef struct _GssPlayreadyEncryptPiece GssPlayreadyEncryptPiece;
+
+struct _GssPlayreadyEncryptPiece
+{
+  GssPlayreadyEncryptBatch *batch;
+  guint64 start;
+  guint64 size;
+};
+
+struct _GssPlayreadyEncryptBatch
+{
+  GssIsomFragment *fragment;
+  guint8 *data;
+  guint8 *content_key;
+
+  GMutex lock;
+  GCond cond;
+  int n_pending;
+
+  GssPlayreadyEncryptPiece pieces[GSS_PLAYREADY_ENCRYPT_THREADS];
+};
+
+static void
+gss_playready_encrypt_piece (GssPlayreadyEncryptPiece * piece)
+{
+  GssPlayreadyEncryptBatch *batch = piece->batch;
+
+  gss_playready_encrypt_range (batch->fragment, batch->data + piece->start,
+      piece->start, piece->size, batch->content_key);
+}
+
+static void
+gss_playready_encrypt_thread (GssPlayreadyEncryptPiece * piece,
+    gpointer unused)
+{
+  GssPlayreadyEncryptBatch *batch = piece->batch;
+
+  gss_playready_encrypt_piece (piece);
+
+  g_mutex_lock (&batch->lock);
+  batch->n_pending--;
+  if (batch->n_pending == 0)
+    g_cond_signal (&batch->cond);
+  g_mutex_unlock (&batch->lock);
+}
+
+static GThreadPool *
+gss_playready_get_encrypt_pool (void)
+{
+  static gsize pool = 0;
+
+  if (g_once_init_enter (&pool)) {
+    /* the calling thread encrypts one of the pieces */
+    g_once_init_leave (&pool, (gsize) g_thread_pool_new ((GFunc)
+            gss_playready_encrypt_thread, NULL,
+            GSS_PLAYREADY_ENCRYPT_THREADS - 1, FALSE, NULL));
+  }
+
+  return (GThreadPool *) pool;
+}
+
+/**
+ * gss_playready_encrypt_samples:
+ * @fragment: a fragment
+ * @mdat_data: mdat of @fragment, including the 8 byte header
+ * @content_key: content key
+ *
+ * Encrypts the sample data of a fragment in place, with AES-128-CTR
+ * and the per-sample initialization vectors of the fragment.  Large
+ * fragments are encrypted by several threads.
+ */
 void
 gss_playready_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
     guint8 * content_key)
 {
-  GssBoxTrun *trun = &fragment->trun;
-  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
-  guint64 sample_offset;
+  GssPlayreadyEncryptBatch batch;
+  GThreadPool *pool;
+  guint64 size = fragment->mdat_size - 8;
+  guint64 piece_size;
+  int n_pieces;
   int i;
 
-  sample_offset = 8;
+  n_pieces = MIN (GSS_PLAYREADY_ENCRYPT_THREADS,
+      size / GSS_PLAYREADY_ENCRYPT_PIECE_SIZE);
+  if (n_pieces <= 1) {
+    gss_playready_encrypt_range (fragment, mdat_data + 8, 0, size,
+        content_key);
+    return;
+  }
 
-  for (i = 0; i < trun->sample_count; i++) {
-    unsigned char raw_iv[16];
-    unsigned char ecount_buf[16] = { 0 };
-    unsigned int num = 0;
-    AES_KEY key;
+  batch.fragment = fragment;
+  batch.data = mdat_data + 8;
+  batch.content_key = content_key;
+  g_mutex_init (&batch.lock);
+  g_cond_init (&batch.cond);
+  batch.n_pending = n_pieces - 1;
+
+  /* whole AES blocks, so that pieces rarely start mid-block */
+  piece_size = ((size + n_pieces - 1) / n_pieces + 15) & ~(guint64) 15;
+  for (i = 0; i < n_pieces; i++) {
+    batch.pieces[i].batch = &batch;
+    batch.pieces[i].start = MIN (i * piece_size, size);
+    batch.pieces[i].size = MIN (piece_size, size - batch.pieces[i].start);
+  }
 
-    memset (raw_iv, 0, 16);
-    GST_WRITE_UINT64_BE (raw_iv, se->samples[i].iv);
+  pool = gss_playready_get_encrypt_pool ();
+  for (i = 1; i < n_pieces; i++) {
+    g_thread_pool_push (pool, &batch.pieces[i], NULL);
+  }
+  gss_playready_encrypt_piece (&batch.pieces[0]);
 
-    AES_set_encrypt_key (content_key, 16 * 8, &key);
+  g_mutex_lock (&batch.lock);
+  while (batch.n_pending > 0)
+    g_cond_wait (&batch.cond, &batch.lock);
+  g_mutex_unlock (&batch.lock);
 
-    if (se->samples[i].num_entries == 0) {
-      AES_ctr128_encrypt (mdat_data + sample_offset,
-          mdat_data + sample_offset, trun->samples[i].size,
-          &key, raw_iv, ecount_buf, &num);
-    } else {
-      guint64 offset;
-      int j;
-      offset = sample_offset;
-      for (j = 0; j < se->samples[i].num_entries; j++) {
-        offset += se->samples[i].entries[j].bytes_of_clear_data;
-        AES_ctr128_encrypt (mdat_data + offset,
-            mdat_data + offset,
-            se->samples[i].entries[j].bytes_of_encrypted_data,
-            &key, raw_iv, ecount_buf, &num);
-        offset += se->samples[i].entries[j].bytes_of_encrypted_data;
-      }
-    }
-    sample_offset += trun->samples[i].size;
-  }
+  g_mutex_clear (&batch.lock);
+  g_cond_clear (&batch.cond);
 }
-#endif
 
 const char *
 gss_playready_get_uri (GssDrmType drm_type)
@@ -70,6 +70,8 @@ char * gss_playready_get_protection_header_base64 (GssAdaptive *adaptive,
     const char *la_url, const char *auth_token);
 void gss_playready_encrypt_samples (GssIsomFragment * fragment,
     guint8 * mdat_data, guint8 * content_key);
+void gss_playready_encrypt_range (GssIsomFragment * fragment,
+    guint8 * data, guint64 start, guint64 size, guint8 * content_key);
 void gss_playready_setup_iv (GssPlayready *playready, GssAdaptive * adaptive,
     GssAdaptiveLevel * level, GssIsomFragment * fragment);
 
@@ -0,0 +1,282 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Predictive prefetch of VOD fragments.
+ *
+ * Players fetch the fragments of a level strictly in sequence, so once
+ * a client has asked for fragments N-1 and N, it will very likely ask
+ * for N+1 next.  The caller identifies a client and level with a
+ * session key, and reports each fragment index requested.  When the
+ * access is sequential, the caller's function for loading the next
+ * fragment (typically into the fragment cache) is run in a background
+ * thread.
+ *
+ * Prefetches run in their own small thread pool, so they never hold up
+ * the worker threads serving requests, and are dropped rather than
+ * queued when the number or total size of prefetches in progress is
+ * over budget.  Each session remembers what was prefetched for it, so
+ * that the next request can be counted as a hit, a late hit, or the
+ * prefetch as wasted.
+ */
+
+#include "config.h"
+
+#include "gss-prefetch.h"
+
+#include <gst/gst.h>
+#include <string.h>
+
+#define GSS_PREFETCH_THREADS 2
+#define GSS_PREFETCH_SESSION_TIMEOUT (60 * G_TIME_SPAN_SECOND)
+#define GSS_PREFETCH_SWEEP_INTERVAL (10 * G_TIME_SPAN_SECOND)
+
+typedef struct _GssPrefetchSession GssPrefetchSession;
+typedef struct _GssPrefetchJob GssPrefetchJob;
+
+struct _GssPrefetchSession
+{
+  int last_index;
+  gint64 last_time;
+  int prefetch_index;           /* -1 if none */
+  gboolean prefetch_done;
+};
+
+struct _GssPrefetchJob
+{
+  char *session_key;
+  int index;
+  gsize size;
+  GssPrefetchFunc func;
+  gpointer data;
+  GDestroyNotify destroy;
+};
+
+struct _GssPrefetch
+{
+  GMutex lock;
+  GHashTable *sessions;
+  GThreadPool *pool;
+  int max_pending;
+  gsize max_pending_size;
+  gint64 last_sweep_time;
+
+  GssPrefetchStats stats;
+};
+
+
+static void gss_prefetch_thread (GssPrefetchJob * job, GssPrefetch * prefetch);
+
+/**
+ * gss_prefetch_new:
+ * @max_pending: number of prefetches that may be in progress at once,
+ *   0 to disable prefetching
+ * @max_pending_size: total size of the fragments being prefetched at
+ *   once, in bytes
+ *
+ * Returns: a new prefetcher
+ */
+GssPrefetch *
+gss_prefetch_new (int max_pending, gsize max_pending_size)
+{
+  GssPrefetch *prefetch;
+
+  prefetch = g_new0 (GssPrefetch, 1);
+  g_mutex_init (&prefetch->lock);
+  prefetch->sessions = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, g_free);
+  prefetch->pool = g_thread_pool_new ((GFunc) gss_prefetch_thread, prefetch,
+      GSS_PREFETCH_THREADS, FALSE, NULL);
+  prefetch->max_pending = max_pending;
+  prefetch->max_pending_size = max_pending_size;
+
+  return prefetch;
+}
+
+void
+gss_prefetch_free (GssPrefetch * prefetch)
+{
+  g_return_if_fail (prefetch != NULL);
+
+  /* lets prefetches in progress finish */
+  g_thread_pool_free (prefetch->pool, FALSE, TRUE);
+  g_hash_table_unref (prefetch->sessions);
+  g_mutex_clear (&prefetch->lock);
+  g_free (prefetch);
+}
+
+void
+gss_prefetch_set_max_pending (GssPrefetch * prefetch, int max_pending)
+{
+  g_return_if_fail (prefetch != NULL);
+
+  g_mutex_lock (&prefetch->lock);
+  prefetch->max_pending = max_pending;
+  g_mutex_unlock (&prefetch->lock);
+}
+
+static gboolean
+gss_prefetch_session_expired (gpointer key, GssPrefetchSession * session,
+    gint64 * now)
+{
+  return *now - session->last_time > GSS_PREFETCH_SESSION_TIMEOUT;
+}
+
+static void
+gss_prefetch_thread (GssPrefetchJob * job, GssPrefetch * prefetch)
+{
+  GssPrefetchSession *session;
+
+  job->func (job->data);
+  if (job->destroy)
+    job->destroy (job->data);
+
+  g_mutex_lock (&prefetch->lock);
+  prefetch->stats.n_pending--;
+  prefetch->stats.pending_size -= job->size;
+  session = g_hash_table_lookup (prefetch->sessions, job->session_key);
+  if (session && session->prefetch_index == job->index) {
+    session->prefetch_done = TRUE;
+  }
+  g_mutex_unlock (&prefetch->lock);
+
+  g_free (job->session_key);
+  g_free (job);
+}
+
+/**
+ * gss_prefetch_request:
+ * @prefetch: a prefetcher
+ * @session_key: identifies a client and level
+ * @index: index of the fragment the client requested
+ * @next_size: size of fragment @index + 1, or 0 if there is none
+ * @func: (allow-none): function loading fragment @index + 1, NULL if
+ *   there is none
+ * @data: data for @func
+ * @destroy: (allow-none): frees @data
+ *
+ * Notes a fragment request, and runs @func in a background thread if
+ * the session is reading fragments in sequence and prefetching is
+ * within budget.  @data is freed with @destroy in any case.
+ *
+ * Returns: TRUE if a prefetch was started
+ */
+gboolean
+gss_prefetch_request (GssPrefetch * prefetch, const char *session_key,
+    int index, gsize next_size, GssPrefetchFunc func, gpointer data,
+    GDestroyNotify destroy)
+{
+  GssPrefetchSession *session;
+  GssPrefetchJob *job;
+  gboolean sequential;
+  gint64 now;
+
+  g_return_val_if_fail (prefetch != NULL, FALSE);
+  g_return_val_if_fail (session_key != NULL, FALSE);
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&prefetch->lock);
+  if (now - prefetch->last_sweep_time > GSS_PREFETCH_SWEEP_INTERVAL) {
+    g_hash_table_foreach_remove (prefetch->sessions,
+        (GHRFunc) gss_prefetch_session_expired, &now);
+    prefetch->last_sweep_time = now;
+  }
+
+  session = g_hash_table_lookup (prefetch->sessions, session_key);
+  if (session == NULL) {
+    session = g_new0 (GssPrefetchSession, 1);
+    session->last_index = -1;
+    session->prefetch_index = -1;
+    g_hash_table_insert (prefetch->sessions, g_strdup (session_key), session);
+  }
+
+  /* a repeated request (e.g., the second half of a range) neither
+   * breaks nor extends the sequence */
+  if (index == session->last_index) {
+    session->last_time = now;
+    g_mutex_unlock (&prefetch->lock);
+    if (destroy)
+      destroy (data);
+    return FALSE;
+  }
+
+  if (session->prefetch_index >= 0) {
+    if (session->prefetch_index != index) {
+      prefetch->stats.n_wasted++;
+    } else if (session->prefetch_done) {
+      prefetch->stats.n_hits++;
+    } else {
+      prefetch->stats.n_late++;
+    }
+    session->prefetch_index = -1;
+  }
+
+  sequential = (index == session->last_index + 1);
+  session->last_index = index;
+  session->last_time = now;
+
+  if (!sequential || func == NULL) {
+    g_mutex_unlock (&prefetch->lock);
+    if (destroy)
+      destroy (data);
+    return FALSE;
+  }
+
+  if (prefetch->stats.n_pending >= prefetch->max_pending ||
+      prefetch->stats.pending_size + next_size > prefetch->max_pending_size) {
+    if (prefetch->max_pending > 0)
+      prefetch->stats.n_dropped++;
+    g_mutex_unlock (&prefetch->lock);
+    if (destroy)
+      destroy (data);
+    return FALSE;
+  }
+
+  session->prefetch_index = index + 1;
+  session->prefetch_done = FALSE;
+  prefetch->stats.n_started++;
+  prefetch->stats.n_pending++;
+  prefetch->stats.pending_size += next_size;
+  g_mutex_unlock (&prefetch->lock);
+
+  job = g_new0 (GssPrefetchJob, 1);
+  job->session_key = g_strdup (session_key);
+  job->index = index + 1;
+  job->size = next_size;
+  job->func = func;
+  job->data = data;
+  job->destroy = destroy;
+  g_thread_pool_push (prefetch->pool, job, NULL);
+
+  return TRUE;
+}
+
+void
+gss_prefetch_get_stats (GssPrefetch * prefetch, GssPrefetchStats * stats)
+{
+  g_return_if_fail (prefetch != NULL);
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (&prefetch->lock);
+  *stats = prefetch->stats;
+  stats->n_sessions = g_hash_table_size (prefetch->sessions);
+  g_mutex_unlock (&prefetch->lock);
+}
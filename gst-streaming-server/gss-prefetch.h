@@ -0,0 +1,57 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GSS_PREFETCH_H
+#define _GSS_PREFETCH_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GssPrefetch GssPrefetch;
+typedef struct _GssPrefetchStats GssPrefetchStats;
+
+typedef void (*GssPrefetchFunc) (gpointer data);
+
+struct _GssPrefetchStats {
+  guint64 n_started;
+  guint64 n_dropped;            /* over budget */
+  guint64 n_hits;               /* requested after the prefetch finished */
+  guint64 n_late;               /* requested while still being prefetched */
+  guint64 n_wasted;             /* never requested */
+  int n_pending;
+  gsize pending_size;
+  int n_sessions;
+};
+
+
+GssPrefetch *gss_prefetch_new (int max_pending, gsize max_pending_size);
+void gss_prefetch_free (GssPrefetch *prefetch);
+void gss_prefetch_set_max_pending (GssPrefetch *prefetch, int max_pending);
+gboolean gss_prefetch_request (GssPrefetch *prefetch, const char *session_key,
+    int index, gsize next_size, GssPrefetchFunc func, gpointer data,
+    GDestroyNotify destroy);
+void gss_prefetch_get_stats (GssPrefetch *prefetch, GssPrefetchStats *stats);
+
+
+G_END_DECLS
+
+#endif
+
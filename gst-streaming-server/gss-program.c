@@ -39,13 +39,19 @@ enum
   PROP_ENABLED,
   PROP_STATE,
   PROP_UUID,
-  PROP_DESCRIPTION
+  PROP_DESCRIPTION,
+  PROP_HLS_WINDOW,
+  PROP_HLS_ENCRYPT,
+  PROP_HLS_KEY_ROTATION
 };
 
 #define DEFAULT_ENABLED FALSE
 #define DEFAULT_STATE GSS_PROGRAM_STATE_STOPPED
 #define DEFAULT_UUID "00000000-0000-0000-0000-000000000000"
 #define DEFAULT_DESCRIPTION ""
+#define DEFAULT_HLS_WINDOW 12
+#define DEFAULT_HLS_ENCRYPT FALSE
+#define DEFAULT_HLS_KEY_ROTATION 10
 
 
 static void gss_program_frag_resource (GssTransaction * transaction);
@@ -113,6 +119,9 @@ gss_program_init (GssProgram * program)
   program->uuid = gss_uuid_to_string (uuid);
   program->description = g_strdup (DEFAULT_DESCRIPTION);
   program->safe_description = gss_html_sanitize_entity (program->description);
+  program->hls.window = DEFAULT_HLS_WINDOW;
+  program->hls.is_encrypted = DEFAULT_HLS_ENCRYPT;
+  program->hls.key_rotation = DEFAULT_HLS_KEY_ROTATION;
 
   gss_object_set_title (GSS_OBJECT (program), program->uuid);
   gss_object_set_name (GSS_OBJECT (program), program->uuid);
@@ -141,6 +150,24 @@ gss_program_class_init (GssProgramClass * program_class)
       PROP_DESCRIPTION, g_param_spec_string ("description", "Description",
           "Description", DEFAULT_DESCRIPTION,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (program_class),
+      PROP_HLS_WINDOW, g_param_spec_int ("hls-window", "HLS Window",
+          "Number of segments listed in HLS media playlists.",
+          3, GSS_STREAM_HLS_CHUNKS - 2, DEFAULT_HLS_WINDOW,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (program_class),
+      PROP_HLS_ENCRYPT, g_param_spec_boolean ("hls-encrypt", "HLS Encrypt",
+          "Encrypt HLS segments with AES-128.  Keys are served over HTTPS "
+          "only, so this needs an HTTPS port and a server host name, "
+          "and segments are sent in the clear without them.",
+          DEFAULT_HLS_ENCRYPT,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (program_class),
+      PROP_HLS_KEY_ROTATION, g_param_spec_int ("hls-key-rotation",
+          "HLS Key Rotation",
+          "Number of HLS segments encrypted with each key (0 for no rotation).",
+          0, G_MAXINT, DEFAULT_HLS_KEY_ROTATION,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   program_class->add_resources = gss_program_add_resources;
 
@@ -159,6 +186,7 @@ gss_program_finalize (GObject * object)
   if (program->hls.variant_buffer) {
     soup_buffer_free (program->hls.variant_buffer);
   }
+  g_free (program->hls.variant_etag);
 
   gss_metrics_free (program->metrics);
   g_free (program->follow_uri);
@@ -189,6 +217,15 @@ gss_program_set_property (GObject * object, guint prop_id,
       program->safe_description =
           gss_html_sanitize_entity (program->description);
       break;
+    case PROP_HLS_WINDOW:
+      program->hls.window = g_value_get_int (value);
+      break;
+    case PROP_HLS_ENCRYPT:
+      program->hls.is_encrypted = g_value_get_boolean (value);
+      break;
+    case PROP_HLS_KEY_ROTATION:
+      program->hls.key_rotation = g_value_get_int (value);
+      break;
     default:
       g_assert_not_reached ();
       break;
@@ -216,6 +253,15 @@ gss_program_get_property (GObject * object, guint prop_id,
     case PROP_UUID:
       g_value_set_string (value, program->uuid);
       break;
+    case PROP_HLS_WINDOW:
+      g_value_set_int (value, program->hls.window);
+      break;
+    case PROP_HLS_ENCRYPT:
+      g_value_set_boolean (value, program->hls.is_encrypted);
+      break;
+    case PROP_HLS_KEY_ROTATION:
+      g_value_set_int (value, program->hls.key_rotation);
+      break;
     default:
       g_assert_not_reached ();
       break;
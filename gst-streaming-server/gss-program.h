@@ -89,12 +89,14 @@ struct _GssProgram {
   int n_hls_chunks;
   struct {
     SoupBuffer *variant_buffer; /* contents of current variant file */
+    guint variant_version;
+    char *variant_etag;
+    guint32 epoch; /* random, keeps variant ETags unique across restarts */
 
     int target_duration; /* max length of a chunk (in seconds) */
-    gboolean is_encrypted;
-    const char *key_uri;
-    gboolean have_iv;
-    guint32 init_vector[4];
+    int window; /* number of segments listed in a media playlist */
+    gboolean is_encrypted; /* encrypt new segments with AES-128 */
+    int key_rotation; /* segments per key, 0 to never rotate */
   } hls;
 };
 
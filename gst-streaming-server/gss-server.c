@@ -264,6 +264,8 @@ gss_server_init (GssServer * server)
 
   server->resources = g_hash_table_new_full (g_str_hash, g_str_equal,
       NULL, (GDestroyNotify) gss_resource_free);
+  server->prefix_resources = g_hash_table_new_full (g_str_hash, g_str_equal,
+      NULL, (GDestroyNotify) gss_resource_free);
 
   server->client_session = soup_session_async_new ();
 
@@ -313,7 +315,6 @@ static void
 gss_server_finalize (GObject * object)
 {
   GssServer *server = GSS_SERVER (object);
-  int i;
 
   g_list_free_full (server->programs, g_object_unref);
 
@@ -327,10 +328,7 @@ gss_server_finalize (GObject * object)
   g_list_free_full (server->modules, g_object_unref);
 
   g_hash_table_unref (server->resources);
-  for (i = 0; i < server->n_prefix_resources; i++) {
-    gss_resource_free (server->prefix_resources[i]);
-  }
-  g_free (server->prefix_resources);
+  g_hash_table_unref (server->prefix_resources);
   gss_metrics_free (server->metrics);
   g_free (server->base_url);
   g_free (server->base_url_https);
@@ -735,6 +733,8 @@ gss_server_add_resource (GssServer * server, const char *location,
       strcmp (content_type, "text/html") != 0, NULL);
   g_return_val_if_fail (content_type == NULL ||
       strcmp (content_type, "text/plain") != 0, NULL);
+  g_return_val_if_fail (!(flags & GSS_RESOURCE_PREFIX) ||
+      g_str_has_suffix (location, "/"), NULL);
 
   resource = g_new0 (GssResource, 1);
   resource->location = g_strdup (location);
@@ -746,10 +746,8 @@ gss_server_add_resource (GssServer * server, const char *location,
   resource->priv = priv;
 
   if (flags & GSS_RESOURCE_PREFIX) {
-    server->n_prefix_resources++;
-    server->prefix_resources = g_realloc (server->prefix_resources,
-        sizeof (GssResource *) * server->n_prefix_resources);
-    server->prefix_resources[server->n_prefix_resources - 1] = resource;
+    g_hash_table_replace (server->prefix_resources, resource->location,
+        resource);
   } else {
     g_hash_table_replace (server->resources, resource->location, resource);
   }
@@ -760,6 +758,9 @@ gss_server_add_resource (GssServer * server, const char *location,
 void
 gss_server_remove_resource (GssServer * server, const char *location)
 {
+  if (g_hash_table_remove (server->prefix_resources, location))
+    return;
+
   g_hash_table_remove (server->resources, location);
 }
 
@@ -1070,15 +1071,30 @@ gss_server_get_multifdsink_string (void)
       "sync-method=burst-keyframe " "burst-value=3000000000";
 }
 
+/* Prefix resources are directories, so only the directories of @path
+ * are looked up, shortest first.  The cost depends on the depth of
+ * @path, not on the number of resources. */
 static GssResource *
 gss_server_lookup_resource (GssServer * server, const char *path)
 {
-  int i;
+  GssResource *resource = NULL;
+  char *dir;
+  char *s;
+
+  if (g_hash_table_size (server->prefix_resources) > 0) {
+    dir = g_strdup (path);
+    for (s = strchr (dir, '/'); s && resource == NULL; s = strchr (s, '/')) {
+      char c;
 
-  for (i = 0; i < server->n_prefix_resources; i++) {
-    if (g_str_has_prefix (path, server->prefix_resources[i]->location)) {
-      return server->prefix_resources[i];
+      s++;
+      c = *s;
+      *s = 0;
+      resource = g_hash_table_lookup (server->prefix_resources, dir);
+      *s = c;
     }
+    g_free (dir);
+    if (resource)
+      return resource;
   }
 
   return g_hash_table_lookup (server->resources, path);
@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 
 
 GssSGList *
@@ -71,45 +72,228 @@ gss_sglist_get_size (GssSGList * sglist)
   return size;
 }
 
-gboolean
-gss_sglist_load (GssSGList * sglist, int fd, guint8 * dest, GError ** error)
+/* Reads exactly @size bytes into @iov, restarting after short reads.
+ * Modifies @iov. */
+static gboolean
+gss_sglist_preadv_full (int fd, struct iovec *iov, int n_iov, off_t offset,
+    gsize size, int *n_reads)
 {
-  int i;
-  off_t ret;
   ssize_t n;
-  off_t offset = 0;
 
-  for (i = 0; i < sglist->n_chunks; i++) {
-    GST_DEBUG ("chunk %d: %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
-        i, sglist->chunks[i].offset, sglist->chunks[i].size);
-    ret = lseek (fd, sglist->chunks[i].offset, SEEK_SET);
-    if (ret < 0) {
-      GST_WARNING ("failed to seek to %" G_GUINT64_FORMAT
-          " error=\"%s\"", sglist->chunks[i].offset, g_strerror (errno));
-      if (error) {
-        *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_SEEK,
-            "failed to seek on file");
-      }
+  while (size > 0) {
+    n = preadv (fd, iov, n_iov, offset);
+    if (n_reads)
+      (*n_reads)++;
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
       return FALSE;
+
+    size -= n;
+    offset += n;
+    while (n_iov > 0 && (gsize) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      n_iov--;
+    }
+    if (n > 0) {
+      iov->iov_base = (guint8 *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * gss_sglist_next_run:
+ * @sglist: a scatter-gather list
+ * @index: (inout): index of the next chunk, start with 0
+ * @dest: destination for the chunks, which are stored back to back
+ * @dest_offset: (inout): offset in @dest of the next chunk, start with 0
+ * @max_gap: largest hole between two chunks that is read and discarded
+ *   rather than starting a new read
+ * @gap: scratch buffer of at least @max_gap bytes, for holes
+ * @iov: array of at least two iovecs
+ * @max_iov: number of elements of @iov
+ * @offset: (out): file offset of the run
+ * @size: (out): total size of the run, including holes
+ *
+ * Collects the next run of chunks that are adjacent in the file, or
+ * separated by at most @max_gap bytes, into @iov, so that it can be
+ * read with a single preadv() or equivalent.
+ *
+ * Returns: the number of iovecs used, or 0 when there are no more
+ *   chunks
+ */
+int
+gss_sglist_next_run (GssSGList * sglist, int *index, guint8 * dest,
+    gsize * dest_offset, gsize max_gap, guint8 * gap, struct iovec *iov,
+    int max_iov, off_t * offset, gsize * size)
+{
+  off_t run_end = 0;
+  gboolean extend = FALSE;
+  int n_iov = 0;
+  int i;
+
+  *offset = 0;
+  *size = 0;
+
+  /* A hole takes an iovec too, so always leave room for two. */
+  for (i = *index; i < sglist->n_chunks && n_iov < max_iov - 1; i++) {
+    GssSGChunk *chunk = &sglist->chunks[i];
+
+    if (chunk->size == 0)
+      continue;
+
+    if (n_iov == 0) {
+      *offset = chunk->offset;
+      run_end = chunk->offset;
+    } else if ((off_t) chunk->offset < run_end ||
+        chunk->offset - run_end > max_gap) {
+      break;
+    } else if ((off_t) chunk->offset > run_end) {
+      iov[n_iov].iov_base = gap;
+      iov[n_iov].iov_len = chunk->offset - run_end;
+      *size += iov[n_iov].iov_len;
+      n_iov++;
+      extend = FALSE;
+    }
+
+    if (extend) {
+      iov[n_iov - 1].iov_len += chunk->size;
+    } else {
+      iov[n_iov].iov_base = dest + *dest_offset;
+      iov[n_iov].iov_len = chunk->size;
+      n_iov++;
+      extend = TRUE;
     }
+    *size += chunk->size;
+    run_end = chunk->offset + chunk->size;
+    *dest_offset += chunk->size;
+  }
+  *index = i;
+
+  return n_iov;
+}
+
+/**
+ * gss_sglist_load_full:
+ * @sglist: a scatter-gather list
+ * @fd: file to read from
+ * @dest: destination for the chunks, which are stored back to back
+ * @max_gap: largest hole between two chunks that is read and discarded
+ *   rather than starting a new read
+ * @n_reads: (out) (allow-none): incremented by the number of read
+ *   system calls made
+ * @error: return location for a #GError, or NULL
+ *
+ * Loads the chunks of @sglist into @dest, using one preadv() per run
+ * of chunks that are adjacent in the file or separated by at most
+ * @max_gap bytes.  The file offset of @fd is not used, so @fd may be
+ * shared between threads.
+ *
+ * Returns: TRUE on success
+ */
+gboolean
+gss_sglist_load_full (GssSGList * sglist, int fd, guint8 * dest,
+    gsize max_gap, int *n_reads, GError ** error)
+{
+  struct iovec iov[GSS_SGLIST_MAX_IOV];
+  guint8 *gap;
+  gsize dest_offset = 0;
+  int i = 0;
+
+  g_return_val_if_fail (sglist != NULL, FALSE);
 
-    n = read (fd, dest + offset, sglist->chunks[i].size);
-    if (n < sglist->chunks[i].size) {
-      GST_WARNING ("failed to read %" G_GUINT64_FORMAT " bytes at %"
-          G_GUINT64_FORMAT " error=\"%s\"",
-          sglist->chunks[i].size, sglist->chunks[i].offset, g_strerror (errno));
+  gap = max_gap ? g_malloc (max_gap) : NULL;
+
+  while (TRUE) {
+    off_t run_offset;
+    gsize run_size;
+    int n_iov;
+
+    n_iov = gss_sglist_next_run (sglist, &i, dest, &dest_offset, max_gap,
+        gap, iov, GSS_SGLIST_MAX_IOV, &run_offset, &run_size);
+    if (n_iov == 0)
+      break;
+
+    GST_DEBUG ("reading %" G_GSIZE_FORMAT " bytes at %" G_GUINT64_FORMAT
+        " in %d pieces", run_size, (guint64) run_offset, n_iov);
+    if (!gss_sglist_preadv_full (fd, iov, n_iov, run_offset, run_size,
+            n_reads)) {
+      GST_WARNING ("failed to read %" G_GSIZE_FORMAT " bytes at %"
+          G_GUINT64_FORMAT " error=\"%s\"", run_size, (guint64) run_offset,
+          g_strerror (errno));
       if (error) {
         *error = g_error_new (_gss_error_quark, GSS_ERROR_FILE_READ,
             "failed to read from file");
       }
+      g_free (gap);
       return FALSE;
     }
-    offset += sglist->chunks[i].size;
   }
 
+  g_free (gap);
+
   return TRUE;
 }
 
+gboolean
+gss_sglist_load (GssSGList * sglist, int fd, guint8 * dest, GError ** error)
+{
+  return gss_sglist_load_full (sglist, fd, dest, GSS_SGLIST_DEFAULT_MAX_GAP,
+      NULL, error);
+}
+
+/**
+ * gss_sglist_new_slice:
+ * @sglist: a scatter-gather list
+ * @start: offset in the data described by @sglist
+ * @size: number of bytes, must be greater than 0
+ *
+ * Returns: a new list describing the bytes [@start, @start + @size) of
+ *   the data described by @sglist
+ */
+GssSGList *
+gss_sglist_new_slice (GssSGList * sglist, gsize start, gsize size)
+{
+  GssSGList *slice;
+  gsize pos;
+  int n_chunks;
+  int i;
+
+  g_return_val_if_fail (sglist != NULL, NULL);
+  g_return_val_if_fail (size > 0, NULL);
+  g_return_val_if_fail (start + size <= gss_sglist_get_size (sglist), NULL);
+
+  n_chunks = 0;
+  pos = 0;
+  for (i = 0; i < sglist->n_chunks; i++) {
+    /* same test as below, so that empty chunks are not counted */
+    if (MAX (start, pos) < MIN (start + size, pos + sglist->chunks[i].size))
+      n_chunks++;
+    pos += sglist->chunks[i].size;
+  }
+
+  slice = gss_sglist_new (n_chunks);
+  n_chunks = 0;
+  pos = 0;
+  for (i = 0; i < sglist->n_chunks; i++) {
+    gsize s = MAX (start, pos);
+    gsize e = MIN (start + size, pos + sglist->chunks[i].size);
+
+    if (s < e) {
+      slice->chunks[n_chunks].offset = sglist->chunks[i].offset + (s - pos);
+      slice->chunks[n_chunks].size = e - s;
+      n_chunks++;
+    }
+    pos += sglist->chunks[i].size;
+  }
+
+  return slice;
+}
+
 void
 gss_sglist_merge (GssSGList * sglist)
 {
@@ -124,3 +308,50 @@ gss_sglist_merge (GssSGList * sglist)
     }
   }
 }
+
+/**
+ * gss_sglist_compact:
+ * @sglist: a scatter-gather list
+ *
+ * Like gss_sglist_merge(), but also removes the chunks left empty, so
+ * that @sglist describes the same data with as few chunks as possible.
+ * Samples of a file are mostly stored back to back, so a fragment's
+ * list usually shrinks to a chunk or two.
+ */
+void
+gss_sglist_compact (GssSGList * sglist)
+{
+  int n_chunks;
+  int i;
+
+  g_return_if_fail (sglist != NULL);
+
+  n_chunks = 0;
+  for (i = 0; i < sglist->n_chunks; i++) {
+    GssSGChunk *chunk = &sglist->chunks[i];
+
+    if (chunk->size == 0)
+      continue;
+    if (n_chunks > 0 && chunk->offset ==
+        sglist->chunks[n_chunks - 1].offset +
+        sglist->chunks[n_chunks - 1].size) {
+      sglist->chunks[n_chunks - 1].size += chunk->size;
+    } else {
+      sglist->chunks[n_chunks] = *chunk;
+      n_chunks++;
+    }
+  }
+
+  /* a list always has at least one chunk */
+  if (n_chunks == 0) {
+    sglist->chunks[0].offset = 0;
+    sglist->chunks[0].size = 0;
+    n_chunks = 1;
+  }
+
+  if (n_chunks < sglist->n_chunks) {
+    sglist->n_chunks = n_chunks;
+    sglist->chunks = g_realloc (sglist->chunks,
+        sizeof (GssSGChunk) * n_chunks);
+  }
+}
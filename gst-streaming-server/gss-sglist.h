@@ -24,8 +24,22 @@
 #include "gss-isom-boxes.h"
 #include "gss-server.h"
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+
 G_BEGIN_DECLS
 
+/* Holes of up to this many bytes between chunks are read and thrown
+ * away, which is cheaper than another system call. */
+#define GSS_SGLIST_DEFAULT_MAX_GAP 16384
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define GSS_SGLIST_MAX_IOV IOV_MAX
+#else
+#define GSS_SGLIST_MAX_IOV 1024
+#endif
+
 typedef struct _GssSGList GssSGList;
 typedef struct _GssSGChunk GssSGChunk;
 
@@ -41,11 +55,18 @@ struct _GssSGList {
 
 
 GssSGList *gss_sglist_new (int n_chunks);
+GssSGList *gss_sglist_new_slice (GssSGList *sglist, gsize start, gsize size);
 void gss_sglist_free (GssSGList *sglist);
 gsize gss_sglist_get_size (GssSGList *sglist);
 gboolean gss_sglist_load (GssSGList *sglist, int fd, guint8 *dest,
     GError **error);
+gboolean gss_sglist_load_full (GssSGList *sglist, int fd, guint8 *dest,
+    gsize max_gap, int *n_reads, GError **error);
+int gss_sglist_next_run (GssSGList *sglist, int *index, guint8 *dest,
+    gsize *dest_offset, gsize max_gap, guint8 *gap, struct iovec *iov,
+    int max_iov, off_t *offset, gsize *size);
 void gss_sglist_merge (GssSGList *sglist);
+void gss_sglist_compact (GssSGList *sglist);
 
 
 G_END_DECLS
@@ -115,3 +115,68 @@ gss_soup_dump_request_headers (SoupMessage * msg)
     GST_ERROR ("%s: %s", name, value);
   }
 }
+
+/* Sets the ETag response header and checks it against If-None-Match.
+ * Returns TRUE (and sets a 304 status) if the client's copy is current,
+ * in which case the caller should not append a body. */
+gboolean
+gss_soup_message_check_etag (SoupMessage * msg, const char *etag)
+{
+  const char *inm;
+  GSList *list;
+  GSList *g;
+  gboolean match = FALSE;
+
+  soup_message_headers_replace (msg->response_headers, "ETag", etag);
+
+  inm = soup_message_headers_get_one (msg->request_headers, "If-None-Match");
+  if (inm == NULL)
+    return FALSE;
+
+  list = soup_header_parse_list (inm);
+  for (g = list; g; g = g_slist_next (g)) {
+    const char *tag = g->data;
+
+    /* If-None-Match uses the weak comparison function */
+    if (strncmp (tag, "W/", 2) == 0)
+      tag += 2;
+    if (strcmp (tag, "*") == 0 || strcmp (tag, etag) == 0) {
+      match = TRUE;
+      break;
+    }
+  }
+  soup_header_free_list (list);
+
+  if (match) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_MODIFIED);
+  }
+  return match;
+}
+
+/* Returns TRUE if the request's Accept-Encoding allows @encoding. */
+gboolean
+gss_soup_message_accepts_encoding (SoupMessage * msg, const char *encoding)
+{
+  const char *accept;
+  GSList *list;
+  GSList *g;
+  gboolean ret = FALSE;
+
+  accept = soup_message_headers_get_list (msg->request_headers,
+      "Accept-Encoding");
+  if (accept == NULL)
+    return FALSE;
+
+  /* only lists encodings with a non-zero quality */
+  list = soup_header_parse_quality_list (accept, NULL);
+  for (g = list; g; g = g_slist_next (g)) {
+    if (g_ascii_strcasecmp (g->data, encoding) == 0 ||
+        strcmp (g->data, "*") == 0) {
+      ret = TRUE;
+      break;
+    }
+  }
+  soup_header_free_list (list);
+
+  return ret;
+}
@@ -33,6 +33,8 @@ char * gss_soup_get_base_url_https (GssServer * server, SoupMessage * msg);
 char * gss_transaction_get_base_url (GssTransaction *t);
 gboolean gss_transaction_is_secure (GssTransaction *t);
 void gss_soup_dump_request_headers (SoupMessage *msg);
+gboolean gss_soup_message_check_etag (SoupMessage *msg, const char *etag);
+gboolean gss_soup_message_accepts_encoding (SoupMessage *msg, const char *encoding);
 
 
 G_END_DECLS
@@ -46,6 +46,7 @@ enum
 
 
 static void msg_wrote_headers (SoupMessage * msg, void *user_data);
+static void gss_stream_remove_file_resources (GssStream * stream);
 
 
 static void gss_stream_finalize (GObject * object);
@@ -139,13 +140,17 @@ gss_stream_finalize (GObject * object)
 
     if (segment->buffer) {
       soup_buffer_free (segment->buffer);
-      g_free (segment->location);
     }
   }
 
   if (stream->hls.index_buffer) {
     soup_buffer_free (stream->hls.index_buffer);
   }
+  if (stream->hls.delta_buffer) {
+    soup_buffer_free (stream->hls.delta_buffer);
+  }
+  g_free (stream->hls.index_etag);
+  g_free (stream->hls.delta_etag);
 #define CLEANUP(x) do { \
   if (x) { \
     if (GST_OBJECT_REFCOUNT (x) != 1) \
@@ -509,7 +514,7 @@ gss_stream_add_resources (GssStream * stream)
   }
 #endif
 
-  gss_stream_remove_resources (stream);
+  gss_stream_remove_file_resources (stream);
 
   g_free (stream->location);
   stream->location = g_strdup_printf ("/%s/streams/stream%d-%dx%d-%dkbps%s.%s",
@@ -541,8 +546,8 @@ gss_stream_add_resources (GssStream * stream)
   return;
 }
 
-void
-gss_stream_remove_resources (GssStream * stream)
+static void
+gss_stream_remove_file_resources (GssStream * stream)
 {
   if (stream->resource)
     gss_server_remove_resource (GSS_OBJECT_SERVER (stream->program),
@@ -552,6 +557,30 @@ gss_stream_remove_resources (GssStream * stream)
         stream->playlist_resource->location);
 }
 
+/* Must be called while stream->program is set; the HLS resources
+ * are added by gss_stream_add_hls() when the sink is set. */
+void
+gss_stream_remove_resources (GssStream * stream)
+{
+  gss_stream_remove_file_resources (stream);
+
+  if (stream->hls.index_resource) {
+    gss_server_remove_resource (GSS_OBJECT_SERVER (stream->program),
+        stream->hls.index_resource->location);
+    stream->hls.index_resource = NULL;
+  }
+  if (stream->hls.segment_resource) {
+    gss_server_remove_resource (GSS_OBJECT_SERVER (stream->program),
+        stream->hls.segment_resource->location);
+    stream->hls.segment_resource = NULL;
+  }
+  if (stream->hls.key_resource) {
+    gss_server_remove_resource (GSS_OBJECT_SERVER (stream->program),
+        stream->hls.key_resource->location);
+    stream->hls.key_resource = NULL;
+  }
+}
+
 void
 gss_stream_set_sink (GssStream * stream, GstElement * sink)
 {
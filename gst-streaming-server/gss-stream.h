@@ -29,6 +29,7 @@
 #include "gss-types.h"
 #include "gss-object.h"
 #include "gss-session.h"
+#include "gss-mpegts.h"
 
 G_BEGIN_DECLS
 
@@ -59,8 +60,11 @@ typedef enum {
 struct _GssHLSSegment {
   int index;
   SoupBuffer *buffer;
-  char *location;
-  int duration;
+  double duration; /* in seconds */
+
+  gboolean is_encrypted;
+  int key_index;
+  guint8 key[16];
 };
 
 struct _GssStream {
@@ -94,8 +98,26 @@ struct _GssStream {
   int n_chunks;
   GssHLSSegment chunks[GSS_STREAM_HLS_CHUNKS];
   struct {
+    GssResource *index_resource;
+    GssResource *segment_resource; /* prefix, serves "<epoch>-%05d.ts" */
+    GssResource *key_resource; /* prefix, https only, serves "%d.key" */
+
     gboolean need_index_update;
     SoupBuffer *index_buffer; /* contents of current index file */
+    SoupBuffer *delta_buffer; /* same, with old segments replaced by EXT-X-SKIP */
+    guint32 epoch; /* random, new for every stream that is created */
+    guint index_version; /* bumped every time the index is regenerated */
+    char *index_etag;
+    char *delta_etag;
+
+    /* streaming thread only */
+    GssMpegtsScanner scanner;
+    gboolean have_segment_start;
+    guint64 segment_start_pcr;
+    int n_published;
+    int key_index; /* -1 if no key has been generated */
+    guint8 key[16];
+    gboolean warned_no_https;
 
     gboolean at_eos; /* true if sliding window is at the end of the stream */
   } hls;
@@ -148,6 +170,8 @@ void gss_stream_remove_resources (GssStream *stream);
 void gss_stream_add_resources (GssStream *stream);
 
 void gss_stream_handle_m3u8 (GssTransaction * t);
+gsize gss_hls_encrypt_segment (guint8 *data, gsize size, const guint8 *key,
+    guint64 sequence);
 
 void gss_stream_add_fd (GssStream *stream, int fd,
     void (*callback) (GssStream *stream, int fd, void *priv), void *priv);
@@ -0,0 +1,440 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * io_uring engine for reading fragments from the main loop.
+ *
+ * The runs of a scatter-gather list (see gss_sglist_next_run()) are
+ * queued as readv SQEs, and submission is deferred to an idle callback
+ * so that all fragment requests that arrive in one main loop iteration
+ * share a single io_uring_submit().  Completions are signalled on an
+ * eventfd that is watched by the main loop, so no thread blocks while
+ * the reads are in flight, and callbacks run in the main thread.
+ *
+ * The reads of one fragment go to disjoint parts of the destination,
+ * so they are submitted unlinked and may complete in any order.
+ * Destination buffers are allocated per request, so they are not
+ * registered with the ring.
+ *
+ * If the submission itself fails, the reads that were not submitted
+ * are failed through their callbacks, and callers fall back to the
+ * preadv() path.  Their SQEs are already in the submission queue, so
+ * they are turned into NOPs that are reaped with the next submission.
+ *
+ * Without liburing, or on kernels without io_uring, gss_uring_new()
+ * returns NULL and callers use the preadv() path in worker threads.
+ */
+
+#include "config.h"
+
+#include "gss-uring.h"
+
+#include <gst/gst.h>
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+typedef struct _GssUringRequest GssUringRequest;
+typedef struct _GssUringRead GssUringRead;
+
+struct _GssUring
+{
+  struct io_uring ring;
+  int queue_depth;
+  int event_fd;
+  GIOChannel *channel;
+  guint watch_id;
+  guint submit_id;
+  int n_queued;                 /* reads queued or in flight */
+  GQueue unsubmitted;           /* reads with an SQE not yet submitted */
+  int n_stale;                  /* NOP SQEs left by failed submissions */
+  gboolean closing;             /* free when the last read completes */
+};
+
+struct _GssUringRequest
+{
+  GssUringCallback callback;
+  gpointer user_data;
+  guint8 *gap;
+  int fd;
+  int n_pending;
+  gboolean failed;
+};
+
+struct _GssUringRead
+{
+  GssUringRequest *request;
+  struct io_uring_sqe *sqe;
+  off_t offset;
+  gsize remaining;
+  int n_iov;
+  struct iovec *iov;
+  struct iovec iov_storage[1];
+};
+
+static gboolean gss_uring_submit (gpointer priv);
+static void gss_uring_destroy (GssUring * uring);
+static void gss_uring_read_done (GssUring * uring, GssUringRead * read);
+
+static void
+gss_uring_schedule_submit (GssUring * uring)
+{
+  if (uring->submit_id == 0) {
+    uring->submit_id = g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+        gss_uring_submit, uring, NULL);
+  }
+}
+
+static gboolean
+gss_uring_submit (gpointer priv)
+{
+  GssUring *uring = priv;
+  GssUringRead *read;
+  int ret;
+
+  uring->submit_id = 0;
+
+  ret = io_uring_submit (&uring->ring);
+  if (ret == -EINTR) {
+    gss_uring_schedule_submit (uring);
+    return FALSE;
+  }
+  if (ret >= 0) {
+    /* the kernel consumes SQEs in order, so the reads that were not
+     * submitted are the last ones in the queue */
+    while (g_queue_get_length (&uring->unsubmitted) >
+        io_uring_sq_ready (&uring->ring)) {
+      g_queue_pop_head (&uring->unsubmitted);
+    }
+    if (!g_queue_is_empty (&uring->unsubmitted))
+      gss_uring_schedule_submit (uring);
+    return FALSE;
+  }
+
+  GST_ERROR ("io_uring_submit failed: %s, failing %u reads",
+      g_strerror (-ret), g_queue_get_length (&uring->unsubmitted));
+
+  while ((read = g_queue_pop_head (&uring->unsubmitted))) {
+    io_uring_prep_nop (read->sqe);
+    io_uring_sqe_set_data (read->sqe, NULL);
+    uring->n_stale++;
+
+    read->request->failed = TRUE;
+    gss_uring_read_done (uring, read);
+  }
+
+  if (uring->closing && uring->n_queued == 0)
+    gss_uring_destroy (uring);
+
+  return FALSE;
+}
+
+static void
+gss_uring_queue_read (GssUring * uring, GssUringRead * read)
+{
+  struct io_uring_sqe *sqe;
+
+  /* n_queued + n_stale never exceeds the queue depth, so there is
+   * always room */
+  sqe = io_uring_get_sqe (&uring->ring);
+  g_assert (sqe != NULL);
+
+  io_uring_prep_readv (sqe, read->request->fd, read->iov, read->n_iov,
+      read->offset);
+  io_uring_sqe_set_data (sqe, read);
+  read->sqe = sqe;
+  g_queue_push_tail (&uring->unsubmitted, read);
+
+  gss_uring_schedule_submit (uring);
+}
+
+static void
+gss_uring_read_done (GssUring * uring, GssUringRead * read)
+{
+  GssUringRequest *request = read->request;
+
+  uring->n_queued--;
+  g_free (read);
+
+  request->n_pending--;
+  if (request->n_pending == 0) {
+    request->callback (!request->failed, request->user_data);
+    g_free (request->gap);
+    g_free (request);
+  }
+}
+
+static void
+gss_uring_complete_read (GssUring * uring, GssUringRead * read, int res)
+{
+  GssUringRequest *request = read->request;
+
+  if (res == -EINTR || res == -EAGAIN) {
+    gss_uring_queue_read (uring, read);
+    return;
+  }
+  if (res <= 0) {
+    GST_WARNING ("failed to read %" G_GSIZE_FORMAT " bytes at %"
+        G_GUINT64_FORMAT " error=\"%s\"", read->remaining,
+        (guint64) read->offset, res < 0 ? g_strerror (-res) : "end of file");
+    request->failed = TRUE;
+  } else if ((gsize) res < read->remaining) {
+    /* short read, queue the rest */
+    read->offset += res;
+    read->remaining -= res;
+    while ((gsize) res >= read->iov->iov_len) {
+      res -= read->iov->iov_len;
+      read->iov++;
+      read->n_iov--;
+    }
+    read->iov->iov_base = (guint8 *) read->iov->iov_base + res;
+    read->iov->iov_len -= res;
+    gss_uring_queue_read (uring, read);
+    return;
+  }
+
+  gss_uring_read_done (uring, read);
+}
+
+static gboolean
+gss_uring_dispatch (GIOChannel * channel, GIOCondition condition,
+    gpointer priv)
+{
+  GssUring *uring = priv;
+  struct io_uring_cqe *cqe;
+  eventfd_t value;
+
+  eventfd_read (uring->event_fd, &value);
+
+  while (io_uring_peek_cqe (&uring->ring, &cqe) == 0) {
+    GssUringRead *read = io_uring_cqe_get_data (cqe);
+    int res = cqe->res;
+
+    io_uring_cqe_seen (&uring->ring, cqe);
+    if (read == NULL) {
+      /* NOP left by a failed submission */
+      uring->n_stale--;
+      continue;
+    }
+    gss_uring_complete_read (uring, read, res);
+  }
+
+  if (uring->closing && uring->n_queued == 0) {
+    /* returning FALSE removes the watch */
+    uring->watch_id = 0;
+    gss_uring_destroy (uring);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * gss_uring_new:
+ * @queue_depth: maximum number of reads in flight
+ *
+ * Returns: a new io_uring engine, or NULL if io_uring is not available
+ */
+GssUring *
+gss_uring_new (int queue_depth)
+{
+  GssUring *uring;
+  int ret;
+
+  g_return_val_if_fail (queue_depth > 0, NULL);
+
+  uring = g_new0 (GssUring, 1);
+  uring->queue_depth = queue_depth;
+  g_queue_init (&uring->unsubmitted);
+
+  ret = io_uring_queue_init (queue_depth, &uring->ring, 0);
+  if (ret < 0) {
+    GST_INFO ("io_uring not available (%s), using worker threads",
+        g_strerror (-ret));
+    g_free (uring);
+    return NULL;
+  }
+
+  uring->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (uring->event_fd < 0 ||
+      io_uring_register_eventfd (&uring->ring, uring->event_fd) < 0) {
+    GST_INFO ("cannot get io_uring completion events, using worker threads");
+    if (uring->event_fd >= 0)
+      close (uring->event_fd);
+    io_uring_queue_exit (&uring->ring);
+    g_free (uring);
+    return NULL;
+  }
+
+  uring->channel = g_io_channel_unix_new (uring->event_fd);
+  uring->watch_id = g_io_add_watch (uring->channel, G_IO_IN,
+      gss_uring_dispatch, uring);
+
+  return uring;
+}
+
+static void
+gss_uring_destroy (GssUring * uring)
+{
+  if (uring->submit_id)
+    g_source_remove (uring->submit_id);
+  if (uring->watch_id)
+    g_source_remove (uring->watch_id);
+  g_io_channel_unref (uring->channel);
+  io_uring_queue_exit (&uring->ring);
+  close (uring->event_fd);
+  g_free (uring);
+}
+
+/**
+ * gss_uring_free:
+ * @uring: an io_uring engine
+ *
+ * Frees @uring.  If reads are in flight, no more reads are accepted and
+ * @uring is freed from the main loop after the last one has completed
+ * and its callback has been called.
+ */
+void
+gss_uring_free (GssUring * uring)
+{
+  g_return_if_fail (uring != NULL);
+
+  if (uring->n_queued > 0) {
+    GST_DEBUG ("freeing io_uring after %d reads in flight", uring->n_queued);
+    uring->closing = TRUE;
+    return;
+  }
+
+  gss_uring_destroy (uring);
+}
+
+/**
+ * gss_uring_read_sglist:
+ * @uring: an io_uring engine
+ * @sglist: chunks to read
+ * @fd: file to read from, kept open until @callback is called
+ * @dest: destination for the chunks, which are stored back to back
+ * @callback: called in the main thread when all reads have completed
+ * @user_data: data for @callback
+ *
+ * Queues the reads for @sglist.  Must be called from the main thread.
+ * If the ring is too busy to take all the reads, nothing is queued and
+ * FALSE is returned, and the caller should read the data some other
+ * way.
+ *
+ * Returns: TRUE if the reads were queued
+ */
+gboolean
+gss_uring_read_sglist (GssUring * uring, GssSGList * sglist, int fd,
+    guint8 * dest, GssUringCallback callback, gpointer user_data)
+{
+  struct iovec iov[GSS_SGLIST_MAX_IOV];
+  GssUringRequest *request;
+  GPtrArray *reads;
+  gsize dest_offset = 0;
+  int index = 0;
+  guint i;
+
+  g_return_val_if_fail (uring != NULL, FALSE);
+  g_return_val_if_fail (sglist != NULL, FALSE);
+  g_return_val_if_fail (callback != NULL, FALSE);
+
+  if (uring->closing)
+    return FALSE;
+
+  request = g_new0 (GssUringRequest, 1);
+  request->callback = callback;
+  request->user_data = user_data;
+  request->gap = g_malloc (GSS_SGLIST_DEFAULT_MAX_GAP);
+  request->fd = fd;
+
+  reads = g_ptr_array_new ();
+  while (TRUE) {
+    GssUringRead *read;
+    off_t offset;
+    gsize size;
+    int n_iov;
+
+    n_iov = gss_sglist_next_run (sglist, &index, dest, &dest_offset,
+        GSS_SGLIST_DEFAULT_MAX_GAP, request->gap, iov, GSS_SGLIST_MAX_IOV,
+        &offset, &size);
+    if (n_iov == 0)
+      break;
+
+    read = g_malloc (sizeof (GssUringRead) +
+        (n_iov - 1) * sizeof (struct iovec));
+    read->request = request;
+    read->offset = offset;
+    read->remaining = size;
+    read->n_iov = n_iov;
+    read->iov = read->iov_storage;
+    memcpy (read->iov, iov, n_iov * sizeof (struct iovec));
+    g_ptr_array_add (reads, read);
+  }
+
+  if (reads->len == 0 || uring->n_queued + uring->n_stale +
+      (int) reads->len > uring->queue_depth) {
+    if (uring->n_stale > 0) {
+      /* reap the NOPs so their slots can be reused */
+      gss_uring_schedule_submit (uring);
+    }
+    g_ptr_array_foreach (reads, (GFunc) g_free, NULL);
+    g_ptr_array_free (reads, TRUE);
+    g_free (request->gap);
+    g_free (request);
+    return FALSE;
+  }
+
+  request->n_pending = reads->len;
+  uring->n_queued += reads->len;
+  for (i = 0; i < reads->len; i++) {
+    gss_uring_queue_read (uring, g_ptr_array_index (reads, i));
+  }
+  g_ptr_array_free (reads, TRUE);
+
+  return TRUE;
+}
+
+#else
+
+GssUring *
+gss_uring_new (int queue_depth)
+{
+  return NULL;
+}
+
+void
+gss_uring_free (GssUring * uring)
+{
+}
+
+gboolean
+gss_uring_read_sglist (GssUring * uring, GssSGList * sglist, int fd,
+    guint8 * dest, GssUringCallback callback, gpointer user_data)
+{
+  return FALSE;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/* GStreamer Streaming Server
+ * Copyright (C) 2009-2012 Entropy Wave Inc <info@entropywave.com>
+ * Copyright (C) 2009-2012 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GSS_URING_H
+#define _GSS_URING_H
+
+#include <glib.h>
+#include "gss-sglist.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GssUring GssUring;
+
+typedef void (*GssUringCallback) (gboolean success, gpointer user_data);
+
+
+GssUring *gss_uring_new (int queue_depth);
+void gss_uring_free (GssUring *uring);
+gboolean gss_uring_read_sglist (GssUring *uring, GssSGList *sglist, int fd,
+    guint8 *dest, GssUringCallback callback, gpointer user_data);
+
+
+G_END_DECLS
+
+#endif
+
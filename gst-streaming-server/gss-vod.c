@@ -34,13 +34,91 @@ enum
   PROP_ENDPOINT,
   PROP_ARCHIVE_DIR,
   PROP_DIR_LEVELS,
-  PROP_CACHE_SIZE
+  PROP_CACHE_SIZE,
+  PROP_CACHE_MEMORY,
+  PROP_FRAGMENT_CACHE_SIZE,
+  PROP_IO_URING,
+  PROP_MMAP,
+  PROP_PREWARM,
+  PROP_PREWARM_LIST,
+  PROP_PREWARM_STREAM,
+  PROP_PREWARM_RATE,
+  PROP_PREFETCH,
+  PROP_PRE_ENCRYPT
 };
 
 #define DEFAULT_ENDPOINT "vod"
 #define DEFAULT_ARCHIVE_DIR "vod"
 #define DEFAULT_DIR_LEVELS 0
 #define DEFAULT_CACHE_SIZE 100
+#define DEFAULT_CACHE_MEMORY 0
+#define DEFAULT_FRAGMENT_CACHE_SIZE 256
+#define DEFAULT_IO_URING FALSE
+#define DEFAULT_MMAP FALSE
+#define DEFAULT_PREWARM 0
+#define DEFAULT_PREWARM_LIST ""
+#define DEFAULT_PREWARM_STREAM "0/clear/isoff-ondemand"
+#define DEFAULT_PREWARM_RATE 0
+#define DEFAULT_PREFETCH 0
+#define DEFAULT_PRE_ENCRYPT FALSE
+#define GSS_VOD_MAX_OPEN_FILES 256
+#define GSS_VOD_URING_QUEUE_DEPTH 256
+#define GSS_VOD_LOAD_THREADS 2
+#define GSS_VOD_PREFETCH_MAX_SIZE (64 << 20)
+
+typedef struct _GssVodCacheEntry GssVodCacheEntry;
+struct _GssVodCacheEntry
+{
+  char *key;
+  GssAdaptive *adaptive;
+  gsize size;
+  gsize manifests_size; /* part of size, see gss_vod_cache_update_size() */
+  gint64 load_time; /* in microseconds */
+  GList *link; /* in vod->cache_lru */
+};
+
+/* A stream being loaded in vod->load_pool.  Requests for the stream
+ * that arrive in the meantime are paused and queued in @waiters. */
+typedef struct _GssVodLoad GssVodLoad;
+struct _GssVodLoad
+{
+  GssVod *vod;
+  char *hash_key;
+  char *key;
+  char *version;
+  char *dir;
+  GssDrmType drm_type;
+  GssAdaptiveStream stream_type;
+
+  GList *waiters;
+  gboolean prewarm;
+  gboolean pre_encrypt;
+
+  /* set by the loading thread */
+  GssAdaptive *adaptive;
+  gint64 load_time;
+  gboolean write_pre_encrypted;
+};
+
+/* A pre-encrypted copy of a DRM stream being written in
+ * vod->pre_encrypt_pool */
+typedef struct _GssVodPreEncrypt GssVodPreEncrypt;
+struct _GssVodPreEncrypt
+{
+  GssVod *vod;
+  char *hash_key;
+  GssAdaptive *adaptive;
+
+  /* set by the writing thread */
+  gboolean written;
+};
+
+typedef struct _GssVodLoadWaiter GssVodLoadWaiter;
+struct _GssVodLoadWaiter
+{
+  GssTransaction *t;
+  char *subpath;
+};
 
 static void gss_vod_finalize (GObject * object);
 static void gss_vod_set_property (GObject * object, guint prop_id,
@@ -49,11 +127,28 @@ static void gss_vod_get_property (GObject * object, guint prop_id,
     GValue * value, GParamSpec * pspec);
 static void gss_vod_get_resource (GssTransaction * t);
 static void gss_vod_post_resource (GssTransaction * t);
-static GssAdaptive *gss_vod_get_adaptive (GssVod * vod, const char *key,
-    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type);
+static GssAdaptive *gss_vod_cache_lookup (GssVod * vod,
+    const char *hash_key);
+static void gss_vod_cache_update_size (GssVod * vod, const char *hash_key);
+static void gss_vod_load_adaptive (GssVod * vod, GssTransaction * t,
+    const char *hash_key, const char *key, const char *version,
+    GssDrmType drm_type, GssAdaptiveStream stream_type, const char *subpath);
+static void gss_vod_load_thread (GssVodLoad * load, gpointer unused);
+static gboolean gss_vod_load_done (GssVodLoad * load);
+static GssVodLoad *gss_vod_start_load (GssVod * vod, const char *hash_key,
+    const char *key, const char *version, GssDrmType drm_type,
+    GssAdaptiveStream stream_type);
+static void gss_vod_pre_encrypt_thread (GssVodPreEncrypt * job,
+    gpointer unused);
+static void gss_vod_prewarm_continue (GssVod * vod);
+static void gss_vod_prewarm_load_done (GssVod * vod, gsize size);
+static gboolean gss_vod_prewarm_start (GssVod * vod);
+static void gss_vod_ready_get_resource (GssTransaction * t);
 static void gss_vod_get_adaptive_resource (GssTransaction * t);
 static void gss_vod_attach (GssObject * object, GssServer * server);
 static void gss_vod_player_get_resource (GssTransaction * t);
+static void gss_vod_cache_entry_free (GssVodCacheEntry * entry);
+static void gss_vod_cache_trim (GssVod * vod);
 
 G_DEFINE_TYPE (GssVod, gss_vod, GSS_TYPE_MODULE);
 
@@ -62,8 +157,24 @@ static GObjectClass *parent_class;
 static void
 gss_vod_init (GssVod * vod)
 {
-  vod->cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
-      (GDestroyNotify) gss_adaptive_free);
+  vod->cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+      (GDestroyNotify) gss_vod_cache_entry_free);
+  vod->cache_lru = g_queue_new ();
+  vod->fragment_cache =
+      gss_fragment_cache_new ((gsize) DEFAULT_FRAGMENT_CACHE_SIZE << 20);
+  vod->fd_cache = gss_fd_cache_new (GSS_VOD_MAX_OPEN_FILES);
+  vod->prefetcher = gss_prefetch_new (DEFAULT_PREFETCH,
+      GSS_VOD_PREFETCH_MAX_SIZE);
+  vod->loads = g_hash_table_new (g_str_hash, g_str_equal);
+  vod->load_pool = g_thread_pool_new ((GFunc) gss_vod_load_thread, NULL,
+      GSS_VOD_LOAD_THREADS, FALSE, NULL);
+  vod->pre_encrypting = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  /* one at a time, so serving is not starved of disk bandwidth */
+  vod->pre_encrypt_pool = g_thread_pool_new ((GFunc)
+      gss_vod_pre_encrypt_thread, NULL, 1, FALSE, NULL);
+  vod->prewarm_queue = g_queue_new ();
+  vod->prewarm_ready = TRUE;
 }
 
 static void
@@ -95,6 +206,75 @@ gss_vod_class_init (GssVodClass * vod_class)
           "Number of streams to hold in memory.", 1, 10000, DEFAULT_CACHE_SIZE,
           (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
               G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_CACHE_MEMORY, g_param_spec_int ("cache-memory", "Cache Memory",
+          "Memory used by streams held in memory, in MB (0 for no limit).",
+          0, G_MAXINT, DEFAULT_CACHE_MEMORY,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_FRAGMENT_CACHE_SIZE, g_param_spec_int ("fragment-cache-size",
+          "Fragment Cache Size",
+          "Memory used for caching popular fragments, in MB.",
+          0, G_MAXINT, DEFAULT_FRAGMENT_CACHE_SIZE,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_IO_URING, g_param_spec_boolean ("io-uring", "io_uring",
+          "Read fragments with io_uring from the main loop, if available, "
+          "instead of in worker threads.", DEFAULT_IO_URING,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_MMAP, g_param_spec_boolean ("mmap", "mmap",
+          "Map source files into memory and send clear content from the "
+          "mapping without copying.  Source files must not be truncated "
+          "in place while mapped.", DEFAULT_MMAP,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PREWARM, g_param_spec_int ("prewarm", "Prewarm",
+          "Number of streams to load at startup (0 to disable).",
+          0, 10000, DEFAULT_PREWARM,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PREWARM_LIST, g_param_spec_string ("prewarm-list",
+          "Prewarm List",
+          "File listing streams to load at startup, most popular first, "
+          "one key/version/drm/stream per line.  If empty, the most "
+          "recently modified streams in the archive directory are loaded.",
+          DEFAULT_PREWARM_LIST,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PREWARM_STREAM, g_param_spec_string ("prewarm-stream",
+          "Prewarm Stream",
+          "Version, DRM and stream type (version/drm/stream) to load for "
+          "streams found in the archive directory.", DEFAULT_PREWARM_STREAM,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PREWARM_RATE, g_param_spec_int ("prewarm-rate", "Prewarm Rate",
+          "Limit on the rate of reading stream metadata at startup, "
+          "in MB/s (0 for no limit).", 0, G_MAXINT, DEFAULT_PREWARM_RATE,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PREFETCH, g_param_spec_int ("prefetch", "Prefetch",
+          "Number of fragments that may be read ahead at once for clients "
+          "playing a stream in sequence (0 to disable).  Needs the "
+          "fragment cache.", 0, 1000, DEFAULT_PREFETCH,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
+  g_object_class_install_property (G_OBJECT_CLASS (vod_class),
+      PROP_PRE_ENCRYPT, g_param_spec_boolean ("pre-encrypt", "Pre-encrypt",
+          "Keep an encrypted copy of DRM streams next to the source files, "
+          "written in the background the first time a stream is loaded, "
+          "and serve from it instead of encrypting every request.  The "
+          "archive directory must be writable.", DEFAULT_PRE_ENCRYPT,
+          (GParamFlags) (G_PARAM_CONSTRUCT | G_PARAM_READWRITE |
+              G_PARAM_STATIC_STRINGS)));
 
   parent_class = g_type_class_peek_parent (vod_class);
 }
@@ -108,7 +288,25 @@ gss_vod_finalize (GObject * object)
 
   g_free (vod->endpoint);
   g_free (vod->archive_dir);
+  g_free (vod->prewarm_list);
+  g_free (vod->prewarm_stream);
+  if (vod->prewarm_timeout)
+    g_source_remove (vod->prewarm_timeout);
+  g_queue_free_full (vod->prewarm_queue, g_free);
+  /* pending loads hold a reference, so there are none left here */
+  g_thread_pool_free (vod->load_pool, FALSE, TRUE);
+  g_hash_table_unref (vod->loads);
+  /* likewise for pre-encrypt jobs */
+  g_thread_pool_free (vod->pre_encrypt_pool, FALSE, TRUE);
+  g_hash_table_unref (vod->pre_encrypting);
   g_hash_table_unref (vod->cache);
+  g_queue_free (vod->cache_lru);
+  /* prefetches hold streams that use the caches below */
+  gss_prefetch_free (vod->prefetcher);
+  gss_fragment_cache_free (vod->fragment_cache);
+  gss_fd_cache_free (vod->fd_cache);
+  if (vod->uring)
+    gss_uring_free (vod->uring);
 
   parent_class->finalize (object);
 }
@@ -141,6 +339,54 @@ gss_vod_set_property (GObject * object, guint prop_id,
       break;
     case PROP_CACHE_SIZE:
       vod->cache_size = g_value_get_int (value);
+      gss_vod_cache_trim (vod);
+      break;
+    case PROP_CACHE_MEMORY:
+      vod->cache_memory = g_value_get_int (value);
+      gss_vod_cache_trim (vod);
+      break;
+    case PROP_FRAGMENT_CACHE_SIZE:
+      vod->fragment_cache_size = g_value_get_int (value);
+      gss_fragment_cache_set_max_size (vod->fragment_cache,
+          (gsize) vod->fragment_cache_size << 20);
+      break;
+    case PROP_MMAP:
+      vod->mmap = g_value_get_boolean (value);
+      break;
+    case PROP_PREWARM:
+      vod->prewarm = g_value_get_int (value);
+      break;
+    case PROP_PREWARM_LIST:
+      string_replace (&vod->prewarm_list, g_value_dup_string (value));
+      break;
+    case PROP_PREWARM_STREAM:
+      string_replace (&vod->prewarm_stream, g_value_dup_string (value));
+      break;
+    case PROP_PREWARM_RATE:
+      vod->prewarm_rate = g_value_get_int (value);
+      break;
+    case PROP_PREFETCH:
+      vod->prefetch = g_value_get_int (value);
+      gss_prefetch_set_max_pending (vod->prefetcher, vod->prefetch);
+      break;
+    case PROP_PRE_ENCRYPT:
+      vod->pre_encrypt = g_value_get_boolean (value);
+      break;
+    case PROP_IO_URING:
+      vod->io_uring = g_value_get_boolean (value);
+      if (vod->io_uring && vod->uring == NULL) {
+        vod->uring = gss_uring_new (GSS_VOD_URING_QUEUE_DEPTH);
+      } else if (!vod->io_uring && vod->uring) {
+        GList *g;
+
+        for (g = vod->cache_lru->head; g; g = g_list_next (g)) {
+          GssVodCacheEntry *entry = g->data;
+          entry->adaptive->uring = NULL;
+        }
+        /* freed once the reads in flight have completed */
+        gss_uring_free (vod->uring);
+        vod->uring = NULL;
+      }
       break;
     default:
       g_assert_not_reached ();
@@ -169,6 +415,36 @@ gss_vod_get_property (GObject * object, guint prop_id,
     case PROP_CACHE_SIZE:
       g_value_set_int (value, vod->cache_size);
       break;
+    case PROP_CACHE_MEMORY:
+      g_value_set_int (value, vod->cache_memory);
+      break;
+    case PROP_FRAGMENT_CACHE_SIZE:
+      g_value_set_int (value, vod->fragment_cache_size);
+      break;
+    case PROP_IO_URING:
+      g_value_set_boolean (value, vod->io_uring);
+      break;
+    case PROP_MMAP:
+      g_value_set_boolean (value, vod->mmap);
+      break;
+    case PROP_PREWARM:
+      g_value_set_int (value, vod->prewarm);
+      break;
+    case PROP_PREWARM_LIST:
+      g_value_set_string (value, vod->prewarm_list);
+      break;
+    case PROP_PREWARM_STREAM:
+      g_value_set_string (value, vod->prewarm_stream);
+      break;
+    case PROP_PREWARM_RATE:
+      g_value_set_int (value, vod->prewarm_rate);
+      break;
+    case PROP_PREFETCH:
+      g_value_set_int (value, vod->prefetch);
+      break;
+    case PROP_PRE_ENCRYPT:
+      g_value_set_boolean (value, vod->pre_encrypt);
+      break;
     default:
       g_assert_not_reached ();
       break;
@@ -205,6 +481,14 @@ gss_vod_attach (GssObject * object, GssServer * server)
   gss_server_add_resource (GSS_OBJECT_SERVER (object), "/vod-player",
       GSS_RESOURCE_UI, GSS_TEXT_HTML, gss_vod_player_get_resource,
       NULL, NULL, vod);
+
+  gss_server_add_resource (GSS_OBJECT_SERVER (object), "/vod-ready",
+      0, NULL, gss_vod_ready_get_resource, NULL, NULL, vod);
+
+  if (vod->prewarm > 0) {
+    vod->prewarm_ready = FALSE;
+    g_idle_add ((GSourceFunc) gss_vod_prewarm_start, vod);
+  }
 }
 
 static void
@@ -212,6 +496,8 @@ gss_vod_get_resource (GssTransaction * t)
 {
   GssVod *vod = GSS_VOD (t->resource->priv);
   GString *s = g_string_new ("");
+  GssFragmentCacheStats stats;
+  GList *g;
 
   t->s = s;
 
@@ -219,6 +505,92 @@ gss_vod_get_resource (GssTransaction * t)
 
   GSS_A ("<h1>Video On Demand</h1>\n");
 
+  gss_fragment_cache_get_stats (vod->fragment_cache, &stats);
+
+  GSS_A ("<table class='table table-striped table-bordered "
+      "table-condensed'>\n");
+  GSS_A ("<tbody>\n");
+  GSS_P ("<tr><td>Streams in memory</td><td>%d</td></tr>\n",
+      g_hash_table_size (vod->cache));
+  GSS_P ("<tr><td>Memory used</td><td>%" G_GSIZE_FORMAT " kB</td></tr>\n",
+      vod->cache_memory_used / 1024);
+  GSS_P ("<tr><td>Cache hits</td><td>%" G_GUINT64_FORMAT "</td></tr>\n",
+      vod->n_cache_hits);
+  GSS_P ("<tr><td>Cache misses</td><td>%" G_GUINT64_FORMAT "</td></tr>\n",
+      vod->n_cache_misses);
+  GSS_P ("<tr><td>Cache evictions</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", vod->n_cache_evictions);
+  GSS_P ("<tr><td>Streams loading</td><td>%d</td></tr>\n",
+      g_hash_table_size (vod->loads));
+  GSS_P ("<tr><td>Requests waiting for a load</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", vod->n_load_waits);
+  GSS_P ("<tr><td>Average load time</td><td>%" G_GINT64_FORMAT
+      " ms</td></tr>\n", vod->n_loads ?
+      vod->load_time_total / (gint64) vod->n_loads / 1000 : 0);
+  GSS_P ("<tr><td>Longest load time</td><td>%" G_GINT64_FORMAT
+      " ms</td></tr>\n", vod->load_time_max / 1000);
+  if (vod->prewarm > 0) {
+    GSS_P ("<tr><td>Prewarm</td><td>%d of %d streams%s</td></tr>\n",
+        vod->prewarm_n_done, vod->prewarm_n_total,
+        vod->prewarm_ready ? ", done" : "");
+  }
+  GSS_P ("<tr><td>Open files</td><td>%d</td></tr>\n",
+      gss_fd_cache_get_n_open (vod->fd_cache));
+  GSS_P ("<tr><td>Fragments in memory</td><td>%d (%" G_GSIZE_FORMAT
+      " kB)</td></tr>\n", stats.n_entries, stats.size / 1024);
+  GSS_P ("<tr><td>Fragment cache hits</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", stats.n_hits);
+  GSS_P ("<tr><td>Fragment cache misses</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", stats.n_misses);
+  GSS_P ("<tr><td>Fragment cache rejections</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", stats.n_rejections);
+  GSS_P ("<tr><td>Fragment cache evictions</td><td>%" G_GUINT64_FORMAT
+      "</td></tr>\n", stats.n_evictions);
+  if (vod->prefetch > 0) {
+    GssPrefetchStats prefetch_stats;
+    guint64 n_used;
+
+    gss_prefetch_get_stats (vod->prefetcher, &prefetch_stats);
+    n_used = prefetch_stats.n_hits + prefetch_stats.n_late +
+        prefetch_stats.n_wasted;
+    GSS_P ("<tr><td>Prefetches</td><td>%" G_GUINT64_FORMAT " started, %"
+        G_GUINT64_FORMAT " over budget, %d in progress (%" G_GSIZE_FORMAT
+        " kB), %d clients</td></tr>\n", prefetch_stats.n_started,
+        prefetch_stats.n_dropped, prefetch_stats.n_pending,
+        prefetch_stats.pending_size / 1024, prefetch_stats.n_sessions);
+    GSS_P ("<tr><td>Prefetch hit rate</td><td>%.1f%% (%" G_GUINT64_FORMAT
+        " hits, %" G_GUINT64_FORMAT " late, %" G_GUINT64_FORMAT
+        " wasted)</td></tr>\n",
+        n_used ? 100.0 * prefetch_stats.n_hits / n_used : 0.0,
+        prefetch_stats.n_hits, prefetch_stats.n_late,
+        prefetch_stats.n_wasted);
+  }
+  if (vod->pre_encrypt) {
+    GSS_P ("<tr><td>Pre-encrypted copies</td><td>%" G_GUINT64_FORMAT
+        " written, %" G_GUINT64_FORMAT " failed, %d in progress</td></tr>\n",
+        vod->n_pre_encrypted, vod->n_pre_encrypt_failures,
+        g_hash_table_size (vod->pre_encrypting));
+  }
+  GSS_A ("</tbody>\n");
+  GSS_A ("</table>\n");
+
+  GSS_A ("<h2>Streams in memory</h2>\n");
+  GSS_A ("<table class='table table-striped table-bordered "
+      "table-condensed'>\n");
+  GSS_A ("<thead>\n");
+  GSS_A ("<tr><th>Stream</th><th>Memory</th><th>Load time</th></tr>\n");
+  GSS_A ("</thead>\n");
+  GSS_A ("<tbody>\n");
+  for (g = vod->cache_lru->head; g; g = g_list_next (g)) {
+    GssVodCacheEntry *entry = g->data;
+
+    GSS_P ("<tr><td>%s</td><td>%" G_GSIZE_FORMAT " kB</td>"
+        "<td>%" G_GINT64_FORMAT " ms</td></tr>\n", entry->key,
+        entry->size / 1024, entry->load_time / 1000);
+  }
+  GSS_A ("</tbody>\n");
+  GSS_A ("</table>\n");
+
   gss_config_append_config_block (G_OBJECT (vod), t, TRUE);
 
   gss_html_footer (t);
@@ -308,6 +680,7 @@ gss_vod_get_adaptive_resource (GssTransaction * t)
   char *stream;
   GssDrmType drm_type;
   GssAdaptiveStream stream_type;
+  char *hash_key = NULL;
 
   GST_DEBUG ("path: %s", t->path);
 
@@ -335,74 +708,684 @@ gss_vod_get_adaptive_resource (GssTransaction * t)
     goto error;
   }
 
-  adaptive =
-      gss_vod_get_adaptive (vod, key, content_version, drm_type, stream_type);
-  if (adaptive == NULL) {
-    GST_DEBUG ("failed to load %s", key);
-    gss_transaction_error_not_found (t, "failed to load");
-    goto error;
-  }
+  hash_key = g_strdup_printf ("%s/%s/%s/%s",
+      key, content_version, gss_drm_get_drm_name (drm_type),
+      gss_adaptive_stream_get_name (stream_type));
 
   GST_DEBUG ("subpath: %s", path);
 
-  gss_adaptive_get_resource (t, adaptive, path);
+  adaptive = gss_vod_cache_lookup (vod, hash_key);
+  if (adaptive) {
+    gss_adaptive_get_resource (t, adaptive, path);
+    gss_vod_cache_update_size (vod, hash_key);
+  } else {
+    gss_vod_load_adaptive (vod, t, hash_key, key, content_version, drm_type,
+        stream_type, path);
+  }
 
 error:
+  g_free (hash_key);
   g_free (key);
   g_free (content_version);
   g_free (stream);
   g_free (drm);
 }
 
+static void
+gss_vod_cache_entry_free (GssVodCacheEntry * entry)
+{
+  gss_adaptive_unref (entry->adaptive);
+  g_free (entry->key);
+  g_free (entry);
+}
+
+static void
+gss_vod_cache_remove (GssVod * vod, GssVodCacheEntry * entry)
+{
+  g_queue_delete_link (vod->cache_lru, entry->link);
+  vod->cache_memory_used -= entry->size;
+  g_hash_table_remove (vod->cache, entry->key);
+}
+
+/* Evicts least recently used streams until the cache is within both
+ * cache-size and cache-memory.  The most recently used stream is always
+ * kept, even if it alone exceeds the memory budget. */
+static void
+gss_vod_cache_trim (GssVod * vod)
+{
+  gsize budget = (gsize) vod->cache_memory * 1024 * 1024;
+
+  while (g_queue_get_length (vod->cache_lru) > 1 &&
+      ((int) g_queue_get_length (vod->cache_lru) > vod->cache_size ||
+          (budget > 0 && vod->cache_memory_used > budget))) {
+    GssVodCacheEntry *entry = g_queue_peek_tail (vod->cache_lru);
+
+    GST_DEBUG ("evicting %s (%" G_GSIZE_FORMAT " bytes)", entry->key,
+        entry->size);
+    gss_vod_cache_remove (vod, entry);
+    vod->n_cache_evictions++;
+  }
+}
+
 static GssAdaptive *
-gss_vod_get_adaptive (GssVod * vod, const char *key, const char *version,
-    GssDrmType drm_type, GssAdaptiveStream stream_type)
+gss_vod_cache_lookup (GssVod * vod, const char *hash_key)
 {
-  GssAdaptive *adaptive;
+  GssVodCacheEntry *entry;
+
+  entry = g_hash_table_lookup (vod->cache, hash_key);
+  if (entry == NULL) {
+    vod->n_cache_misses++;
+    return NULL;
+  }
+
+  vod->n_cache_hits++;
+  g_queue_unlink (vod->cache_lru, entry->link);
+  g_queue_push_head_link (vod->cache_lru, entry->link);
+
+  return entry->adaptive;
+}
+
+/* Manifests are cached in the adaptive as requests come in, after the
+ * entry was sized at insert, so charge them to the entry afterwards. */
+static void
+gss_vod_cache_update_size (GssVod * vod, const char *hash_key)
+{
+  GssVodCacheEntry *entry;
+  gsize manifests_size;
+
+  entry = g_hash_table_lookup (vod->cache, hash_key);
+  if (entry == NULL)
+    return;
+
+  manifests_size = entry->adaptive->manifests_size;
+  if (manifests_size == entry->manifests_size)
+    return;
+
+  vod->cache_memory_used -= entry->size;
+  entry->size = entry->size - entry->manifests_size + manifests_size;
+  entry->manifests_size = manifests_size;
+  vod->cache_memory_used += entry->size;
+
+  /* the entry was just used, so it is not the one evicted */
+  gss_vod_cache_trim (vod);
+}
+
+/* Takes ownership of @adaptive. */
+static void
+gss_vod_cache_insert (GssVod * vod, const char *hash_key,
+    GssAdaptive * adaptive, gint64 load_time)
+{
+  GssVodCacheEntry *entry;
+
+  entry = g_new0 (GssVodCacheEntry, 1);
+  entry->key = g_strdup (hash_key);
+  entry->adaptive = adaptive;
+  entry->size = gss_adaptive_get_memory_size (adaptive);
+  entry->manifests_size = adaptive->manifests_size;
+  entry->load_time = load_time;
+  entry->link = g_list_alloc ();
+  entry->link->data = entry;
+  g_queue_push_head_link (vod->cache_lru, entry->link);
+  vod->cache_memory_used += entry->size;
+  g_hash_table_replace (vod->cache, entry->key, entry);
+
+  gss_vod_cache_trim (vod);
+}
+
+static char *
+gss_vod_get_dir (GssVod * vod, const char *key)
+{
+  switch (vod->dir_levels) {
+    case 0:
+      return g_strdup_printf ("%s/%s", vod->archive_dir, key);
+    case 1:
+      return g_strdup_printf ("%s/%c/%s", vod->archive_dir, key[0], key);
+    case 2:
+      return g_strdup_printf ("%s/%c/%c/%s", vod->archive_dir, key[0], key[1],
+          key);
+    case 3:
+      return g_strdup_printf ("%s/%c/%c/%c/%s", vod->archive_dir, key[0],
+          key[1], key[2], key);
+    default:
+      g_assert_not_reached ();
+  }
+  return NULL;
+}
+
+/* Runs in vod->load_pool.  Only touches @load, which is not shared
+ * until it is handed back to the main loop. */
+static void
+gss_vod_load_thread (GssVodLoad * load, gpointer unused)
+{
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  load->adaptive = gss_adaptive_load (GSS_OBJECT_SERVER (load->vod),
+      load->key, load->dir, load->version, load->drm_type,
+      load->stream_type);
+  load->load_time = g_get_monotonic_time () - start;
+
+  if (load->adaptive && load->pre_encrypt) {
+    load->write_pre_encrypted =
+        !gss_adaptive_open_pre_encrypted (load->adaptive);
+  }
+
+  g_idle_add ((GSourceFunc) gss_vod_load_done, load);
+}
+
+static gboolean
+gss_vod_pre_encrypt_done (GssVodPreEncrypt * job)
+{
+  GssVod *vod = job->vod;
+
+  g_hash_table_remove (vod->pre_encrypting, job->hash_key);
+  if (job->written) {
+    vod->n_pre_encrypted++;
+  } else {
+    vod->n_pre_encrypt_failures++;
+  }
+
+  gss_adaptive_unref (job->adaptive);
+  g_object_unref (job->vod);
+  g_free (job->hash_key);
+  g_free (job);
+
+  return FALSE;
+}
+
+/* Runs in vod->pre_encrypt_pool.  The stream may be serving requests
+ * meanwhile, which only read it. */
+static void
+gss_vod_pre_encrypt_thread (GssVodPreEncrypt * job, gpointer unused)
+{
+  GST_INFO ("writing pre-encrypted copy of %s", job->hash_key);
+  job->written = gss_adaptive_write_pre_encrypted (job->adaptive);
+
+  g_idle_add ((GSourceFunc) gss_vod_pre_encrypt_done, job);
+}
+
+/* Writes the pre-encrypted copy of a freshly loaded stream, unless it
+ * is already being written. */
+static void
+gss_vod_start_pre_encrypt (GssVod * vod, const char *hash_key,
+    GssAdaptive * adaptive)
+{
+  GssVodPreEncrypt *job;
+
+  if (g_hash_table_lookup (vod->pre_encrypting, hash_key))
+    return;
+  g_hash_table_insert (vod->pre_encrypting, g_strdup (hash_key),
+      GINT_TO_POINTER (1));
+
+  job = g_new0 (GssVodPreEncrypt, 1);
+  job->vod = g_object_ref (vod);
+  job->hash_key = g_strdup (hash_key);
+  job->adaptive = gss_adaptive_ref (adaptive);
+  g_thread_pool_push (vod->pre_encrypt_pool, job, NULL);
+}
+
+static gboolean
+gss_vod_load_done (GssVodLoad * load)
+{
+  GssVod *vod = load->vod;
+  GssAdaptive *adaptive = load->adaptive;
+  GList *g;
+
+  g_hash_table_remove (vod->loads, load->hash_key);
+
+  if (adaptive) {
+    GST_INFO ("loaded %s in %" G_GINT64_FORMAT " ms", load->hash_key,
+        load->load_time / 1000);
+
+    adaptive->fragment_cache = vod->fragment_cache;
+    adaptive->fd_cache = vod->fd_cache;
+    adaptive->uring = vod->io_uring ? vod->uring : NULL;
+    adaptive->prefetch = vod->prefetch > 0 ? vod->prefetcher : NULL;
+    adaptive->use_mmap = vod->mmap;
+
+    vod->n_loads++;
+    vod->load_time_total += load->load_time;
+    vod->load_time_max = MAX (vod->load_time_max, load->load_time);
+
+    if (load->write_pre_encrypted) {
+      gss_vod_start_pre_encrypt (vod, load->hash_key, adaptive);
+    }
+
+    /* keep a reference for the waiters, in case the cache is tiny */
+    gss_vod_cache_insert (vod, load->hash_key, gss_adaptive_ref (adaptive),
+        load->load_time);
+  } else {
+    GST_DEBUG ("failed to load %s", load->key);
+  }
+
+  load->waiters = g_list_reverse (load->waiters);
+  for (g = load->waiters; g; g = g_list_next (g)) {
+    GssVodLoadWaiter *waiter = g->data;
+    GssTransaction *t = waiter->t;
+
+    /* The handler may pause the message again for an asynchronous
+     * fragment read, which cancels this before it takes effect. */
+    soup_server_unpause_message (t->soupserver, t->msg);
+
+    if (adaptive) {
+      gss_adaptive_get_resource (t, adaptive, waiter->subpath);
+    } else {
+      gss_transaction_error_not_found (t, "failed to load");
+    }
+
+    /* what gss_server_resource_callback() does after the handler */
+    if (t->s) {
+      gsize len = t->s->len;
+
+      soup_message_body_append (t->msg->response_body, SOUP_MEMORY_TAKE,
+          g_string_free (t->s, FALSE), len);
+      t->s = NULL;
+    }
+
+    g_free (waiter->subpath);
+    g_free (waiter);
+  }
+  g_list_free (load->waiters);
+  if (adaptive)
+    gss_vod_cache_update_size (vod, load->hash_key);
+
+  if (load->prewarm) {
+    gss_vod_prewarm_load_done (vod,
+        adaptive ? gss_adaptive_get_memory_size (adaptive) : 0);
+  }
+
+  if (adaptive)
+    gss_adaptive_unref (adaptive);
+  g_object_unref (vod);
+  g_free (load->hash_key);
+  g_free (load->key);
+  g_free (load->version);
+  g_free (load->dir);
+  g_free (load);
+
+  return FALSE;
+}
+
+static GssVodLoad *
+gss_vod_start_load (GssVod * vod, const char *hash_key, const char *key,
+    const char *version, GssDrmType drm_type, GssAdaptiveStream stream_type)
+{
+  GssVodLoad *load;
+
+  load = g_new0 (GssVodLoad, 1);
+  load->vod = g_object_ref (vod);
+  load->hash_key = g_strdup (hash_key);
+  load->key = g_strdup (key);
+  load->version = g_strdup (version);
+  load->dir = gss_vod_get_dir (vod, key);
+  load->drm_type = drm_type;
+  load->stream_type = stream_type;
+  load->pre_encrypt = vod->pre_encrypt && drm_type != GSS_DRM_CLEAR;
+  g_hash_table_insert (vod->loads, load->hash_key, load);
+
+  GST_DEBUG ("loading %s", hash_key);
+  g_thread_pool_push (vod->load_pool, load, NULL);
+
+  return load;
+}
+
+/* Pauses @t until the stream is loaded, starting a load in
+ * vod->load_pool unless one for the same stream is already running. */
+static void
+gss_vod_load_adaptive (GssVod * vod, GssTransaction * t,
+    const char *hash_key, const char *key, const char *version,
+    GssDrmType drm_type, GssAdaptiveStream stream_type, const char *subpath)
+{
+  GssVodLoadWaiter *waiter;
+  GssVodLoad *load;
+
+  load = g_hash_table_lookup (vod->loads, hash_key);
+  if (load == NULL) {
+    load = gss_vod_start_load (vod, hash_key, key, version, drm_type,
+        stream_type);
+  } else {
+    GST_DEBUG ("waiting for load of %s", hash_key);
+    vod->n_load_waits++;
+  }
+
+  /* libsoup frees the query after the handler returns */
+  if (t->query) {
+    g_object_set_data_full (G_OBJECT (t->msg), "gss-vod-query",
+        g_hash_table_ref (t->query), (GDestroyNotify) g_hash_table_unref);
+  }
+
+  waiter = g_new0 (GssVodLoadWaiter, 1);
+  waiter->t = t;
+  waiter->subpath = g_strdup (subpath);
+  load->waiters = g_list_prepend (load->waiters, waiter);
+
+  soup_server_pause_message (t->soupserver, t->msg);
+}
+
+/* Prewarm
+ *
+ * With the prewarm property set, the most popular streams are loaded
+ * into the cache at startup, so that their first viewers do not wait
+ * for the load.  Popularity comes from the prewarm-list file, which
+ * lists stream paths ("key/version/drm/stream", as in request URLs)
+ * most popular first.  Without a list, archive-dir is scanned and the
+ * most recently modified streams are loaded as prewarm-stream.
+ *
+ * Loads go through the normal load pool, at most GSS_VOD_LOAD_THREADS
+ * at a time.  prewarm-rate limits how fast metadata is read from
+ * disk, using the in-memory size of each loaded stream as an estimate
+ * of the bytes read for it, so that prewarming does not starve
+ * fragment reads for live viewers.  /vod-ready reports progress, and
+ * returns 503 until prewarming is done, for load balancer health
+ * checks. */
+
+typedef struct _GssVodPrewarmScan GssVodPrewarmScan;
+struct _GssVodPrewarmScan
+{
+  GssVod *vod;
+  char *archive_dir;
+  int dir_levels;
+  char *list;
+  char *stream;
+  int n_streams;
+
+  GList *paths;
+};
+
+typedef struct _GssVodPrewarmTitle GssVodPrewarmTitle;
+struct _GssVodPrewarmTitle
+{
+  char *key;
+  gint64 mtime;
+};
+
+static void
+gss_vod_prewarm_scan_dir (GssVodPrewarmScan * scan, const char *path,
+    int depth, GArray * titles)
+{
+  const char *name;
+  GDir *dir;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir))) {
+    char *subpath;
+
+    if (name[0] == '.')
+      continue;
+
+    subpath = g_build_filename (path, name, NULL);
+    if (depth < scan->dir_levels) {
+      gss_vod_prewarm_scan_dir (scan, subpath, depth + 1, titles);
+    } else {
+      char *manifest;
+      GStatBuf sb;
+
+      manifest = g_build_filename (subpath, "gss-manifest", NULL);
+      if (g_stat (manifest, &sb) == 0) {
+        GssVodPrewarmTitle title;
+
+        title.key = g_strdup (name);
+        title.mtime = sb.st_mtime;
+        g_array_append_val (titles, title);
+      }
+      g_free (manifest);
+    }
+    g_free (subpath);
+  }
+  g_dir_close (dir);
+}
+
+static gint
+gss_vod_prewarm_title_compare (gconstpointer a, gconstpointer b)
+{
+  const GssVodPrewarmTitle *title_a = a;
+  const GssVodPrewarmTitle *title_b = b;
+
+  /* newest first */
+  if (title_a->mtime != title_b->mtime)
+    return (title_a->mtime < title_b->mtime) ? 1 : -1;
+  return strcmp (title_a->key, title_b->key);
+}
+
+static gboolean gss_vod_prewarm_scan_done (GssVodPrewarmScan * scan);
+
+static gpointer
+gss_vod_prewarm_scan_thread (GssVodPrewarmScan * scan)
+{
+  if (scan->list && scan->list[0]) {
+    char *contents;
+    char **lines;
+    GError *error = NULL;
+    int n = 0;
+    int i;
+
+    if (g_file_get_contents (scan->list, &contents, NULL, &error)) {
+      lines = g_strsplit (contents, "\n", -1);
+      for (i = 0; lines[i] && n < scan->n_streams; i++) {
+        char *line = g_strstrip (lines[i]);
+
+        if (line[0] == '\0' || line[0] == '#')
+          continue;
+        scan->paths = g_list_prepend (scan->paths, g_strdup (line));
+        n++;
+      }
+      g_strfreev (lines);
+      g_free (contents);
+    } else {
+      GST_WARNING ("failed to read prewarm list: %s", error->message);
+      g_error_free (error);
+    }
+  } else {
+    GArray *titles;
+    int i;
+
+    titles = g_array_new (FALSE, FALSE, sizeof (GssVodPrewarmTitle));
+    gss_vod_prewarm_scan_dir (scan, scan->archive_dir, 0, titles);
+    g_array_sort (titles, gss_vod_prewarm_title_compare);
+    for (i = 0; i < (int) titles->len; i++) {
+      GssVodPrewarmTitle *title = &g_array_index (titles, GssVodPrewarmTitle,
+          i);
+
+      if (i < scan->n_streams) {
+        scan->paths = g_list_prepend (scan->paths,
+            g_strdup_printf ("%s/%s", title->key, scan->stream));
+      }
+      g_free (title->key);
+    }
+    g_array_free (titles, TRUE);
+  }
+  scan->paths = g_list_reverse (scan->paths);
+
+  g_idle_add ((GSourceFunc) gss_vod_prewarm_scan_done, scan);
+
+  return NULL;
+}
+
+static void
+gss_vod_prewarm_finish (GssVod * vod)
+{
+  vod->prewarm_ready = TRUE;
+  GST_INFO ("prewarm done: %d streams in %" G_GINT64_FORMAT " ms",
+      vod->prewarm_n_done,
+      (g_get_monotonic_time () - vod->prewarm_start_time) / 1000);
+}
+
+/* Starts a load for @path, or returns FALSE if it is invalid or
+ * already loaded. */
+static gboolean
+gss_vod_prewarm_start_load (GssVod * vod, const char *path)
+{
+  GssDrmType drm_type;
+  GssAdaptiveStream stream_type;
+  GssVodLoad *load;
+  char **parts;
   char *hash_key;
+  gboolean ret = FALSE;
 
-  hash_key = g_strdup_printf ("%s/%s/%s/%s",
-      key, version, gss_drm_get_drm_name (drm_type),
+  parts = g_strsplit (path, "/", 0);
+  if (g_strv_length (parts) != 4) {
+    GST_WARNING ("invalid prewarm stream \"%s\"", path);
+    g_strfreev (parts);
+    return FALSE;
+  }
+  drm_type = gss_drm_get_drm_type (parts[2]);
+  stream_type = gss_adaptive_get_stream_type (parts[3]);
+  if (drm_type == GSS_DRM_UNKNOWN ||
+      stream_type == GSS_ADAPTIVE_STREAM_UNKNOWN) {
+    GST_WARNING ("invalid prewarm stream \"%s\"", path);
+    g_strfreev (parts);
+    return FALSE;
+  }
+
+  hash_key = g_strdup_printf ("%s/%s/%s/%s", parts[0], parts[1],
+      gss_drm_get_drm_name (drm_type),
       gss_adaptive_stream_get_name (stream_type));
+  if (!g_hash_table_lookup (vod->cache, hash_key) &&
+      !g_hash_table_lookup (vod->loads, hash_key)) {
+    load = gss_vod_start_load (vod, hash_key, parts[0], parts[1], drm_type,
+        stream_type);
+    load->prewarm = TRUE;
+    ret = TRUE;
+  }
+  g_free (hash_key);
+  g_strfreev (parts);
+
+  return ret;
+}
+
+static gboolean
+gss_vod_prewarm_timeout (GssVod * vod)
+{
+  vod->prewarm_timeout = 0;
+  gss_vod_prewarm_continue (vod);
+  return FALSE;
+}
 
-  adaptive = g_hash_table_lookup (vod->cache, hash_key);
-  if (adaptive == NULL) {
-    char *dir;
-
-    switch (vod->dir_levels) {
-      case 0:
-        dir = g_strdup_printf ("%s/%s", vod->archive_dir, key);
-        break;
-      case 1:
-        dir = g_strdup_printf ("%s/%c/%s", vod->archive_dir, key[0], key);
-        break;
-      case 2:
-        dir =
-            g_strdup_printf ("%s/%c/%c/%s", vod->archive_dir, key[0], key[1],
-            key);
-        break;
-      case 3:
-        dir =
-            g_strdup_printf ("%s/%c/%c/%c/%s", vod->archive_dir, key[0], key[1],
-            key[2], key);
-        break;
-      default:
-        g_assert_not_reached ();
+static void
+gss_vod_prewarm_continue (GssVod * vod)
+{
+  while (vod->prewarm_n_pending < GSS_VOD_LOAD_THREADS &&
+      !g_queue_is_empty (vod->prewarm_queue)) {
+    gint64 now = g_get_monotonic_time ();
+    char *path;
+
+    if (now < vod->prewarm_next_time) {
+      if (vod->prewarm_timeout == 0) {
+        vod->prewarm_timeout = g_timeout_add ((vod->prewarm_next_time -
+                now + 999) / 1000, (GSourceFunc) gss_vod_prewarm_timeout,
+            vod);
+      }
+      return;
     }
 
-    adaptive =
-        gss_adaptive_load (GSS_OBJECT_SERVER (vod), key, dir, version, drm_type,
-        stream_type);
-    g_free (dir);
-    if (adaptive == NULL) {
-      g_free (hash_key);
-      return NULL;
+    path = g_queue_pop_head (vod->prewarm_queue);
+    if (gss_vod_prewarm_start_load (vod, path)) {
+      vod->prewarm_n_pending++;
+    } else {
+      vod->prewarm_n_done++;
     }
-    g_hash_table_replace (vod->cache, hash_key, adaptive);
+    g_free (path);
+  }
+
+  if (vod->prewarm_n_pending == 0 && g_queue_is_empty (vod->prewarm_queue) &&
+      !vod->prewarm_ready) {
+    gss_vod_prewarm_finish (vod);
+  }
+}
+
+/* Called from gss_vod_load_done() for loads started by prewarming. */
+static void
+gss_vod_prewarm_load_done (GssVod * vod, gsize size)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  vod->prewarm_n_pending--;
+  vod->prewarm_n_done++;
+
+  if (vod->prewarm_rate > 0) {
+    vod->prewarm_next_time = MAX (vod->prewarm_next_time, now) +
+        (gint64) size * G_USEC_PER_SEC / ((gint64) vod->prewarm_rate << 20);
+  }
+
+  gss_vod_prewarm_continue (vod);
+}
+
+static gboolean
+gss_vod_prewarm_scan_done (GssVodPrewarmScan * scan)
+{
+  GssVod *vod = scan->vod;
+  GList *g;
+
+  for (g = scan->paths; g; g = g_list_next (g)) {
+    g_queue_push_tail (vod->prewarm_queue, g->data);
+  }
+  vod->prewarm_n_total = g_queue_get_length (vod->prewarm_queue);
+  vod->prewarm_scanning = FALSE;
+  GST_INFO ("prewarming %d streams", vod->prewarm_n_total);
+
+  gss_vod_prewarm_continue (vod);
+
+  g_list_free (scan->paths);
+  g_free (scan->archive_dir);
+  g_free (scan->list);
+  g_free (scan->stream);
+  g_object_unref (scan->vod);
+  g_free (scan);
+
+  return FALSE;
+}
+
+/* Runs from the main loop once all modules are attached, since loading
+ * needs the PlayReady module for keys. */
+static gboolean
+gss_vod_prewarm_start (GssVod * vod)
+{
+  GssVodPrewarmScan *scan;
+  GThread *thread;
+
+  scan = g_new0 (GssVodPrewarmScan, 1);
+  scan->vod = g_object_ref (vod);
+  scan->archive_dir = g_strdup (vod->archive_dir);
+  scan->dir_levels = vod->dir_levels;
+  scan->list = g_strdup (vod->prewarm_list);
+  scan->stream = g_strdup (vod->prewarm_stream);
+  scan->n_streams = vod->prewarm;
+
+  vod->prewarm_scanning = TRUE;
+  vod->prewarm_start_time = g_get_monotonic_time ();
+
+  /* scanning a large archive can take a while */
+  thread = g_thread_new ("gss_vod_prewarm",
+      (GThreadFunc) gss_vod_prewarm_scan_thread, scan);
+  g_thread_unref (thread);
+
+  return FALSE;
+}
+
+static void
+gss_vod_ready_get_resource (GssTransaction * t)
+{
+  GssVod *vod = GSS_VOD (t->resource->priv);
+  char *content;
+
+  if (vod->prewarm_ready) {
+    content = g_strdup_printf ("ready\n");
+    soup_message_set_status (t->msg, SOUP_STATUS_OK);
+  } else if (vod->prewarm_scanning) {
+    content = g_strdup_printf ("prewarming: scanning\n");
+    soup_message_set_status (t->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
   } else {
-    g_free (hash_key);
+    content = g_strdup_printf ("prewarming: %d of %d streams loaded\n",
+        vod->prewarm_n_done, vod->prewarm_n_total);
+    soup_message_set_status (t->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
   }
-  return adaptive;
+  soup_message_headers_replace (t->msg->response_headers, "Cache-Control",
+      "no-cache");
+  soup_message_set_response (t->msg, GSS_TEXT_PLAIN, SOUP_MEMORY_TAKE,
+      content, strlen (content));
 }
 
 static void
@@ -26,6 +26,10 @@
 #include <glib/gstdio.h>
 
 #include "gss-server.h"
+#include "gss-fragment-cache.h"
+#include "gss-fd-cache.h"
+#include "gss-prefetch.h"
+#include "gss-uring.h"
 
 #define GSS_TYPE_VOD \
   (gss_vod_get_type())
@@ -46,12 +50,57 @@ typedef struct _GssVodClass GssVodClass;
 struct _GssVod {
   GssModule module;
   GHashTable *cache;
+  GQueue *cache_lru; /* most recently used first */
+  gsize cache_memory_used;
+  GssFragmentCache *fragment_cache;
+  GssFdCache *fd_cache;
+  GssUring *uring;
+  GssPrefetch *prefetcher;
+
+  guint64 n_cache_hits;
+  guint64 n_cache_misses;
+  guint64 n_cache_evictions;
+
+  /* streams being loaded, hash key -> GssVodLoad */
+  GHashTable *loads;
+  GThreadPool *load_pool;
+  guint64 n_loads;
+  guint64 n_load_waits;
+  gint64 load_time_total;
+  gint64 load_time_max;
+
+  /* streams whose pre-encrypted copy is being written, hash key -> 1 */
+  GHashTable *pre_encrypting;
+  GThreadPool *pre_encrypt_pool;
+  guint64 n_pre_encrypted;
+  guint64 n_pre_encrypt_failures;
+
+  /* startup prewarm, paths of streams still to load */
+  GQueue *prewarm_queue;
+  gboolean prewarm_scanning;
+  gboolean prewarm_ready;
+  int prewarm_n_total;
+  int prewarm_n_done;
+  int prewarm_n_pending;
+  gint64 prewarm_start_time;
+  gint64 prewarm_next_time;
+  guint prewarm_timeout;
 
   /* properties */
   char *endpoint;
   char *archive_dir;
   int dir_levels;
   int cache_size;
+  int cache_memory;
+  int fragment_cache_size;
+  gboolean io_uring;
+  gboolean mmap;
+  int prewarm;
+  char *prewarm_list;
+  char *prewarm_stream;
+  int prewarm_rate;
+  int prefetch;
+  gboolean pre_encrypt;
 };
 
 struct _GssVodClass {
@@ -0,0 +1,176 @@
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-isom.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+/* Builds a track with a sample table that exercises the corners of
+ * the sample index: runs of zero-duration samples, several stsc runs
+ * with single and multi-sample chunks, and either a per-sample or a
+ * constant stsz. */
+static GssIsomTrack *
+create_track (guint32 constant_size)
+{
+  static const GssBoxSttsEntry stts[] = {
+    {2, 0}, {3, 1000}, {2, 0}, {4, 512}, {1, 0}, {6, 1001}
+  };
+  static const GssBoxCttsEntry ctts[] = {
+    {5, 0}, {3, 2000}, {10, 1000}
+  };
+  /* chunks 1-2 hold 3 samples, 3-4 hold 1, and 5-6 hold 5 */
+  static const guint32 stsc[][2] = {
+    {1, 3}, {3, 1}, {5, 5}
+  };
+  GssIsomTrack *track;
+  int n_samples = 18;
+  int n_chunks = 6;
+  int i;
+
+  track = gss_isom_track_new ();
+
+  track->stts.present = TRUE;
+  track->stts.entry_count = G_N_ELEMENTS (stts);
+  track->stts.entries = g_new (GssBoxSttsEntry, G_N_ELEMENTS (stts));
+  memcpy (track->stts.entries, stts, sizeof (stts));
+
+  track->ctts.present = TRUE;
+  track->ctts.entry_count = G_N_ELEMENTS (ctts);
+  track->ctts.entries = g_new (GssBoxCttsEntry, G_N_ELEMENTS (ctts));
+  memcpy (track->ctts.entries, ctts, sizeof (ctts));
+
+  track->stsc.present = TRUE;
+  track->stsc.entry_count = G_N_ELEMENTS (stsc);
+  track->stsc.entries = g_new0 (GssBoxStscEntry, G_N_ELEMENTS (stsc));
+  for (i = 0; i < G_N_ELEMENTS (stsc); i++) {
+    track->stsc.entries[i].first_chunk = stsc[i][0];
+    track->stsc.entries[i].samples_per_chunk = stsc[i][1];
+    track->stsc.entries[i].sample_description_index = 1;
+  }
+
+  track->stsz.present = TRUE;
+  track->stsz.sample_count = n_samples;
+  track->stsz.sample_size = constant_size;
+  if (constant_size == 0) {
+    track->stsz.sample_sizes = g_new (guint32, n_samples);
+    for (i = 0; i < n_samples; i++) {
+      track->stsz.sample_sizes[i] = 100 + 7 * i;
+    }
+  }
+
+  track->stco.present = TRUE;
+  track->stco.entry_count = n_chunks;
+  track->stco.chunk_offsets = g_new (guint64, n_chunks);
+  for (i = 0; i < n_chunks; i++) {
+    track->stco.chunk_offsets[i] = 1000 + G_GUINT64_CONSTANT (100000) * i;
+  }
+
+  return track;
+}
+
+static void
+check_track (GssIsomTrack * track)
+{
+  GssIsomSampleIterator iter;
+  GssIsomSample expected;
+  GssIsomSample sample;
+  guint64 *dts;
+  guint64 total;
+  int n_samples = track->stsz.sample_count;
+  int i, j;
+
+  /* the iterator walks the tables sequentially, so it is the
+   * reference for random access */
+  dts = g_new (guint64, n_samples);
+  total = 0;
+  i = 0;
+  gss_isom_sample_iter_init (&iter, track);
+  do {
+    gss_isom_sample_iter_get_sample (&iter, &expected);
+    gss_isom_track_get_sample (track, &sample, i);
+
+    fail_unless_equals_int (sample.duration, expected.duration);
+    fail_unless_equals_int (sample.size, expected.size);
+    fail_unless_equals_int (sample.composition_time_offset,
+        expected.composition_time_offset);
+    fail_unless_equals_uint64 (sample.offset, expected.offset);
+
+    dts[i] = total;
+    total += expected.duration;
+    i++;
+  } while (gss_isom_sample_iter_iterate (&iter));
+  fail_unless_equals_int (i, n_samples);
+
+  /* the sample that plays at a timestamp is the last one that starts
+   * at or before it, which skips over zero-duration samples */
+  for (i = 0; i < n_samples; i++) {
+    guint64 timestamps[3];
+    guint64 end = (i + 1 < n_samples) ? dts[i + 1] : total;
+
+    timestamps[0] = dts[i];
+    timestamps[1] = dts[i] + (end - dts[i]) / 2;
+    timestamps[2] = MAX (end, dts[i] + 1) - 1;
+
+    for (j = 0; j < G_N_ELEMENTS (timestamps); j++) {
+      guint64 ts = timestamps[j];
+      int index;
+
+      if (ts >= total)
+        continue;
+      index = n_samples - 1;
+      while (dts[index] > ts)
+        index--;
+
+      fail_unless_equals_int (gss_isom_track_get_index_from_timestamp (track,
+              ts), index);
+    }
+  }
+  fail_unless_equals_int (gss_isom_track_get_index_from_timestamp (track,
+          total), n_samples);
+  fail_unless_equals_int (gss_isom_track_get_index_from_timestamp (track,
+          total + 12345), n_samples);
+
+  g_free (dts);
+}
+
+GST_START_TEST (test_isom_sample_index)
+{
+  GssIsomTrack *track;
+
+  track = create_track (0);
+  check_track (track);
+  gss_isom_track_free (track);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_isom_sample_index_constant_size)
+{
+  GssIsomTrack *track;
+
+  track = create_track (188);
+  check_track (track);
+  gss_isom_track_free (track);
+}
+
+GST_END_TEST;
+
+
+static Suite *
+gss_isom_suite (void)
+{
+  Suite *s = suite_create ("GssIsom");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_isom_sample_index);
+  tcase_add_test (tc_chain, test_isom_sample_index_constant_size);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_isom);
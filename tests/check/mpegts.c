@@ -0,0 +1,333 @@
+
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "gst-streaming-server/gss-mpegts.h"
+#include <gst/check/gstcheck.h>
+
+#include <string.h>
+
+#define PMT_PID 0x1000
+#define VIDEO_PID 0x0100
+#define AUDIO_PID 0x0101
+
+static void
+write_pcr (guint8 * data, guint64 pcr)
+{
+  guint64 base = pcr / 300;
+  int ext = pcr % 300;
+
+  data[0] = base >> 25;
+  data[1] = base >> 17;
+  data[2] = base >> 9;
+  data[3] = base >> 1;
+  data[4] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+  data[5] = ext & 0xff;
+}
+
+/* A packet with an adaptation field if it has the random access flag
+ * or a PCR; pcr is ignored if has_pcr is FALSE. */
+static void
+make_packet (guint8 * data, int pid, gboolean pusi, gboolean rai,
+    gboolean has_pcr, guint64 pcr)
+{
+  memset (data, 0xff, GSS_MPEGTS_PACKET_SIZE);
+  data[0] = GSS_MPEGTS_SYNC_BYTE;
+  data[1] = (pusi ? 0x40 : 0) | (pid >> 8);
+  data[2] = pid & 0xff;
+  data[3] = 0x10;
+  if (rai || has_pcr) {
+    data[3] |= 0x20;
+    data[4] = has_pcr ? 7 : 1;
+    data[5] = (rai ? 0x40 : 0) | (has_pcr ? 0x10 : 0);
+    if (has_pcr)
+      write_pcr (data + 6, pcr);
+  }
+}
+
+static void
+make_pat (guint8 * data, int pmt_pid)
+{
+  guint8 *s = data + 5;
+
+  make_packet (data, 0x0000, TRUE, FALSE, FALSE, 0);
+  data[4] = 0;                  /* pointer_field */
+  s[0] = 0x00;                  /* table_id */
+  s[1] = 0xb0;
+  s[2] = 13;                    /* section_length */
+  s[3] = 0;
+  s[4] = 1;                     /* transport_stream_id */
+  s[5] = 0xc1;
+  s[6] = 0;
+  s[7] = 0;
+  s[8] = 0;
+  s[9] = 1;                     /* program_number */
+  s[10] = 0xe0 | (pmt_pid >> 8);
+  s[11] = pmt_pid & 0xff;
+}
+
+static void
+make_pmt (guint8 * data, int pmt_pid, int pcr_pid)
+{
+  guint8 *s = data + 5;
+
+  make_packet (data, pmt_pid, TRUE, FALSE, FALSE, 0);
+  data[4] = 0;                  /* pointer_field */
+  s[0] = 0x02;                  /* table_id */
+  s[1] = 0xb0;
+  s[2] = 9 + 2 * 5 + 4;         /* section_length */
+  s[3] = 0;
+  s[4] = 1;                     /* program_number */
+  s[5] = 0xc1;
+  s[6] = 0;
+  s[7] = 0;
+  s[8] = 0xe0 | (pcr_pid >> 8);
+  s[9] = pcr_pid & 0xff;
+  s[10] = 0xf0;
+  s[11] = 0;                    /* program_info_length */
+  /* AAC audio before the video, which the scanner must skip */
+  s[12] = 0x0f;
+  s[13] = 0xe0 | (AUDIO_PID >> 8);
+  s[14] = AUDIO_PID & 0xff;
+  s[15] = 0xf0;
+  s[16] = 0;
+  s[17] = 0x1b;
+  s[18] = 0xe0 | (VIDEO_PID >> 8);
+  s[19] = VIDEO_PID & 0xff;
+  s[20] = 0xf0;
+  s[21] = 0;
+}
+
+/* PAT, PMT, then n_gops GOPs of gop_size video packets, each starting
+ * with a keyframe that carries a PCR, and an audio keyframe in the
+ * middle of each GOP. */
+static guint8 *
+make_stream (int n_gops, int gop_size, gsize * size)
+{
+  guint8 *data;
+  guint8 *p;
+  int i;
+  int j;
+
+  *size = (2 + n_gops * gop_size) * GSS_MPEGTS_PACKET_SIZE;
+  data = g_malloc (*size);
+  p = data;
+  make_pat (p, PMT_PID);
+  p += GSS_MPEGTS_PACKET_SIZE;
+  make_pmt (p, PMT_PID, VIDEO_PID);
+  p += GSS_MPEGTS_PACKET_SIZE;
+  for (i = 0; i < n_gops; i++) {
+    for (j = 0; j < gop_size; j++) {
+      if (j == 0) {
+        make_packet (p, VIDEO_PID, TRUE, TRUE, TRUE,
+            (guint64) i * GSS_MPEGTS_PCR_CLOCK);
+      } else if (j == gop_size / 2) {
+        make_packet (p, AUDIO_PID, TRUE, TRUE, FALSE, 0);
+      } else {
+        make_packet (p, VIDEO_PID, FALSE, FALSE, FALSE, 0);
+      }
+      p += GSS_MPEGTS_PACKET_SIZE;
+    }
+  }
+
+  return data;
+}
+
+/* Feeds data to a new scanner in buffers of buffer_size bytes, and
+ * returns the number of keyframes found.  Their offsets in data are
+ * stored in splits. */
+static int
+scan_in_buffers (GssMpegtsScanner * scanner, const guint8 * data, gsize size,
+    gsize buffer_size, gsize * splits, int max_splits)
+{
+  gsize start;
+  int n = 0;
+
+  gss_mpegts_scanner_init (scanner);
+  for (start = 0; start < size; start += buffer_size) {
+    gsize n_bytes = MIN (buffer_size, size - start);
+    gsize offset = 0;
+    gssize split;
+
+    while (gss_mpegts_scanner_scan (scanner, data + start, n_bytes, &offset,
+            &split)) {
+      fail_unless (n < max_splits);
+      splits[n++] = start + split;
+    }
+    fail_unless (offset == n_bytes);
+  }
+
+  return n;
+}
+
+GST_START_TEST (test_mpegts_packet_parse)
+{
+  guint8 data[GSS_MPEGTS_PACKET_SIZE];
+  GssMpegtsPacket packet;
+  guint64 pcr;
+
+  make_packet (data, 0x1abc, TRUE, FALSE, FALSE, 0);
+  fail_unless (gss_mpegts_packet_parse (data, &packet));
+  fail_unless_equals_int (packet.pid, 0x1abc);
+  fail_unless (packet.payload_unit_start);
+  fail_if (packet.random_access);
+  fail_if (packet.has_pcr);
+
+  make_packet (data, VIDEO_PID, FALSE, TRUE, FALSE, 0);
+  fail_unless (gss_mpegts_packet_parse (data, &packet));
+  fail_unless_equals_int (packet.pid, VIDEO_PID);
+  fail_if (packet.payload_unit_start);
+  fail_unless (packet.random_access);
+  fail_if (packet.has_pcr);
+
+  /* uses the top bit of the 33-bit base and the 9-bit extension */
+  pcr = ((G_GUINT64_CONSTANT (1) << 32) + 12345) * 300 + 299;
+  make_packet (data, VIDEO_PID, TRUE, TRUE, TRUE, pcr);
+  fail_unless (gss_mpegts_packet_parse (data, &packet));
+  fail_unless (packet.random_access);
+  fail_unless (packet.has_pcr);
+  fail_unless (packet.pcr == pcr);
+
+  data[0] = 0x48;
+  fail_if (gss_mpegts_packet_parse (data, &packet));
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_mpegts_psi)
+{
+  guint8 data[4 * GSS_MPEGTS_PACKET_SIZE];
+  GssMpegtsScanner scanner;
+  gsize offset;
+  gssize split;
+
+  make_pat (data, PMT_PID);
+  make_pmt (data + GSS_MPEGTS_PACKET_SIZE, PMT_PID, VIDEO_PID);
+  make_packet (data + 2 * GSS_MPEGTS_PACKET_SIZE, AUDIO_PID, TRUE, TRUE,
+      FALSE, 0);
+  make_packet (data + 3 * GSS_MPEGTS_PACKET_SIZE, VIDEO_PID, TRUE, TRUE,
+      TRUE, 1000);
+
+  gss_mpegts_scanner_init (&scanner);
+  offset = 0;
+  fail_unless (gss_mpegts_scanner_scan (&scanner, data, sizeof (data),
+          &offset, &split));
+  fail_unless_equals_int (scanner.pmt_pid, PMT_PID);
+  fail_unless_equals_int (scanner.video_pid, VIDEO_PID);
+  fail_unless_equals_int (scanner.pcr_pid, VIDEO_PID);
+
+  /* the audio keyframe is skipped */
+  fail_unless_equals_int (split, 3 * GSS_MPEGTS_PACKET_SIZE);
+  fail_unless_equals_int (offset, sizeof (data));
+  fail_unless (scanner.have_pcr);
+  fail_unless (scanner.pcr == 1000);
+  fail_unless (scanner.n_packets == 4);
+
+  fail_if (gss_mpegts_scanner_scan (&scanner, data, sizeof (data), &offset,
+          &split));
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_mpegts_buffer_boundaries)
+{
+  const gsize buffer_sizes[] = { 188, 188 * 7, 100, 187, 189, 1000, 4096, 1 };
+  GssMpegtsScanner scanner;
+  gsize splits[16];
+  guint8 *data;
+  gsize size;
+  guint i;
+
+  data = make_stream (10, 20, &size);
+
+  for (i = 0; i < G_N_ELEMENTS (buffer_sizes); i++) {
+    int n;
+    int j;
+
+    n = scan_in_buffers (&scanner, data, size, buffer_sizes[i], splits,
+        G_N_ELEMENTS (splits));
+    fail_unless_equals_int (n, 10);
+    for (j = 0; j < n; j++) {
+      fail_unless_equals_int (splits[j], (2 + j * 20) * GSS_MPEGTS_PACKET_SIZE);
+    }
+    fail_unless (scanner.n_packets == 2 + 10 * 20);
+    fail_unless (scanner.n_resyncs == 0);
+    fail_unless (scanner.pcr == 9 * (guint64) GSS_MPEGTS_PCR_CLOCK);
+  }
+
+  g_free (data);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_mpegts_resync)
+{
+  GssMpegtsScanner scanner;
+  gsize splits[16];
+  guint8 *data;
+  guint8 *garbled;
+  gsize size;
+  gsize garbage = 5;
+  gsize at = 3 * GSS_MPEGTS_PACKET_SIZE;
+  int n;
+
+  data = make_stream (4, 10, &size);
+
+  /* a few bytes of garbage between packets 3 and 4 */
+  garbled = g_malloc (size + garbage);
+  memcpy (garbled, data, at);
+  memset (garbled + at, 0x00, garbage);
+  memcpy (garbled + at + garbage, data + at, size - at);
+
+  n = scan_in_buffers (&scanner, garbled, size + garbage, size + garbage,
+      splits, G_N_ELEMENTS (splits));
+  fail_unless_equals_int (n, 4);
+  fail_unless_equals_int (splits[0], 2 * GSS_MPEGTS_PACKET_SIZE);
+  fail_unless_equals_int (splits[1], 12 * GSS_MPEGTS_PACKET_SIZE + garbage);
+  fail_unless (scanner.n_resyncs > 0);
+
+  /* the same, with the garbage at the end of a buffer */
+  n = scan_in_buffers (&scanner, garbled, size + garbage, at + 2, splits,
+      G_N_ELEMENTS (splits));
+  fail_unless_equals_int (n, 4);
+  fail_unless_equals_int (splits[1], 12 * GSS_MPEGTS_PACKET_SIZE + garbage);
+
+  g_free (garbled);
+  g_free (data);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_mpegts_pcr_elapsed)
+{
+  guint64 wrap = (G_GUINT64_CONSTANT (1) << 33) * 300;
+
+  fail_unless (gss_mpegts_pcr_elapsed (0, GSS_MPEGTS_PCR_CLOCK) == 1.0);
+  fail_unless (gss_mpegts_pcr_elapsed (GSS_MPEGTS_PCR_CLOCK,
+          3 * GSS_MPEGTS_PCR_CLOCK) == 2.0);
+  /* across the 33-bit wraparound of the PCR base */
+  fail_unless (gss_mpegts_pcr_elapsed (wrap - GSS_MPEGTS_PCR_CLOCK,
+          GSS_MPEGTS_PCR_CLOCK) == 2.0);
+}
+
+GST_END_TEST;
+
+static Suite *
+gss_mpegts_suite (void)
+{
+  Suite *s = suite_create ("GssMpegts");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_mpegts_packet_parse);
+  tcase_add_test (tc_chain, test_mpegts_psi);
+  tcase_add_test (tc_chain, test_mpegts_buffer_boundaries);
+  tcase_add_test (tc_chain, test_mpegts_resync);
+  tcase_add_test (tc_chain, test_mpegts_pcr_elapsed);
+
+  return s;
+}
+
+GST_CHECK_MAIN (gss_mpegts);
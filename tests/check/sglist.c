@@ -11,8 +11,78 @@
 #endif
 
 #include "gst-streaming-server/gss-sglist.h"
+#include "gst-streaming-server/gss-isom.h"
+#include "gst-streaming-server/gss-playready.h"
 #include <gst/check/gstcheck.h>
 
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#define TEST_FILE_SIZE (1 << 20)
+
+static guint8 *
+create_test_file (int *fd, char **filename)
+{
+  guint8 *data;
+  int i;
+
+  data = g_malloc (TEST_FILE_SIZE);
+  for (i = 0; i < TEST_FILE_SIZE; i++) {
+    data[i] = g_random_int ();
+  }
+
+  *fd = g_file_open_tmp ("gss-sglist-XXXXXX", filename, NULL);
+  fail_unless (*fd >= 0);
+  fail_unless (write (*fd, data, TEST_FILE_SIZE) == TEST_FILE_SIZE);
+
+  return data;
+}
+
+static void
+destroy_test_file (int fd, char *filename)
+{
+  close (fd);
+  g_unlink (filename);
+  g_free (filename);
+}
+
+/* Builds a list that looks like the video samples of a fragment:
+ * mostly back to back, with an audio chunk between some of them. */
+static GssSGList *
+create_fragment_sglist (int n_samples, gsize interleave_gap)
+{
+  GssSGList *sglist;
+  gsize offset = 4096;
+  int i;
+
+  sglist = gss_sglist_new (n_samples);
+  for (i = 0; i < n_samples; i++) {
+    sglist->chunks[i].offset = offset;
+    sglist->chunks[i].size = 1000 + g_random_int_range (0, 8000);
+    offset += sglist->chunks[i].size;
+    if (i % 5 == 4)
+      offset += interleave_gap;
+  }
+  fail_unless (offset <= TEST_FILE_SIZE);
+
+  return sglist;
+}
+
+static void
+check_sglist_data (GssSGList * sglist, const guint8 * data,
+    const guint8 * file_data)
+{
+  gsize offset = 0;
+  int i;
+
+  for (i = 0; i < sglist->n_chunks; i++) {
+    fail_unless (memcmp (data + offset, file_data + sglist->chunks[i].offset,
+            sglist->chunks[i].size) == 0);
+    offset += sglist->chunks[i].size;
+  }
+}
+
 GST_START_TEST (test_sglist)
 {
   GssSGList *sglist;
@@ -42,15 +112,369 @@ GST_START_TEST (test_sglist)
 
 GST_END_TEST;
 
+GST_START_TEST (test_sglist_compact)
+{
+  GssSGList *sglist;
+  gsize size;
+
+  /* 12 runs of 5 adjacent samples */
+  sglist = create_fragment_sglist (60, 3000);
+  size = gss_sglist_get_size (sglist);
+  gss_sglist_compact (sglist);
+  fail_unless_equals_int (sglist->n_chunks, 12);
+  fail_unless (gss_sglist_get_size (sglist) == size);
+  fail_unless (sglist->chunks[0].offset == 4096);
+  gss_sglist_free (sglist);
+
+  /* no gaps, and empty chunks */
+  sglist = create_fragment_sglist (60, 0);
+  sglist->chunks[0].size = 0;
+  sglist->chunks[59].size = 0;
+  size = gss_sglist_get_size (sglist);
+  gss_sglist_compact (sglist);
+  fail_unless_equals_int (sglist->n_chunks, 1);
+  fail_unless (sglist->chunks[0].size == size);
+  gss_sglist_free (sglist);
+
+  sglist = gss_sglist_new (3);
+  gss_sglist_compact (sglist);
+  fail_unless_equals_int (sglist->n_chunks, 1);
+  fail_unless (gss_sglist_get_size (sglist) == 0);
+  gss_sglist_free (sglist);
+}
+
+GST_END_TEST;
+
+/* Returns the file offset of byte @pos of the data described by
+ * @sglist. */
+static gsize
+get_file_offset (GssSGList * sglist, gsize pos)
+{
+  int i;
+
+  for (i = 0; i < sglist->n_chunks; i++) {
+    if (pos < sglist->chunks[i].size)
+      return sglist->chunks[i].offset + pos;
+    pos -= sglist->chunks[i].size;
+  }
+  fail_unless (FALSE);
+  return 0;
+}
+
+static GssSGList *
+check_slice (GssSGList * sglist, gsize start, gsize size)
+{
+  GssSGList *slice;
+  gsize i;
+
+  slice = gss_sglist_new_slice (sglist, start, size);
+  fail_unless (slice != NULL);
+  fail_unless (gss_sglist_get_size (slice) == size);
+  for (i = 0; i < slice->n_chunks; i++) {
+    fail_unless (slice->chunks[i].size > 0);
+  }
+  for (i = 0; i < size; i++) {
+    fail_unless (get_file_offset (slice, i) ==
+        get_file_offset (sglist, start + i));
+  }
+
+  return slice;
+}
+
+GST_START_TEST (test_sglist_slice)
+{
+  static const GssSGChunk chunks[] = {
+    {1000, 100}, {5000, 50}, {0, 0}, {8000, 1}, {9000, 200}
+  };
+  GssSGList *sglist;
+  GssSGList *slice;
+  gsize total;
+  gsize start;
+
+  sglist = gss_sglist_new (G_N_ELEMENTS (chunks));
+  memcpy (sglist->chunks, chunks, sizeof (chunks));
+  total = gss_sglist_get_size (sglist);
+
+  /* within one chunk */
+  slice = check_slice (sglist, 10, 20);
+  fail_unless_equals_int (slice->n_chunks, 1);
+  fail_unless (slice->chunks[0].offset == 1010);
+  gss_sglist_free (slice);
+
+  /* across chunks, skipping the empty one */
+  slice = check_slice (sglist, 90, 70);
+  fail_unless_equals_int (slice->n_chunks, 4);
+  fail_unless (slice->chunks[0].offset == 1090);
+  fail_unless (slice->chunks[0].size == 10);
+  fail_unless (slice->chunks[3].offset == 9000);
+  fail_unless (slice->chunks[3].size == 9);
+  gss_sglist_free (slice);
+
+  /* exactly one chunk */
+  slice = check_slice (sglist, 100, 50);
+  fail_unless_equals_int (slice->n_chunks, 1);
+  fail_unless (slice->chunks[0].offset == 5000);
+  gss_sglist_free (slice);
+
+  slice = check_slice (sglist, 150, 1);
+  fail_unless_equals_int (slice->n_chunks, 1);
+  fail_unless (slice->chunks[0].offset == 8000);
+  gss_sglist_free (slice);
+
+  /* ending and starting at chunk edges */
+  slice = check_slice (sglist, 0, 150);
+  fail_unless_equals_int (slice->n_chunks, 2);
+  gss_sglist_free (slice);
+
+  slice = check_slice (sglist, 150, total - 150);
+  fail_unless_equals_int (slice->n_chunks, 2);
+  gss_sglist_free (slice);
+
+  /* the full list */
+  slice = check_slice (sglist, 0, total);
+  fail_unless_equals_int (slice->n_chunks, 4);
+  gss_sglist_free (slice);
+
+  for (start = 0; start < total; start++) {
+    gss_sglist_free (check_slice (sglist, start, 1));
+    gss_sglist_free (check_slice (sglist, start, MIN (17, total - start)));
+    gss_sglist_free (check_slice (sglist, start, total - start));
+  }
+
+  gss_sglist_free (sglist);
+}
+
+GST_END_TEST;
+
+/* Builds the samples of a fragment, with sizes that are not multiples
+ * of the AES block size, and some that are smaller than the clear
+ * header of a video sample. */
+static GssIsomFragment *
+create_encrypted_fragment (int n_samples, gboolean is_video)
+{
+  GssIsomFragment *fragment;
+  guint64 *init_vectors;
+  int i;
+
+  fragment = gss_isom_fragment_new ();
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (n_samples * sizeof (GssBoxTrunSample));
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    if (i % 7 == 3) {
+      fragment->trun.samples[i].size = g_random_int_range (1, 48);
+    } else {
+      fragment->trun.samples[i].size = g_random_int_range (48, 20000);
+    }
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+  fragment->sglist = gss_sglist_new (1);
+
+  init_vectors = g_malloc (n_samples * sizeof (guint64));
+  for (i = 0; i < n_samples; i++) {
+    init_vectors[i] = ((guint64) g_random_int () << 32) | g_random_int ();
+  }
+  gss_isom_fragment_set_sample_encryption (fragment, n_samples,
+      init_vectors, is_video);
+  g_free (init_vectors);
+
+  return fragment;
+}
+
+static void
+check_encrypt_range (GssIsomFragment * fragment, const guint8 * clear,
+    const guint8 * encrypted, guint8 * key, guint64 start, guint64 size)
+{
+  guint8 *data;
+
+  data = g_malloc (size);
+  memcpy (data, clear + 8 + start, size);
+  gss_playready_encrypt_range (fragment, data, start, size, key);
+  fail_unless (memcmp (data, encrypted + 8 + start, size) == 0,
+      "range %" G_GUINT64_FORMAT "+%" G_GUINT64_FORMAT " differs",
+      start, size);
+  g_free (data);
+}
+
+static void
+check_encrypt_fragment (int n_samples, gboolean is_video)
+{
+  GssIsomFragment *fragment;
+  guint8 *clear;
+  guint8 *encrypted;
+  guint8 key[16];
+  guint64 size;
+  guint64 start;
+  int i;
+
+  fragment = create_encrypted_fragment (n_samples, is_video);
+  size = fragment->mdat_size - 8;
+  for (i = 0; i < 16; i++) {
+    key[i] = g_random_int ();
+  }
+
+  clear = g_malloc (fragment->mdat_size);
+  for (i = 0; i < fragment->mdat_size; i++) {
+    clear[i] = g_random_int ();
+  }
+  encrypted = g_malloc (fragment->mdat_size);
+  memcpy (encrypted, clear, fragment->mdat_size);
+  gss_playready_encrypt_samples (fragment, encrypted, key);
+  fail_if (memcmp (clear + 8, encrypted + 8, size) == 0);
+
+  check_encrypt_range (fragment, clear, encrypted, key, 0, size);
+
+  /* ranges starting and ending at and around sample edges, inside
+   * clear headers, and mid AES block */
+  start = 0;
+  for (i = 0; i < n_samples; i++) {
+    guint64 sample_size = fragment->trun.samples[i].size;
+    guint64 s;
+
+    for (s = MAX (start, 1) - 1; s <= start + 49 && s < size; s += 7) {
+      check_encrypt_range (fragment, clear, encrypted, key, s, 1);
+      check_encrypt_range (fragment, clear, encrypted, key, s,
+          MIN (sample_size, size - s));
+    }
+    start += sample_size;
+  }
+
+  for (i = 0; i < 100; i++) {
+    start = g_random_int_range (0, size);
+    check_encrypt_range (fragment, clear, encrypted, key, start,
+        g_random_int_range (1, size - start + 1));
+    check_encrypt_range (fragment, clear, encrypted, key, start, size - start);
+  }
+
+  g_free (clear);
+  g_free (encrypted);
+  gss_isom_fragment_free (fragment);
+}
+
+GST_START_TEST (test_playready_encrypt_range)
+{
+  /* subsample encryption with clear headers */
+  check_encrypt_fragment (60, TRUE);
+  /* whole samples */
+  check_encrypt_fragment (60, FALSE);
+  /* large enough to be encrypted in pieces by several threads */
+  check_encrypt_fragment (200, TRUE);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_sglist_load)
+{
+  GssSGList *sglist;
+  guint8 *file_data;
+  guint8 *data;
+  char *filename;
+  int n_reads;
+  int fd;
+
+  file_data = create_test_file (&fd, &filename);
+
+  sglist = create_fragment_sglist (60, 3000);
+  data = g_malloc (gss_sglist_get_size (sglist));
+
+  /* adjacent chunks are read together */
+  n_reads = 0;
+  fail_unless (gss_sglist_load_full (sglist, fd, data, 0, &n_reads, NULL));
+  check_sglist_data (sglist, data, file_data);
+  fail_unless_equals_int (n_reads, 12);
+
+  /* small holes are read through */
+  memset (data, 0, gss_sglist_get_size (sglist));
+  n_reads = 0;
+  fail_unless (gss_sglist_load_full (sglist, fd, data, 4096, &n_reads, NULL));
+  check_sglist_data (sglist, data, file_data);
+  fail_unless_equals_int (n_reads, 1);
+
+  /* chunks out of file order, and empty chunks */
+  sglist->chunks[10].offset = 0;
+  sglist->chunks[20].size = 0;
+  memset (data, 0, gss_sglist_get_size (sglist));
+  fail_unless (gss_sglist_load (sglist, fd, data, NULL));
+  check_sglist_data (sglist, data, file_data);
+
+  /* reading past the end of the file */
+  sglist->chunks[30].offset = TEST_FILE_SIZE - 10;
+  fail_if (gss_sglist_load (sglist, fd, data, NULL));
+
+  g_free (data);
+  gss_sglist_free (sglist);
+  g_free (file_data);
+  destroy_test_file (fd, filename);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_sglist_load_benchmark)
+{
+  GssSGList *sglist;
+  guint8 *file_data;
+  guint8 *data;
+  char *filename;
+  GTimer *timer;
+  int n_reads;
+  int fd;
+  guint i;
+  const int n_iterations = 1000;
+  const gsize max_gaps[] = { 0, 1024, GSS_SGLIST_DEFAULT_MAX_GAP };
+
+  file_data = create_test_file (&fd, &filename);
+  sglist = create_fragment_sglist (60, 6000);
+  data = g_malloc (gss_sglist_get_size (sglist));
+  timer = g_timer_new ();
+
+  /* before: one lseek() and one read() per chunk */
+  g_print ("%d chunks, lseek+read: %d syscalls\n", sglist->n_chunks,
+      sglist->n_chunks * 2);
+
+  for (i = 0; i < G_N_ELEMENTS (max_gaps); i++) {
+    int j;
+
+    n_reads = 0;
+    g_timer_start (timer);
+    for (j = 0; j < n_iterations; j++) {
+      fail_unless (gss_sglist_load_full (sglist, fd, data, max_gaps[i],
+              &n_reads, NULL));
+    }
+    g_timer_stop (timer);
+    check_sglist_data (sglist, data, file_data);
+
+    g_print ("%d chunks, preadv, max gap %" G_GSIZE_FORMAT ": %d syscalls, "
+        "%.1f us\n", sglist->n_chunks, max_gaps[i], n_reads / n_iterations,
+        g_timer_elapsed (timer, NULL) * 1e6 / n_iterations);
+  }
+
+  g_timer_destroy (timer);
+  g_free (data);
+  gss_sglist_free (sglist);
+  g_free (file_data);
+  destroy_test_file (fd, filename);
+}
+
+GST_END_TEST;
+
 
 static Suite *
 gss_sglist_suite (void)
 {
   Suite *s = suite_create ("GssSGList");
   TCase *tc_chain = tcase_create ("general");
+  TCase *tc_bench = tcase_create ("benchmark");
 
   suite_add_tcase (s, tc_chain);
   tcase_add_test (tc_chain, test_sglist);
+  tcase_add_test (tc_chain, test_sglist_compact);
+  tcase_add_test (tc_chain, test_sglist_slice);
+  tcase_add_test (tc_chain, test_playready_encrypt_range);
+  tcase_add_test (tc_chain, test_sglist_load);
+
+  suite_add_tcase (s, tc_bench);
+  tcase_set_timeout (tc_bench, 60);
+  tcase_add_test (tc_bench, test_sglist_load_benchmark);
 
   return s;
 }
@@ -0,0 +1,300 @@
+
+
+#include "config.h"
+
+#include <gst-streaming-server/gss-server.h>
+#include <gst-streaming-server/gss-utils.h>
+#include <gst-streaming-server/gss-isom.h>
+#include <gst-streaming-server/gss-playready.h>
+
+#include <openssl/evp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+
+gboolean verbose = FALSE;
+gboolean hls_aes = FALSE;
+gboolean fragment_lookup = FALSE;
+gboolean playready = FALSE;
+int n_fragments = 10000;
+int segment_size = 2 * 1024 * 1024;
+int fragment_size = 4 * 1024 * 1024;
+int bench_time = 1000;
+
+static GOptionEntry entries[] = {
+  {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
+  {"hls-aes", 0, 0, G_OPTION_ARG_NONE, &hls_aes,
+      "Benchmark HLS AES-128 segment encryption", NULL},
+  {"segment-size", 0, 0, G_OPTION_ARG_INT, &segment_size,
+      "Size of HLS segments (default 2 MB)", "BYTES"},
+  {"fragment-lookup", 0, 0, G_OPTION_ARG_NONE, &fragment_lookup,
+      "Benchmark looking up fragments by timestamp", NULL},
+  {"n-fragments", 0, 0, G_OPTION_ARG_INT, &n_fragments,
+      "Number of fragments per track (default 10000)", "N"},
+  {"playready", 0, 0, G_OPTION_ARG_NONE, &playready,
+      "Benchmark PlayReady/CENC fragment encryption", NULL},
+  {"fragment-size", 0, 0, G_OPTION_ARG_INT, &fragment_size,
+      "Size of video fragments (default 4 MB)", "BYTES"},
+  {"time", 't', 0, G_OPTION_ARG_INT, &bench_time,
+      "Time to run each benchmark (default 1000 ms)", "MSEC"},
+  {NULL}
+};
+
+static void
+bench_hls_aes (void)
+{
+  guint8 key[16];
+  guint8 *data;
+  gint64 start;
+  gint64 elapsed;
+  int n;
+
+  data = g_malloc (segment_size + 16);
+  memset (data, 0x47, segment_size);
+  gss_utils_get_random_bytes (key, 16);
+
+  n = 0;
+  start = g_get_monotonic_time ();
+  do {
+    gss_hls_encrypt_segment (data, segment_size, key, n);
+    n++;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < bench_time * 1000);
+
+  g_print ("hls-aes: %d segments of %d bytes in %" G_GINT64_FORMAT " us, "
+      "%.1f MB/s per core\n", n, segment_size, elapsed,
+      (double) n * segment_size / elapsed);
+
+  g_free (data);
+}
+
+/* what gss_isom_track_get_fragment_by_timestamp() used to do */
+static GssIsomFragment *
+linear_get_fragment_by_timestamp (GssIsomTrack * track, guint64 timestamp)
+{
+  int i;
+
+  for (i = 0; i < track->n_fragments; i++) {
+    if (track->fragments[i]->timestamp == timestamp) {
+      return track->fragments[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void
+bench_fragment_lookup_run (GssIsomTrack * track, const char *name,
+    GssIsomFragment * (*lookup) (GssIsomTrack *, guint64))
+{
+  gint64 start;
+  gint64 elapsed;
+  int n;
+
+  n = 0;
+  start = g_get_monotonic_time ();
+  do {
+    int i;
+
+    /* a batch of random lookups, as from many clients */
+    for (i = 0; i < 1000; i++) {
+      GssIsomFragment *fragment = track->fragments[g_random_int_range (0,
+              track->n_fragments)];
+
+      if (lookup (track, fragment->timestamp) != fragment) {
+        g_print ("fragment-lookup: %s returned the wrong fragment\n", name);
+        return;
+      }
+    }
+    n += i;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < bench_time * 1000);
+
+  g_print ("fragment-lookup: %s, %d fragments: %.3f us per lookup\n",
+      name, track->n_fragments, (double) elapsed / n);
+}
+
+static void
+bench_fragment_lookup (void)
+{
+  GssIsomTrack *track;
+  guint64 timestamp = 0;
+  int i;
+
+  track = gss_isom_track_new ();
+  track->n_fragments = n_fragments;
+  track->n_fragments_alloc = n_fragments;
+  track->fragments = g_malloc (n_fragments * sizeof (GssIsomFragment *));
+  for (i = 0; i < n_fragments; i++) {
+    GssIsomFragment *fragment = gss_isom_fragment_new ();
+
+    /* 2 second fragments, with some jitter as from real encoders */
+    fragment->timestamp = timestamp;
+    fragment->duration = 20000000 + g_random_int_range (-10000, 10000);
+    fragment->index = i;
+    fragment->sglist = gss_sglist_new (1);
+    track->fragments[i] = fragment;
+    timestamp += fragment->duration;
+  }
+
+  bench_fragment_lookup_run (track, "linear scan",
+      linear_get_fragment_by_timestamp);
+  bench_fragment_lookup_run (track, "binary search",
+      gss_isom_track_get_fragment_by_timestamp);
+
+  gss_isom_track_free (track);
+}
+
+/* what gss_playready_encrypt_samples() used to do: a new key schedule
+ * for every sample */
+static void
+per_sample_encrypt_samples (GssIsomFragment * fragment, guint8 * mdat_data,
+    guint8 * content_key)
+{
+  GssBoxTrun *trun = &fragment->trun;
+  GssBoxUUIDSampleEncryption *se = &fragment->sample_encryption;
+  guint64 sample_offset = 8;
+  EVP_CIPHER_CTX *ctx;
+  int i;
+
+  ctx = EVP_CIPHER_CTX_new ();
+  for (i = 0; i < trun->sample_count; i++) {
+    unsigned char raw_iv[16];
+    guint64 offset = sample_offset;
+    int len;
+    int j;
+
+    memset (raw_iv, 0, 16);
+    GST_WRITE_UINT64_BE (raw_iv, se->samples[i].iv);
+    EVP_EncryptInit_ex (ctx, EVP_aes_128_ctr (), NULL, content_key, raw_iv);
+    for (j = 0; j < se->samples[i].num_entries; j++) {
+      offset += se->samples[i].entries[j].bytes_of_clear_data;
+      EVP_EncryptUpdate (ctx, mdat_data + offset, &len, mdat_data + offset,
+          se->samples[i].entries[j].bytes_of_encrypted_data);
+      offset += se->samples[i].entries[j].bytes_of_encrypted_data;
+    }
+    sample_offset += trun->samples[i].size;
+  }
+  EVP_CIPHER_CTX_free (ctx);
+}
+
+static void
+single_thread_encrypt_samples (GssIsomFragment * fragment,
+    guint8 * mdat_data, guint8 * content_key)
+{
+  gss_playready_encrypt_range (fragment, mdat_data + 8, 0,
+      fragment->mdat_size - 8, content_key);
+}
+
+static void
+bench_playready_run (GssIsomFragment * fragment, guint8 * data,
+    guint8 * key, const char *name,
+    void (*encrypt) (GssIsomFragment *, guint8 *, guint8 *))
+{
+  gint64 start;
+  gint64 elapsed;
+  int n;
+
+  n = 0;
+  start = g_get_monotonic_time ();
+  do {
+    encrypt (fragment, data, key);
+    n++;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < bench_time * 1000);
+
+  g_print ("playready: %s, %d byte fragments: %.2f GB/s\n", name,
+      fragment->mdat_size, (double) n * fragment->mdat_size / elapsed / 1000);
+}
+
+static void
+bench_playready (void)
+{
+  GssIsomFragment *fragment;
+  guint64 *init_vectors;
+  guint8 key[16];
+  guint8 *data;
+  guint8 *check;
+  int n_samples = 60;
+  int i;
+
+  /* 2 seconds of 30 fps video, one large key frame */
+  fragment = gss_isom_fragment_new ();
+  fragment->trun.sample_count = n_samples;
+  fragment->trun.samples = g_malloc0 (n_samples * sizeof (GssBoxTrunSample));
+  fragment->trun.samples[0].size = fragment_size / 4;
+  for (i = 1; i < n_samples; i++) {
+    fragment->trun.samples[i].size = (fragment_size - fragment_size / 4) /
+        (n_samples - 1);
+  }
+  fragment->mdat_size = 8;
+  for (i = 0; i < n_samples; i++) {
+    fragment->mdat_size += fragment->trun.samples[i].size;
+  }
+  fragment->sglist = gss_sglist_new (1);
+
+  init_vectors = g_malloc (n_samples * sizeof (guint64));
+  for (i = 0; i < n_samples; i++) {
+    init_vectors[i] = g_random_int ();
+  }
+  gss_isom_fragment_set_sample_encryption (fragment, n_samples,
+      init_vectors, TRUE);
+  g_free (init_vectors);
+
+  gss_utils_get_random_bytes (key, 16);
+  data = g_malloc (fragment->mdat_size);
+  check = g_malloc (fragment->mdat_size);
+  gss_utils_get_random_bytes (data, fragment->mdat_size);
+  memcpy (check, data, fragment->mdat_size);
+
+  per_sample_encrypt_samples (fragment, check, key);
+  gss_playready_encrypt_samples (fragment, data, key);
+  if (memcmp (data, check, fragment->mdat_size) != 0) {
+    g_print ("playready: encrypted data does not match\n");
+  } else {
+    bench_playready_run (fragment, data, key, "key setup per sample, "
+        "1 thread", per_sample_encrypt_samples);
+    bench_playready_run (fragment, data, key, "key setup per fragment, "
+        "1 thread", single_thread_encrypt_samples);
+    bench_playready_run (fragment, data, key, "key setup per fragment, "
+        "parallel", gss_playready_encrypt_samples);
+  }
+
+  g_free (data);
+  g_free (check);
+  gss_isom_fragment_free (fragment);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  gboolean all;
+
+  context = g_option_context_new ("- micro-benchmarks");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  all = !hls_aes && !fragment_lookup && !playready;
+
+  if (all || hls_aes) {
+    bench_hls_aes ();
+  }
+  if (all || fragment_lookup) {
+    bench_fragment_lookup ();
+  }
+  if (all || playready) {
+    bench_playready ();
+  }
+
+  return 0;
+}
@@ -4,21 +4,46 @@
 #include <gst-streaming-server/gss-isom.h>
 
 #include <stdio.h>
+#include <unistd.h>
 
 
 
 gboolean verbose = FALSE;
 gboolean dump = FALSE;
 gboolean fragment = FALSE;
+gboolean use_mmap = FALSE;
+gboolean stats = FALSE;
 
 static GOptionEntry entries[] = {
   {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
   {"dump", 'd', 0, G_OPTION_ARG_NONE, &dump, "Dump file to readable output",
       NULL},
   {"fragment", 'd', 0, G_OPTION_ARG_NONE, &fragment, "Fragment file", NULL},
+  {"mmap", 'm', 0, G_OPTION_ARG_NONE, &use_mmap, "Parse the file in place "
+        "with mmap", NULL},
+  {"stats", 's', 0, G_OPTION_ARG_NONE, &stats, "Print parse time and "
+        "memory use", NULL},
   {NULL}
 };
 
+/* resident set size of the process, in bytes */
+static gsize
+get_rss (void)
+{
+  char *contents;
+  gsize rss = 0;
+
+  if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL)) {
+    unsigned long pages = 0;
+
+    sscanf (contents, "%*lu %lu", &pages);
+    rss = pages * sysconf (_SC_PAGESIZE);
+    g_free (contents);
+  }
+
+  return rss;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -45,14 +70,26 @@ main (int argc, char *argv[])
     gboolean ret;
     guint8 *data;
     int size;
+    gint64 start;
+    gsize rss;
 
     file = gss_isom_parser_new ();
+    file->use_mmap = use_mmap;
 
+    rss = get_rss ();
+    start = g_get_monotonic_time ();
     ret = gss_isom_parser_parse_file (file, argv[i]);
     if (!ret) {
       g_print ("parse failed");
       continue;
     }
+    if (stats) {
+      g_print ("%s: parsed in %.1f ms%s, RSS %+" G_GSSIZE_FORMAT " kB, "
+          "parser %" G_GSIZE_FORMAT " kB\n", argv[i],
+          (g_get_monotonic_time () - start) / 1000.0,
+          use_mmap ? " (mmap)" : "", (gssize) (get_rss () - rss) / 1024,
+          gss_isom_parser_get_memory_size (file) / 1024);
+    }
 
     if (dump) {
       gss_isom_parser_dump (file);